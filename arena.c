@@ -0,0 +1,59 @@
+#include "chibicc.h"
+
+// Tokens, nodes, types and objects are allocated by the millions and
+// are never freed individually, so instead of calling calloc for each
+// of them, we carve them out of large zero-cleared chunks. Each kind
+// of object has its own arena so that objects of the same kind, which
+// are usually visited in allocation order, are packed together.
+
+#define CHUNK_SIZE (1024 * 1024)
+
+struct ArenaChunk {
+  ArenaChunk *next;
+  _Alignas(16) char data[];
+};
+
+Arena token_arena;
+Arena node_arena;
+Arena type_arena;
+Arena obj_arena;
+
+// Returns a zero-cleared, 16-byte aligned block of memory.
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+
+  if (arena->end - arena->ptr < size) {
+    size_t len = MAX(CHUNK_SIZE, sizeof(ArenaChunk) + size);
+    ArenaChunk *chunk = calloc(1, len);
+    if (!chunk)
+      error("out of memory");
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->ptr = chunk->data;
+    arena->end = (char *)chunk + len;
+  }
+
+  void *p = arena->ptr;
+  arena->ptr += size;
+  return p;
+}
+
+// Frees everything allocated from a given arena at once. Used for
+// objects that die at the end of a compiler phase.
+void arena_release(Arena *arena) {
+  ArenaChunk *chunk = arena->chunks;
+  while (chunk) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  *arena = (Arena){};
+}
+
+// Exchanges two arenas. Used to allocate objects that outlive their
+// compiler phase from a different arena for a while.
+void swap_arenas(Arena *a, Arena *b) {
+  Arena tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
@@ -0,0 +1,30 @@
+// CRC-16 and Fletcher-16 checksums over a fixed buffer
+// exit: 146
+#include <stdint.h>
+
+static uint8_t buf[64];
+
+static uint16_t crc16(const uint8_t *p, int n) {
+  uint16_t crc = 0xffff;
+  for (int i = 0; i < n; i++) {
+    crc ^= p[i];
+    for (int j = 0; j < 8; j++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+  }
+  return crc;
+}
+
+static uint16_t fletcher16(const uint8_t *p, int n) {
+  uint16_t a = 0, b = 0;
+  for (int i = 0; i < n; i++) {
+    a = (a + p[i]) % 255;
+    b = (b + a) % 255;
+  }
+  return b << 8 | a;
+}
+
+int main(void) {
+  for (int i = 0; i < 64; i++)
+    buf[i] = i * 7 + 3;
+  return (crc16(buf, 64) ^ fletcher16(buf, 64)) & 0xff;
+}
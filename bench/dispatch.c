@@ -0,0 +1,51 @@
+// Switch-based bytecode interpreter
+// exit: 169
+#include <stdint.h>
+
+enum { OP_PUSH, OP_ADD, OP_SUB, OP_MUL, OP_DUP, OP_SWAP, OP_JNZ, OP_DEC, OP_HALT };
+
+static const uint8_t code[] = {
+  OP_PUSH, 1,
+  OP_PUSH, 10,
+  OP_SWAP,
+  OP_PUSH, 3, OP_MUL,
+  OP_SWAP, OP_DEC, OP_DUP, OP_JNZ, 4,
+  OP_ADD,
+  OP_HALT,
+};
+
+static int stack[16];
+
+static int run(const uint8_t *pc0) {
+  int sp = 0;
+  int pc = 0;
+  for (;;) {
+    int op = pc0[pc++];
+    switch (op) {
+    case OP_PUSH: stack[sp++] = pc0[pc++]; break;
+    case OP_ADD: sp--; stack[sp - 1] += stack[sp]; break;
+    case OP_SUB: sp--; stack[sp - 1] -= stack[sp]; break;
+    case OP_MUL: sp--; stack[sp - 1] *= stack[sp]; break;
+    case OP_DUP: stack[sp] = stack[sp - 1]; sp++; break;
+    case OP_SWAP: {
+      int t = stack[sp - 1];
+      stack[sp - 1] = stack[sp - 2];
+      stack[sp - 2] = t;
+      break;
+    }
+    case OP_JNZ:
+      if (stack[--sp])
+        pc = pc0[pc];
+      else
+        pc++;
+      break;
+    case OP_DEC: stack[sp - 1]--; break;
+    case OP_HALT: return stack[sp - 1];
+    default: return -1;
+    }
+  }
+}
+
+int main(void) {
+  return run(code) & 0xff;
+}
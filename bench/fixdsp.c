@@ -0,0 +1,40 @@
+// Q15 fixed-point FIR filter and moving average
+// exit: 184
+#include <stdint.h>
+
+#define NTAPS 8
+#define NSAMPLES 32
+
+static const int16_t taps[NTAPS] = {
+  1024, 2048, 4096, 8192, 8192, 4096, 2048, 1024,
+};
+
+static int16_t input[NSAMPLES];
+static int16_t output[NSAMPLES];
+
+static int16_t mul_q15(int16_t a, int16_t b) {
+  return (int16_t)(((long)a * b) >> 15);
+}
+
+static void fir(const int16_t *in, int16_t *out, int n) {
+  for (int i = NTAPS - 1; i < n; i++) {
+    long acc = 0;
+    for (int j = 0; j < NTAPS; j++)
+      acc += mul_q15(in[i - j], taps[j]);
+    out[i] = acc > 32767 ? 32767 : acc < -32768 ? -32768 : acc;
+  }
+}
+
+static int16_t moving_average(const int16_t *in, int n) {
+  long sum = 0;
+  for (int i = 0; i < n; i++)
+    sum += in[i];
+  return sum / n;
+}
+
+int main(void) {
+  for (int i = 0; i < NSAMPLES; i++)
+    input[i] = (i & 1) ? 12000 : -8000;
+  fir(input, output, NSAMPLES);
+  return moving_average(output, NSAMPLES) & 0xff;
+}
@@ -0,0 +1,67 @@
+// Struct-heavy parser for a small binary message format
+// exit: 160
+#include <stdint.h>
+
+struct header {
+  uint8_t version;
+  uint8_t kind;
+  uint16_t length;
+};
+
+struct field {
+  uint8_t tag;
+  uint8_t size;
+  uint16_t value;
+};
+
+struct message {
+  struct header hdr;
+  struct field fields[8];
+  int nfields;
+  int errors;
+};
+
+static const uint8_t wire[] = {
+  1, 3, 16, 0,
+  1, 2, 0x34, 0x12,
+  2, 1, 0x7f, 0,
+  3, 2, 0xcd, 0xab,
+  4, 1, 0x01, 0,
+};
+
+static struct message msg;
+
+static int parse_header(struct header *h, const uint8_t *p) {
+  h->version = p[0];
+  h->kind = p[1];
+  h->length = p[2] | p[3] << 8;
+  return h->version == 1;
+}
+
+static void parse_field(struct field *f, const uint8_t *p) {
+  f->tag = p[0];
+  f->size = p[1];
+  f->value = (f->size == 2) ? (p[2] | p[3] << 8) : p[2];
+}
+
+static int parse(struct message *m, const uint8_t *p, int len) {
+  if (!parse_header(&m->hdr, p))
+    return -1;
+  m->nfields = 0;
+  for (int off = 4; off + 4 <= len && m->nfields < 8; off += 4)
+    parse_field(&m->fields[m->nfields++], p + off);
+  return m->nfields;
+}
+
+static int checksum(struct message *m) {
+  int sum = m->hdr.kind;
+  for (int i = 0; i < m->nfields; i++)
+    sum += m->fields[i].tag * m->fields[i].value;
+  return sum;
+}
+
+int main(void) {
+  if (parse(&msg, wire, sizeof(wire)) < 0)
+    return 1;
+  return checksum(&msg) & 0xff;
+}
@@ -0,0 +1,28 @@
+// Recursive algorithms: Fibonacci, Ackermann and Towers of Hanoi
+// exit: 93
+static int fib(int n) {
+  return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+static int ackermann(int m, int n) {
+  if (m == 0)
+    return n + 1;
+  if (n == 0)
+    return ackermann(m - 1, 1);
+  return ackermann(m - 1, ackermann(m, n - 1));
+}
+
+static int moves;
+
+static void hanoi(int n, int from, int to, int via) {
+  if (n == 0)
+    return;
+  hanoi(n - 1, from, via, to);
+  moves++;
+  hanoi(n - 1, via, to, from);
+}
+
+int main(void) {
+  hanoi(5, 0, 2, 1);
+  return fib(10) + ackermann(2, 2) + moves;
+}
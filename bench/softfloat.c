@@ -0,0 +1,28 @@
+// Single-precision math through the soft-float runtime
+// skip: needs the soft-float runtime (__addsf3 and friends), which
+// is not part of this repository. It should exit with 1.
+static float poly(float x) {
+  return ((0.5f * x + 1.25f) * x - 3.0f) * x + 2.0f;
+}
+
+static float newton_sqrt(float x) {
+  float r = x;
+  for (int i = 0; i < 8; i++)
+    r = 0.5f * (r + x / r);
+  return r;
+}
+
+static float dot(const float *a, const float *b, int n) {
+  float sum = 0;
+  for (int i = 0; i < n; i++)
+    sum = sum + a[i] * b[i];
+  return sum;
+}
+
+static float va[4] = {1.0f, 2.0f, 3.0f, 4.0f};
+static float vb[4] = {0.5f, 0.25f, 0.125f, 0.0625f};
+
+int main(void) {
+  float x = poly(1.5f) + newton_sqrt(2.0f) + dot(va, vb, 4);
+  return x > 4.0f;
+}
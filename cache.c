@@ -0,0 +1,550 @@
+// This file implements a compile cache similar to ccache.
+//
+// If CHIBICC_CACHE is set to a directory, the assembly generated for
+// a translation unit is stored there under a hash of everything it
+// depends on: the preprocessed tokens, the names and contents of the
+// files that were read (they determine the line numbers in the
+// output), the options that affect code generation and the compiler
+// binary itself. When the same translation unit is compiled again,
+// its assembly is copied from the cache, and parsing and code
+// generation are skipped.
+//
+// The cache is trimmed in least-recently-used order when it grows
+// beyond CHIBICC_CACHE_SIZE bytes (a K, M or G suffix may be given;
+// the default is 1G). The modification time of an entry is updated
+// when it is used. The number of hits and misses and the total size
+// of the entries are kept in a "stats" file, which is locked while it
+// is updated because parallel compiles share the cache.
+//
+// When a translation unit misses the cache, the code of its functions
+// may still be there. Each function is keyed by the tokens of its
+// body and by the tokens of all declarations of the translation unit,
+// that is, everything outside function bodies. When one function is
+// edited, only that function goes through code generation again. The
+// code of the functions of the last compile of a source file is kept
+// in a sidecar file next to the other entries.
+
+#include "chibicc.h"
+
+#define CACHE_VERSION "chibicc-cache-1"
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t size;
+  uint64_t fn_hits;
+  uint64_t fn_misses;
+} CacheStats;
+
+// Two FNV-1a hashes with different offsets and multipliers give a
+// 128-bit key.
+typedef struct {
+  uint64_t h1;
+  uint64_t h2;
+} Hash;
+
+static void hash_bytes(Hash *h, void *p, size_t len) {
+  unsigned char *s = p;
+  for (size_t i = 0; i < len; i++) {
+    h->h1 = (h->h1 ^ s[i]) * 0x100000001b3;
+    h->h2 = (h->h2 ^ s[i]) * 0x9e3779b97f4a7c15;
+  }
+}
+
+static void hash_u64(Hash *h, uint64_t val) {
+  hash_bytes(h, &val, sizeof(val));
+}
+
+// Strings are prefixed with their length so that the boundaries
+// between fields are part of the hash.
+static void hash_str(Hash *h, char *s, size_t len) {
+  hash_u64(h, len);
+  hash_bytes(h, s, len);
+}
+
+static void hash_token(Hash *h, Token *tok) {
+  hash_u64(h, tok->kind);
+  if (tok->kind == TK_STR) {
+    hash_str(h, tok->str, tok->ty->size);
+    hash_u64(h, tok->ty->base->size);
+    hash_u64(h, tok->ty->base->is_unsigned);
+  } else {
+    hash_str(h, tok->loc, tok->len);
+  }
+}
+
+static char *cache_dir(void) {
+  char *dir = getenv("CHIBICC_CACHE");
+  return (dir && *dir) ? dir : NULL;
+}
+
+static uint64_t cache_limit(void) {
+  char *s = getenv("CHIBICC_CACHE_SIZE");
+  if (!s || !*s)
+    return 1ULL << 30;
+
+  char *end;
+  uint64_t val = strtoull(s, &end, 10);
+  switch (*end) {
+  case 'k': case 'K': return val << 10;
+  case 'm': case 'M': return val << 20;
+  case 'g': case 'G': return val << 30;
+  }
+  return val;
+}
+
+static char *read_whole_file(char *path, size_t *len) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+
+  char *buf;
+  FILE *out = open_memstream(&buf, len);
+  char buf2[4096];
+  for (;;) {
+    size_t n = fread(buf2, 1, sizeof(buf2), fp);
+    if (n == 0)
+      break;
+    fwrite(buf2, 1, n, out);
+  }
+  fclose(fp);
+  fclose(out);
+  return buf;
+}
+
+// Copies a file by writing a temporary file next to the destination
+// and renaming it, so that a reader never sees a partial file.
+static bool copy_file(char *src, char *dst) {
+  size_t len;
+  char *buf = read_whole_file(src, &len);
+  if (!buf)
+    return false;
+
+  char *tmp = format("%s.%d.tmp", dst, getpid());
+  FILE *fp = fopen(tmp, "w");
+  if (!fp) {
+    free(buf);
+    return false;
+  }
+
+  bool ok = fwrite(buf, 1, len, fp) == len;
+  ok = !fclose(fp) && ok;
+  free(buf);
+
+  if (!ok || rename(tmp, dst)) {
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+// Calls fn with the stats locked. The stats file is created if it
+// doesn't exist.
+static void update_stats(char *dir, void (*fn)(char *dir, CacheStats *st)) {
+  int fd = open(format("%s/stats", dir), O_RDWR | O_CREAT, 0666);
+  if (fd == -1)
+    return;
+
+  struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+  if (fcntl(fd, F_SETLKW, &lock) == -1) {
+    close(fd);
+    return;
+  }
+
+  CacheStats st = {};
+  if (pread(fd, &st, sizeof(st), 0) != sizeof(st))
+    st = (CacheStats){};
+  fn(dir, &st);
+  if (pwrite(fd, &st, sizeof(st), 0) != sizeof(st))
+    ftruncate(fd, 0);
+  close(fd);
+}
+
+static void count_hit(char *dir, CacheStats *st) {
+  st->hits++;
+}
+
+static void count_miss(char *dir, CacheStats *st) {
+  st->misses++;
+}
+
+typedef struct {
+  char *path;
+  time_t mtime;
+  off_t size;
+} CacheEntry;
+
+static int compare_entries(const void *a, const void *b) {
+  const CacheEntry *x = a;
+  const CacheEntry *y = b;
+  return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// Returns the entries in a cache directory, oldest first.
+static CacheEntry *read_entries(char *dir, int *len) {
+  CacheEntry *arr = NULL;
+  int cap = 0;
+  *len = 0;
+
+  DIR *dp = opendir(dir);
+  if (!dp)
+    return NULL;
+
+  for (struct dirent *ent; (ent = readdir(dp));) {
+    char *ext = strrchr(ent->d_name, '.');
+    if (!ext || (strcmp(ext, ".s") && strcmp(ext, ".fn")))
+      continue;
+
+    struct stat st;
+    char *path = format("%s/%s", dir, ent->d_name);
+    if (stat(path, &st))
+      continue;
+
+    if (*len == cap) {
+      cap = cap ? cap * 2 : 64;
+      arr = realloc(arr, sizeof(CacheEntry) * cap);
+    }
+    arr[(*len)++] = (CacheEntry){path, st.st_mtim.tv_sec, st.st_size};
+  }
+  closedir(dp);
+
+  qsort(arr, *len, sizeof(CacheEntry), compare_entries);
+  return arr;
+}
+
+// Removes the least recently used entries until the cache is 10%
+// below its limit. The total size is recomputed from the entries
+// because other processes may have trimmed the cache concurrently.
+static void trim_cache(char *dir, CacheStats *st) {
+  uint64_t limit = cache_limit();
+  if (st->size <= limit)
+    return;
+
+  int len;
+  CacheEntry *arr = read_entries(dir, &len);
+
+  st->size = 0;
+  for (int i = 0; i < len; i++)
+    st->size += arr[i].size;
+
+  for (int i = 0; i < len && st->size > limit / 10 * 9; i++)
+    if (!unlink(arr[i].path))
+      st->size -= arr[i].size;
+
+  for (int i = 0; i < len; i++)
+    free(arr[i].path);
+  free(arr);
+}
+
+static off_t stored_size;
+
+static void add_entry(char *dir, CacheStats *st) {
+  st->size += stored_size;
+  trim_cache(dir, st);
+}
+
+// Hashes the compiler itself and the options that affect code
+// generation. Returns false if the cache cannot be used.
+static bool hash_compiler(Hash *h) {
+  hash_str(h, CACHE_VERSION, strlen(CACHE_VERSION));
+
+  struct stat st;
+  if (!stat("/proc/self/exe", &st)) {
+    hash_u64(h, st.st_size);
+    hash_u64(h, st.st_mtim.tv_sec);
+    hash_u64(h, st.st_mtim.tv_nsec);
+  }
+
+  hash_u64(h, opt_fcommon);
+  hash_u64(h, opt_pg);
+  hash_u64(h, opt_profile_timer);
+  hash_u64(h, opt_profile_generate);
+  if (opt_profile_use) {
+    size_t len;
+    char *buf = read_whole_file(opt_profile_use, &len);
+    if (!buf)
+      return false;
+    hash_str(h, buf, len);
+    free(buf);
+  }
+  return true;
+}
+
+// Returns the key of a preprocessed translation unit, or NULL if the
+// cache is not enabled.
+char *compile_cache_key(Token *tok) {
+  char *dir = cache_dir();
+  if (!dir)
+    return NULL;
+  mkdir(dir, 0777);
+
+  Hash h = {0xcbf29ce484222325, 0x84222325cbf29ce4};
+  if (!hash_compiler(&h))
+    return NULL;
+
+  for (File **files = get_input_files(); *files; files++) {
+    File *file = *files;
+    hash_str(&h, file->name, strlen(file->name));
+    if (file->contents)
+      hash_str(&h, file->contents, strlen(file->contents));
+  }
+
+  for (; tok->kind != TK_EOF; tok = tok->next)
+    hash_token(&h, tok);
+
+  return format("%016lx%016lx", (unsigned long)h.h1, (unsigned long)h.h2);
+}
+
+// Copies the cached output for a key to `path`. Returns false if
+// there is none.
+bool cache_fetch(char *key, char *path) {
+  char *dir = cache_dir();
+  char *entry = format("%s/%s.s", dir, key);
+
+  if (!copy_file(entry, path)) {
+    update_stats(dir, count_miss);
+    return false;
+  }
+
+  utimensat(AT_FDCWD, entry, NULL, 0);
+  update_stats(dir, count_hit);
+  return true;
+}
+
+// Stores the output at `path` under a key.
+void cache_store(char *key, char *path) {
+  char *dir = cache_dir();
+  char *entry = format("%s/%s.s", dir, key);
+  struct stat st;
+  if (!copy_file(path, entry) || stat(entry, &st))
+    return;
+
+  stored_size = st.st_size;
+  update_stats(dir, add_entry);
+}
+
+#define FN_CACHE_MAGIC "chibifn1"
+
+// The code of a function. Label numbers in it are relative to the
+// function (see emit_text()).
+typedef struct FnEntry FnEntry;
+struct FnEntry {
+  FnEntry *next;
+  Hash key;
+  char *text;
+  int len;
+  int labels;
+};
+
+static bool fn_cache_on;
+static char *fn_cache_path;
+static HashMap fn_keys;    // function name -> Hash
+static HashMap fn_entries; // Hash -> FnEntry of the last compile
+static FnEntry *fn_used;   // Entries of this compile, in reverse order
+static int fn_hits;
+static int fn_misses;
+static off_t fn_old_size;
+
+// Reads the sidecar file written by the last compile of the same
+// source file. A truncated or foreign file is ignored.
+static void read_fn_entries(void) {
+  size_t len;
+  char *buf = read_whole_file(fn_cache_path, &len);
+  if (!buf)
+    return;
+  fn_old_size = len;
+  if (len < 8 || memcmp(buf, FN_CACHE_MAGIC, 8))
+    return;
+
+  char *p = buf + 8;
+  char *end = buf + len;
+  while (end - p >= sizeof(Hash) + 8) {
+    FnEntry *e = calloc(1, sizeof(FnEntry));
+    memcpy(&e->key, p, sizeof(Hash));
+    memcpy(&e->labels, p + sizeof(Hash), 4);
+    memcpy(&e->len, p + sizeof(Hash) + 4, 4);
+    p += sizeof(Hash) + 8;
+    if (e->len < 0 || e->len > end - p)
+      return;
+    e->text = p;
+    p += e->len;
+    hashmap_put2(&fn_entries, (char *)&e->key, sizeof(Hash), e);
+  }
+}
+
+// Computes the keys of the functions of a translation unit and reads
+// the sidecar file. Code that depends on more than the tokens of the
+// translation unit, such as profiling code, is not cached.
+void fn_cache_begin(Token *tok, Obj *prog, char *pch) {
+  fn_cache_on = false;
+  fn_keys = (HashMap){};
+  fn_entries = (HashMap){};
+  fn_used = NULL;
+  fn_hits = fn_misses = 0;
+  fn_old_size = 0;
+
+  char *dir = cache_dir();
+  if (!dir || opt_pg || opt_profile_generate || opt_profile_use)
+    return;
+  mkdir(dir, 0777);
+
+  Hash h = {0xcbf29ce484222325, 0x84222325cbf29ce4};
+  hash_str(&h, FN_CACHE_MAGIC, 8);
+  if (!hash_compiler(&h))
+    return;
+
+  // The declarations of a precompiled header are not in the tokens.
+  if (pch) {
+    struct stat st;
+    if (stat(pch, &st))
+      return;
+    hash_u64(&h, st.st_ino);
+    hash_u64(&h, st.st_size);
+    hash_u64(&h, st.st_mtim.tv_sec);
+    hash_u64(&h, st.st_mtim.tv_nsec);
+  }
+
+  HashMap bodies = {};
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->body_begin)
+      hashmap_put2(&bodies, (char *)&fn->body_begin, sizeof(Token *), fn);
+
+  for (Token *t = tok; t->kind != TK_EOF;) {
+    Obj *fn = hashmap_get2(&bodies, (char *)&t, sizeof(Token *));
+    if (fn) {
+      t = fn->body_end;
+      continue;
+    }
+    hash_token(&h, t);
+    t = t->next;
+  }
+
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function || !fn->body_begin || !fn->is_live)
+      continue;
+
+    Hash *key = malloc(sizeof(Hash));
+    *key = h;
+    hash_str(key, fn->name, strlen(fn->name));
+    for (Token *t = fn->body_begin; t != fn->body_end; t = t->next)
+      hash_token(key, t);
+    hashmap_put(&fn_keys, fn->name, key);
+  }
+
+  // The sidecar file is named after the source file.
+  Hash h2 = {0xcbf29ce484222325, 0x84222325cbf29ce4};
+  char cwd[4096];
+  if (base_file[0] != '/' && getcwd(cwd, sizeof(cwd)))
+    hash_str(&h2, cwd, strlen(cwd));
+  hash_str(&h2, base_file, strlen(base_file));
+  fn_cache_path = format("%s/%016lx%016lx.fn", dir, (unsigned long)h2.h1,
+                         (unsigned long)h2.h2);
+
+  read_fn_entries();
+  fn_cache_on = true;
+}
+
+// Returns false if the code of a function cannot be cached.
+// Otherwise, sets `text` to the cached code, or to NULL if there
+// is none.
+bool fn_cache_lookup(Obj *fn, char **text, int *len, int *labels) {
+  Hash *key = fn_cache_on ? hashmap_get(&fn_keys, fn->name) : NULL;
+  if (!key)
+    return false;
+
+  FnEntry *e = hashmap_get2(&fn_entries, (char *)key, sizeof(Hash));
+  if (!e) {
+    fn_misses++;
+    *text = NULL;
+    return true;
+  }
+
+  fn_hits++;
+  e->next = fn_used;
+  fn_used = e;
+  *text = e->text;
+  *len = e->len;
+  *labels = e->labels;
+  return true;
+}
+
+// Adds the code of a function that missed the cache.
+void fn_cache_store(Obj *fn, char *text, int len, int labels) {
+  FnEntry *e = calloc(1, sizeof(FnEntry));
+  e->key = *(Hash *)hashmap_get(&fn_keys, fn->name);
+  e->text = text;
+  e->len = len;
+  e->labels = labels;
+  e->next = fn_used;
+  fn_used = e;
+}
+
+static void add_fn_entries(char *dir, CacheStats *st) {
+  st->fn_hits += fn_hits;
+  st->fn_misses += fn_misses;
+  st->size += stored_size;
+  trim_cache(dir, st);
+}
+
+// Replaces the sidecar file with the functions of this compile.
+void fn_cache_end(void) {
+  if (!fn_cache_on)
+    return;
+  fn_cache_on = false;
+
+  char *tmp = format("%s.%d.tmp", fn_cache_path, getpid());
+  FILE *fp = fopen(tmp, "w");
+  if (!fp)
+    return;
+
+  bool ok = fwrite(FN_CACHE_MAGIC, 8, 1, fp) == 1;
+  off_t size = 8;
+  for (FnEntry *e = fn_used; e; e = e->next) {
+    ok = ok && fwrite(&e->key, sizeof(Hash), 1, fp) == 1;
+    ok = ok && fwrite(&e->labels, 4, 1, fp) == 1;
+    ok = ok && fwrite(&e->len, 4, 1, fp) == 1;
+    ok = ok && fwrite(e->text, 1, e->len, fp) == e->len;
+    size += sizeof(Hash) + 8 + e->len;
+  }
+  ok = !fclose(fp) && ok;
+
+  if (!ok || rename(tmp, fn_cache_path)) {
+    unlink(tmp);
+    return;
+  }
+
+  stored_size = size - fn_old_size;
+  update_stats(cache_dir(), add_fn_entries);
+}
+
+// Prints the statistics of the cache for `chibicc --cache-stats`.
+void print_cache_stats(void) {
+  char *dir = cache_dir();
+  if (!dir)
+    error("--cache-stats: CHIBICC_CACHE is not set");
+
+  CacheStats st = {};
+  int fd = open(format("%s/stats", dir), O_RDONLY);
+  if (fd != -1) {
+    if (pread(fd, &st, sizeof(st), 0) != sizeof(st))
+      st = (CacheStats){};
+    close(fd);
+  }
+
+  int len;
+  CacheEntry *arr = read_entries(dir, &len);
+  uint64_t size = 0;
+  for (int i = 0; i < len; i++)
+    size += arr[i].size;
+
+  uint64_t total = st.hits + st.misses;
+  printf("cache directory  %s\n", dir);
+  printf("hits             %lu\n", (unsigned long)st.hits);
+  printf("misses           %lu\n", (unsigned long)st.misses);
+  printf("hit rate         %.1f%%\n", total ? st.hits * 100.0 / total : 0.0);
+  printf("function hits    %lu\n", (unsigned long)st.fn_hits);
+  printf("function misses  %lu\n", (unsigned long)st.fn_misses);
+  printf("entries          %d\n", len);
+  printf("size             %.1f MB (limit %.1f MB)\n",
+         size / 1048576.0, cache_limit() / 1048576.0);
+}
@@ -1,17 +1,23 @@
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <glob.h>
 #include <libgen.h>
+#include <limits.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -30,6 +36,26 @@ typedef struct Node Node;
 typedef struct Member Member;
 typedef struct Relocation Relocation;
 typedef struct Hideset Hideset;
+typedef struct ArenaChunk ArenaChunk;
+
+//
+// arena.c
+//
+
+typedef struct {
+  ArenaChunk *chunks;
+  char *ptr;
+  char *end;
+} Arena;
+
+extern Arena token_arena;
+extern Arena node_arena;
+extern Arena type_arena;
+extern Arena obj_arena;
+
+void *arena_alloc(Arena *arena, size_t size);
+void arena_release(Arena *arena);
+void swap_arenas(Arena *a, Arena *b);
 
 //
 // strings.c
@@ -67,6 +93,10 @@ typedef struct {
   // For #line directive
   char *display_name;
   int line_delta;
+
+  // Offsets of the beginnings of lines, built on first use
+  int *line_starts;
+  int num_lines;
 } File;
 
 // Token type
@@ -80,13 +110,14 @@ struct Token {
   int len;          // Token length
   Type *ty;         // Used if TK_NUM or TK_STR
   char *str;        // String literal contents including terminating '\0'
+  char *ident;      // Interned spelling of an identifier, keyword or punctuator
 
   File *file;       // Source location
   char *filename;   // Filename
-  int line_no;      // Line number
-  int line_delta;   // Line number
+  int line_delta;   // Added to the line number by #line
   bool at_bol;      // True if this token is at beginning of line
   bool has_space;   // True if this token follows a space character
+  bool is_shared;   // True if this token is in the header cache
   Hideset *hideset; // For macro expansion
   Token *origin;    // If this is expanded from a macro, the original token
 };
@@ -95,15 +126,41 @@ noreturn void error(char *fmt, ...) __attribute__((format(printf, 1, 2)));
 noreturn void error_at(char *loc, char *fmt, ...) __attribute__((format(printf, 2, 3)));
 noreturn void error_tok(Token *tok, char *fmt, ...) __attribute__((format(printf, 2, 3)));
 void warn_tok(Token *tok, char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// If a thread sets `error_trap`, error() and error_tok() save the
+// message in it and longjmp() to `env` instead of exiting.
+typedef struct {
+  jmp_buf env;
+  Token *tok;
+  char *msg;
+} ErrorTrap;
+
+extern _Thread_local ErrorTrap *error_trap;
+// Flags kept in the byte preceding an interned string
+#define IDENT_KEYWORD  1 // C keyword
+#define IDENT_TYPENAME 2 // Keyword that starts a type name
+#define IDENT_TYPEDEF  4 // Has been declared as a typedef
+#define IDENT_MACRO    8 // Has been defined as a macro
+
+int get_line_no(File *file, char *loc);
+int tok_line_no(Token *tok);
+char *intern(char *s, int len);
 bool equal(Token *tok, char *op);
 Token *skip(Token *tok, char *op);
 bool consume(Token **rest, Token *tok, char *str);
 void convert_pp_tokens(Token *tok);
 File **get_input_files(void);
+void add_input_file(File *file);
+void reset_input_files(void);
 File *new_file(char *name, int file_no, char *contents);
 Token *tokenize_string_literal(Token *tok, Type *basety);
 Token *tokenize(File *file);
 Token *tokenize_file(char *filename);
+Token *find_header(char *path);
+Token *tokenize_header(char *path);
+bool file_exists_in(char *dir, char *name);
+
+extern int cache_updates;
 
 #define unreachable() \
   error("internal error at %s:%d", __FILE__, __LINE__)
@@ -116,7 +173,12 @@ char *search_include_paths(char *filename);
 void init_macros(void);
 void define_macro(char *name, char *buf);
 void undef_macro(char *name);
+void setup_preprocessor(void);
+void reset_preprocessor(void);
 Token *preprocess(Token *tok);
+uint32_t write_preprocessor_state(void);
+void read_preprocessor_state(void *state);
+void add_pch_file(File *file);
 
 //
 // parse.c
@@ -154,7 +216,15 @@ struct Obj {
   Obj *alloca_bottom;
   int stack_size;
 
-  // Static inline function
+  // The tokens of the body, from "{" to the token after "}", and the
+  // range of numbers the parser gave to its labels and anonymous
+  // variables. Used to cache the code of the function.
+  Token *body_begin;
+  Token *body_end;
+  int first_id;
+  int last_id;
+
+  // Reachability from non-static objects
   bool is_live;
   bool is_root;
   StringArray refs;
@@ -222,65 +292,83 @@ typedef enum {
 } NodeKind;
 
 // AST node type
+//
+// The members after `rhs` depend on the node kind. A node is allocated
+// only as large as its kind needs (see node_size() in parse.c), so
+// those members must not be accessed for other kinds.
 struct Node {
-  NodeKind kind; // Node kind
-  Node *next;    // Next node
-  Type *ty;      // Type, e.g. int or pointer to int
-  Token *tok;    // Representative token
-
-  Node *lhs;     // Left-hand side
-  Node *rhs;     // Right-hand side
-
-  // "if" or "for" statement
-  Node *cond;
-  Node *then;
-  Node *els;
-  Node *init;
-  Node *inc;
-
-  // "break" and "continue" labels
-  char *brk_label;
-  char *cont_label;
-
-  // Block or statement expression
-  Node *body;
-
-  // Struct member access
-  Member *member;
-
-  // Function call
-  Type *func_ty;
-  Node *args;
-  bool pass_by_stack;
-  Obj *ret_buffer;
-
-  // Goto or labeled statement, or labels-as-values
-  char *label;
-  char *unique_label;
-  Node *goto_next;
-
-  // Switch
-  Node *case_next;
-  Node *default_case;
-
-  // Case
-  long begin;
-  long end;
-
-  // "asm" string literal
-  char *asm_str;
-
-  // Variable
-  Obj *var;
-
-  // Numeric literal
-  int64_t val;
-  long double fval;
+  NodeKind kind;      // Node kind
+  bool pass_by_stack; // Function argument passed on the stack
+  Node *next;         // Next node
+  Type *ty;           // Type, e.g. int or pointer to int
+  Token *tok;         // Representative token
+
+  Node *lhs;          // Left-hand side
+  Node *rhs;          // Right-hand side
+
+  union {
+    struct {
+      // "if", "for", "do", "switch" or "?:"
+      Node *cond;
+      Node *then;
+      Node *els;
+      Node *init;
+      Node *inc;
+
+      // "break" and "continue" labels
+      char *brk_label;
+      char *cont_label;
+
+      // Switch, or the next case of the same switch
+      Node *case_next;
+      Node *default_case;
+    };
+
+    struct {
+      // Goto, labeled statement, labels-as-values or case
+      char *label;
+      char *unique_label;
+      Node *goto_next;
+
+      // Case
+      long begin;
+      long end;
+    };
+
+    // Block or statement expression
+    Node *body;
+
+    // Struct member access
+    Member *member;
+
+    // Function call
+    struct {
+      Type *func_ty;
+      Node *args;
+      Obj *ret_buffer;
+    };
+
+    // "asm" string literal
+    char *asm_str;
+
+    // Variable
+    Obj *var;
+
+    // Numeric literal
+    struct {
+      int64_t val;
+      long double fval;
+    };
+  };
 };
 
 Node *new_cast(Node *expr, Type *ty);
 int64_t const_expr(Token **rest, Token *tok);
 Obj *parse(Token *tok);
+Obj *parse_whole_program(Token **tus, int len);
+int node_size(NodeKind kind);
+uint32_t write_parser_state(Token *tok);
+void read_parser_state(void *state);
 
 //
 // type.c
@@ -389,6 +477,35 @@ Type *enum_type(void);
 Type *struct_type(void);
 void add_type(Node *node);
 
+//
+// pch.c
+//
+
+uint32_t pch_alloc(void *ptr, int size);
+void pch_ptr(uint32_t slot, uint32_t off);
+void pch_bytes(uint32_t slot, char *p, int len);
+void pch_str(uint32_t slot, char *s);
+void pch_ident(uint32_t slot, char *s);
+void pch_token(uint32_t slot, Token *tok);
+void pch_tokens(uint32_t slot, Token *tok);
+void pch_type(uint32_t slot, Type *ty);
+void pch_obj(uint32_t slot, Obj *var);
+void write_pch(char *path, Token *tok);
+void read_pch(char *path);
+
+//
+// cache.c
+//
+
+char *compile_cache_key(Token *tok);
+bool cache_fetch(char *key, char *path);
+void cache_store(char *key, char *path);
+void print_cache_stats(void);
+void fn_cache_begin(Token *tok, Obj *prog, char *pch);
+bool fn_cache_lookup(Obj *fn, char **text, int *len, int *labels);
+void fn_cache_store(Obj *fn, char *text, int len, int labels);
+void fn_cache_end(void);
+
 //
 // codegen.c
 //
@@ -428,6 +545,8 @@ void hashmap_put(HashMap *map, char *key, void *val);
 void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
 void hashmap_delete(HashMap *map, char *key);
 void hashmap_delete2(HashMap *map, char *key, int keylen);
+HashMap hashmap_copy(HashMap *map);
+HashEntry *hashmap_next(HashMap *map, int *idx);
 void hashmap_test(void);
 
 //
@@ -438,4 +557,10 @@ bool file_exists(char *path);
 
 extern StringArray include_paths;
 extern bool opt_fcommon;
+extern bool opt_pg;
+extern int opt_profile_timer;
+extern int opt_codegen_threads;
+extern bool opt_profile_generate;
+extern char *opt_profile_use;
+extern bool opt_server;
 extern char *base_file;
@@ -1,4 +1,6 @@
 #include "chibicc.h"
+#include <pthread.h>
+#include <stdatomic.h>
 
 #define GP_MAX 2
 #define FP_MAX 2
@@ -8,40 +10,308 @@
 #define GP_SCRATCH_START 2
 #define GP_SCRATCH_END 6
 
-static FILE *output_file;
-static int depth;
-static Obj *current_fn;
-
-static int indents;
-
-static int to_gp_reg, to_fp_reg, to_dp_reg, to_lp_reg;
+// The state of code generation. Functions are generated in parallel,
+// each with its own context, into a private buffer and with labels
+// numbered from zero (see emit_text()). The main context holds the
+// rest of the output.
+typedef struct {
+  // Assembly text is formatted directly into a large buffer. In the
+  // main context, it is written to `output_fd` whenever it fills up.
+  // Otherwise, `output_fd` is -1 and the buffer just grows.
+  int output_fd;
+  char *out_buf;
+  int out_len;
+  int out_cap;
+  int line_start; // Start of the line being formatted
+
+  // An unconditional jump is not written out immediately. If it is
+  // followed only by labels and one of them is the jump target, the
+  // jump is a no-op and we can relax it away entirely.
+  char *pending_jump;
+  char *pending_target;
+  StringArray pending_labels;
+
+  Obj *current_fn;
+  int depth;
+  int label_count;
+  int indents;
+  int to_gp_reg, to_fp_reg, to_dp_reg, to_lp_reg;
+
+  // Call-site counters emitted for -pg. Each entry is
+  // "<counter> <caller> <callee>".
+  StringArray prof_arcs;
+  int prof_arc_idx;
+
+  // Branch counters for -fprofile-generate and -fprofile-use. They are
+  // numbered in the order of the branches in each function, so the same
+  // source yields the same counter names in both modes.
+  StringArray prof_branches;
+  int prof_branch_idx;
+} GenContext;
+
+static _Thread_local GenContext *ctx;
 
 static bool gen_expr(Node *node, bool collapse, bool override);
 static void gen_stmt(Node *node);
 
+// Counts from -fprofile-use. Read-only while functions are generated.
+static HashMap profile;
+
+#define OUTPUT_BUF_SIZE (1 << 20)
+
+static void write_all(char *p, int len) {
+  while (len > 0) {
+    int n = write(ctx->output_fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      error("cannot write output: %s", strerror(errno));
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+// Makes room for `n` more bytes. Complete lines are written out,
+// but the line being formatted stays in the buffer.
+static void out_reserve(int n) {
+  if (ctx->out_len + n <= ctx->out_cap)
+    return;
+
+  if (ctx->output_fd != -1 && ctx->line_start > 0) {
+    write_all(ctx->out_buf, ctx->line_start);
+    memmove(ctx->out_buf, ctx->out_buf + ctx->line_start, ctx->out_len - ctx->line_start);
+    ctx->out_len -= ctx->line_start;
+    ctx->line_start = 0;
+  }
+
+  if (ctx->out_len + n > ctx->out_cap) {
+    int min = (ctx->output_fd != -1) ? OUTPUT_BUF_SIZE : 4096;
+    ctx->out_cap = MAX(ctx->out_cap * 2, MAX(ctx->out_len + n, min));
+    ctx->out_buf = realloc(ctx->out_buf, ctx->out_cap);
+  }
+}
+
+static void out_mem(char *p, int len) {
+  if (len == 0)
+    return;
+  out_reserve(len);
+  memcpy(ctx->out_buf + ctx->out_len, p, len);
+  ctx->out_len += len;
+}
+
+static void out_char(char c) {
+  out_reserve(1);
+  ctx->out_buf[ctx->out_len++] = c;
+}
+
+static void out_str(char *s) {
+  out_mem(s, strlen(s));
+}
+
+// Writes a number in base 10 or 16 with an optional sign character,
+// padded to `width` with spaces or zeros.
+static void out_num(uint64_t val, char sign, int base, int width, bool zero) {
+  char buf[24];
+  char *p = buf + sizeof(buf);
+  do {
+    *--p = "0123456789abcdef"[val % base];
+    val /= base;
+  } while (val);
+
+  int len = buf + sizeof(buf) - p + (sign != 0);
+  if (sign && zero)
+    out_char(sign);
+  for (; len < width; len++)
+    out_char(zero ? '0' : ' ');
+  if (sign && !zero)
+    out_char(sign);
+  out_mem(p, buf + sizeof(buf) - p);
+}
+
+// A printf replacement that knows only the conversions we use:
+// %c, %s, %d, %u and %x with optional 0 or + flags, width and h or l
+// length modifier. %Lf is passed on to snprintf.
+static void out_vformat(char *fmt, va_list ap) {
+  for (char *p = fmt; *p;) {
+    if (*p != '%') {
+      char *q = strchr(p, '%');
+      int len = q ? q - p : strlen(p);
+      out_mem(p, len);
+      p += len;
+      continue;
+    }
+    p++;
+
+    bool zero = false;
+    bool plus = false;
+    for (; *p == '0' || *p == '+'; p++) {
+      if (*p == '0')
+        zero = true;
+      else
+        plus = true;
+    }
+
+    int width = 0;
+    while ('0' <= *p && *p <= '9')
+      width = width * 10 + *p++ - '0';
+
+    char len = 0;
+    if (*p == 'h' || *p == 'l' || *p == 'L')
+      len = *p++;
+
+    switch (*p++) {
+    case 'c':
+      out_char(va_arg(ap, int));
+      break;
+    case 's':
+      out_str(va_arg(ap, char *));
+      break;
+    case 'd': {
+      int64_t val = (len == 'l') ? va_arg(ap, long) : va_arg(ap, int);
+      if (len == 'h')
+        val = (short)val;
+      char sign = (val < 0) ? '-' : plus ? '+' : 0;
+      out_num(val < 0 ? -(uint64_t)val : val, sign, 10, width, zero);
+      break;
+    }
+    case 'u':
+    case 'x': {
+      uint64_t val = (len == 'l') ? va_arg(ap, unsigned long) : va_arg(ap, unsigned);
+      if (len == 'h')
+        val = (unsigned short)val;
+      out_num(val, 0, p[-1] == 'u' ? 10 : 16, width, zero);
+      break;
+    }
+    case 'f': {
+      char buf[128];
+      assert(len == 'L');
+      int n = snprintf(buf, sizeof(buf), "%Lf", va_arg(ap, long double));
+      out_mem(buf, MIN(n, sizeof(buf) - 1));
+      break;
+    }
+    case '%':
+      out_char('%');
+      break;
+    default:
+      error("internal error: unsupported format: %s", fmt);
+    }
+  }
+}
+
+static void flush_pending(void) {
+  if (ctx->pending_jump) {
+    out_str(ctx->pending_jump);
+    out_char('\n');
+  }
+  for (int i = 0; i < ctx->pending_labels.len; i++) {
+    out_str(ctx->pending_labels.data[i]);
+    out_mem(":\n", 2);
+  }
+  ctx->pending_jump = ctx->pending_target = NULL;
+  ctx->pending_labels.len = 0;
+}
+
+static bool is_jump(char *line) {
+  return line[1] == 'j' && (!strncmp(line, "\tjr.l ", 6) || !strncmp(line, "\tjr.s ", 6));
+}
+
+static bool is_label_def(char *line) {
+  int len = strlen(line);
+  return len > 1 && line[len - 1] == ':' && line[0] != '\t' && line[0] != '#';
+}
+
+static void emit_line(char *line) {
+  if (is_jump(line)) {
+    flush_pending();
+    ctx->pending_jump = line;
+    ctx->pending_target = ctx->pending_jump + 6;
+    return;
+  }
+
+  if (ctx->pending_jump && is_label_def(line)) {
+    char *label = strndup(line, strlen(line) - 1);
+    if (!strcmp(label, ctx->pending_target))
+      ctx->pending_jump = NULL;
+    strarray_push(&ctx->pending_labels, label);
+    if (!ctx->pending_jump)
+      flush_pending();
+    return;
+  }
+
+  flush_pending();
+  out_str(line);
+  out_char('\n');
+}
+
 __attribute__((format(printf, 1, 2)))
 static void println(char *fmt, ...) {
+  ctx->line_start = ctx->out_len;
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(output_file, fmt, ap);
+  out_vformat(fmt, ap);
   va_end(ap);
-  fprintf(output_file, "\n");
+
+  out_reserve(1);
+  ctx->out_buf[ctx->out_len] = '\0';
+  char *line = ctx->out_buf + ctx->line_start;
+
+  // Most lines are neither jumps nor behind a pending jump, and they
+  // stay where they were formatted.
+  if (!ctx->pending_jump && !is_jump(line)) {
+    out_char('\n');
+    ctx->line_start = ctx->out_len;
+    return;
+  }
+
+  line = strdup(line);
+  ctx->out_len = ctx->line_start;
+  emit_line(line);
+  ctx->line_start = ctx->out_len;
 }
 
-__attribute__((format(printf, 1, 2)))
-static void debug(char *fmt, ...) {
-  /*for (int i = 0; i < indents; i++)
+static void load_profile(char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    error("cannot open %s: %s", path, strerror(errno));
+
+  char name[256];
+  unsigned long long val;
+  while (fscanf(fp, "%255s %llu", name, &val) == 2) {
+    uint64_t *v = calloc(1, sizeof(uint64_t));
+    *v = val;
+    hashmap_put(&profile, strdup(name), v);
+  }
+  fclose(fp);
+}
+
+static uint64_t profile_count(char *counter) {
+  uint64_t *val = hashmap_get(&profile, counter);
+  return val ? *val : 0;
+}
+
+static char *branch_counter(void) {
+  char *label = format("__prof_br_%s_%d", ctx->current_fn->name, ctx->prof_branch_idx++);
+  if (opt_profile_generate)
+    strarray_push(&ctx->prof_branches, label);
+  return label;
+}
+
+static void count_branch(char *counter) {
+  if (!opt_profile_generate)
+    return;
+  println("\tadq.w @%s, 1", counter);
+  println("\tadx.w @%s+2, 0", counter);
+}
+
+static void debug(Node *node) {
+  /*for (int i = 0; i < ctx->indents; i++)
     printf(" ");
-  va_list ap;
-  va_start(ap, fmt);
-  vprintf(fmt, ap);
-  va_end(ap);
-  printf("\n");*/
+  printf("%d@%s:%d\n", node->kind, node->tok->file->name, tok_line_no(node->tok));*/
 }
 
 static int count(void) {
-  static int i = 1;
-  return i++;
+  return ++ctx->label_count;
 }
 
 static char get_suffix(int sz) {
@@ -66,13 +336,13 @@ static void push(int sz, int from_reg) {
   if (sz == 1) sz = 2;
   if (sz < 4) {
     println("\tld.%c @-sp, %c%d", get_suffix(sz), get_stack_reg(sz), from_reg);
-    if (sz == 3) depth += 4;
-    else depth += sz;
+    if (sz == 3) ctx->depth += 4;
+    else ctx->depth += sz;
   }
   else {
     println("\tld.w @-sp, @__long_%d1", from_reg);
     println("\tld.w @-sp, @__long_%d0", from_reg);
-    depth += 4;
+    ctx->depth += 4;
   }
 }
 
@@ -80,13 +350,13 @@ static void pop(int sz, int to_reg) {
   if (sz == 1) sz = 2;
   if (sz < 4) {
     println("\tld.%c %c%d, @sp+", get_suffix(sz), get_stack_reg(sz), to_reg);
-    if (sz == 3) depth -= 4;
-    else depth -= sz;
+    if (sz == 3) ctx->depth -= 4;
+    else ctx->depth -= sz;
   }
   else {
     println("\tld.w @__long_%d0, @sp+", to_reg);
     println("\tld.w @__long_%d1, @sp+", to_reg);
-    depth -= 4;
+    ctx->depth -= 4;
   }
 }
 
@@ -101,7 +371,7 @@ static void pushf(int sz, int from_reg) {
     println("\tld.w @-sp, @__float_%d1", from_reg);
     println("\tld.w @-sp, @__float_%d0", from_reg);
   }
-  depth += sz;
+  ctx->depth += sz;
 }
 
 static void popf(int sz, int to_reg) {
@@ -115,7 +385,7 @@ static void popf(int sz, int to_reg) {
     println("\tld.w @__float_%d0, @sp+", to_reg);
     println("\tld.w @__float_%d1, @sp+", to_reg);
   }
-  depth -= sz;
+  ctx->depth -= sz;
 }
 
 // Round up `n` to the nearest multiple of `align`. For instance,
@@ -196,6 +466,7 @@ static void gen_addr(Node *node, int to_reg) {
         else if (node->member->offset > 0)
           println("\tadd.p p%d, %d", to_reg, node->member->offset);
       }
+      return;
     }
     case ND_FUNCALL:
       if (node->ret_buffer) {
@@ -305,7 +576,7 @@ static void store(Type *ty, int to_ptr, int from_reg) {
     println("\tld.p @-sp, p0");
     println("\tld.p p0, @sp+4");
     
-    depth -= 4;
+    ctx->depth -= 4;
     
     switch (ty->kind) {
       case TY_STRUCT:
@@ -546,7 +817,7 @@ static void cast(Type *from, Type *to, int from_reg, int to_reg) {
 
 static void push_struct(Type *ty, int from_reg) {
   int sz = align_to(ty->size, 2);
-  depth += sz;
+  ctx->depth += sz;
   
   for (int i = 0; i < sz; i += 2)
     println("\tld.w @-sp, @p%d+%d", from_reg, i);
@@ -564,23 +835,23 @@ static void push_args2(Node *args, bool first_pass) {
   switch (args->ty->kind) {
     case TY_STRUCT:
     case TY_UNION:
-      push_struct(args->ty, to_gp_reg);
+      push_struct(args->ty, ctx->to_gp_reg);
       break;
     case TY_FLOAT:
-      pushf(args->ty->size, to_fp_reg);
+      pushf(args->ty->size, ctx->to_fp_reg);
       break;
     case TY_DOUBLE:
-      pushf(args->ty->size, to_dp_reg);
+      pushf(args->ty->size, ctx->to_dp_reg);
       break;
     case TY_ARRAY:
-      push(3, to_gp_reg);
+      push(3, ctx->to_gp_reg);
       break;
     case TY_LONG:
     case TY_ENUM:
-      push(4, to_lp_reg);
+      push(4, ctx->to_lp_reg);
       break;
     default:
-      push(args->ty->size, to_gp_reg);
+      push(args->ty->size, ctx->to_gp_reg);
       break;
   }
 }
@@ -650,8 +921,8 @@ static int push_args(Node *node) {
 }
 
 static void copy_struct(int from_ptr) {
-  Type *ty = current_fn->ty->return_ty;
-  Obj *var = current_fn->params;
+  Type *ty = ctx->current_fn->ty->return_ty;
+  Obj *var = ctx->current_fn->params;
   
   if (from_ptr == 0) return;
   println("\tld.p p0, @p6+%d", var->offset);
@@ -686,31 +957,31 @@ static void builtin_alloca(int to_reg) {
   println("\tld.p p1, @sp+");
   
   // Move alloca_bottom pointer
-  println("\tld.p p0, @p6+%d", current_fn->alloca_bottom->offset);
+  println("\tld.p p0, @p6+%d", ctx->current_fn->alloca_bottom->offset);
   println("\tsub.p p0, p%d", to_reg);
-  println("\tld.p @p6+%d, p0", current_fn->alloca_bottom->offset);
+  println("\tld.p @p6+%d, p0", ctx->current_fn->alloca_bottom->offset);
 }
 
 static int get_reg_type(Type *ty) {
   if (ty->kind == TY_LONG || ty->kind == TY_ENUM)
-    return to_lp_reg;
+    return ctx->to_lp_reg;
   else if (ty->kind == TY_FLOAT)
-    return to_fp_reg;
+    return ctx->to_fp_reg;
   else if (ty->kind == TY_DOUBLE)
-    return to_dp_reg;
+    return ctx->to_dp_reg;
   else
-    return to_gp_reg;
+    return ctx->to_gp_reg;
 }
 
 // Generate code for a given node.
 // The collapse parameter tells gen_expr to use the current register instead of the next one.
 // Returns true when the register index should be decremented.
 static bool gen_expr(Node *node, bool collapse, bool override) {
-  //println("\t; .loc %d %d", node->tok->file->file_no, node->tok->line_no);
+  //println("\t; .loc %d %d", node->tok->file->file_no, tok_line_no(node->tok));
   int rec_reg;
   int to_reg;
   
-  indents++;
+  ctx->indents++;
   
   bool ret = false;
   
@@ -722,44 +993,44 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
       rec_reg = 0;
     }
     else if (ty->kind == TY_FLOAT) {
-      rec_reg = MIN(to_fp_reg + 1, FP_MAX - 1);
-      to_reg = to_fp_reg;
+      rec_reg = MIN(ctx->to_fp_reg + 1, FP_MAX - 1);
+      to_reg = ctx->to_fp_reg;
       if (!collapse) {
-        to_fp_reg = rec_reg;
+        ctx->to_fp_reg = rec_reg;
         ret = true;
       }
     }
     else if (ty->kind == TY_DOUBLE) {
-      rec_reg = MIN(to_dp_reg + 1, DP_MAX - 1);
-      to_reg = to_dp_reg;
+      rec_reg = MIN(ctx->to_dp_reg + 1, DP_MAX - 1);
+      to_reg = ctx->to_dp_reg;
       if (!collapse) {
-        to_dp_reg = rec_reg;
+        ctx->to_dp_reg = rec_reg;
         ret = true;
       }
     }
     else if (ty->kind == TY_LONG || ty->kind == TY_ENUM) {
-      rec_reg = MIN(to_lp_reg + 1, LP_MAX - 1);
-      to_reg = to_lp_reg;
+      rec_reg = MIN(ctx->to_lp_reg + 1, LP_MAX - 1);
+      to_reg = ctx->to_lp_reg;
       if (!collapse) {
-        to_lp_reg = rec_reg;
+        ctx->to_lp_reg = rec_reg;
         ret = true;
       }
     }
     else {
-      rec_reg = MIN(to_gp_reg + 1, GP_SCRATCH_END - 1);
-      to_reg = to_gp_reg;
+      rec_reg = MIN(ctx->to_gp_reg + 1, GP_SCRATCH_END - 1);
+      to_reg = ctx->to_gp_reg;
       if (!collapse) {
-        to_gp_reg = rec_reg;
+        ctx->to_gp_reg = rec_reg;
         ret = true;
       }
     }
   }
   
-  debug("%d@%s:%d", node->kind, node->tok->file->name, node->tok->line_no);
+  debug(node);
   
   switch (node->kind) {
     case ND_NULL_EXPR:
-      indents--; return ret;
+      ctx->indents--; return ret;
     case ND_NUM: {
       switch (node->ty->kind) {
         case TY_FLOAT: {
@@ -768,7 +1039,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
           println("\tld.w @__float_%d0, w0", to_reg);
           println("\tld.w w0, %04hx", (uint16_t)(u.u32 >> 16));
           println("\tld.w @__float_%d1, w0", to_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
         }
         case TY_DOUBLE: {
           union { double f64; uint64_t u64; } u = { node->fval };
@@ -780,7 +1051,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
           println("\tld.w @__double_%d2, w0", to_reg);
           println("\tld.w w0, $%04hx", (uint16_t)(u.u64 >> 48));
           println("\tld.w @__double_%d3, w0", to_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
         }
         case TY_LONG:
         case TY_ENUM:
@@ -791,13 +1062,13 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
           println("\tld.w @__long_%d0, w0", to_reg);
           println("\tld.w w0, $%04hx", (uint16_t)(node->val >> 16));
           println("\tld.w @__long_%d1, w0", to_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
         default: {
           if (node->val < 128 && node->val > -129)
             println("\tldq p%d, %d", to_reg, (int8_t)(node->val & 0xff));
           else
             println("\tld.%c %c%d, %d", get_suffix(node->ty->size), get_stack_reg(node->ty->size), to_reg, (int32_t)(node->val & 0xffffff));
-          indents--; return ret;
+          ctx->indents--; return ret;
         }
       }
     }
@@ -807,19 +1078,19 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         case TY_FLOAT:
           println("\tld.w w0, $8000");
           println("\txor.w @__float_%d1, w0", to_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
         case TY_DOUBLE:
           println("\tld.w w0, $8000");
           println("\txor.w @__double_%d3, w0", to_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
         case TY_LONG:
         case TY_ENUM:
           println("\tneg.w @__long_%d0", to_reg);
           println("\tngx.w @__long_%d1", to_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
         default:
           println("\tneg.%c %c%d", get_suffix(node->ty->size), get_stack_reg(node->ty->size), to_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
       }
     case ND_VAR: {
       if (node->ty->size <= 3) {
@@ -862,7 +1133,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         load(node->var->ty, to_reg, rec_reg);
       }
       
-      indents--; return ret;
+      ctx->indents--; return ret;
     }
     case ND_MEMBER: {
       gen_addr(node, rec_reg);
@@ -897,38 +1168,38 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
           }
         }
       }
-      indents--; return ret;
+      ctx->indents--; return ret;
     }
     case ND_DEREF: {
       if (gen_expr(node->lhs, false, false)) {
         if (node->lhs->ty->kind == TY_FLOAT)
-          to_fp_reg--;
+          ctx->to_fp_reg--;
         else if (node->lhs->ty->kind == TY_DOUBLE)
-          to_dp_reg--;
+          ctx->to_dp_reg--;
         else if (node->lhs->ty->kind == TY_LONG || node->lhs->ty->kind == TY_ENUM)
-          to_lp_reg--;
+          ctx->to_lp_reg--;
         else
-          to_gp_reg--;
+          ctx->to_gp_reg--;
       }
       load(node->ty, to_reg, rec_reg);
-      indents--; return ret;
+      ctx->indents--; return ret;
     }
     case ND_ADDR:
       gen_addr(node->lhs, to_reg);
-      indents--; return ret;
+      ctx->indents--; return ret;
     case ND_ASSIGN:
       gen_addr(node->lhs, to_reg);
       if (to_reg == rec_reg) push(3, to_reg);
       if (gen_expr(node->rhs, false, false)) {
         ret = false;
         if (node->rhs->ty->kind == TY_FLOAT)
-          to_fp_reg--;
+          ctx->to_fp_reg--;
         else if (node->rhs->ty->kind == TY_DOUBLE)
-          to_dp_reg--;
+          ctx->to_dp_reg--;
         else if (node->rhs->ty->kind == TY_LONG || node->rhs->ty->kind == TY_ENUM)
-          to_lp_reg--;
+          ctx->to_lp_reg--;
         else
-          to_gp_reg--;
+          ctx->to_gp_reg--;
       }
       
       if (node->lhs->kind == ND_MEMBER && node->lhs->member->is_bitfield) {
@@ -957,7 +1228,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
           println("\tor.%c %c%d, @sp+", suffix, reg, rec_reg);
           
           store(node->ty, to_reg == rec_reg ? -1 : to_reg, rec_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
         }
         else {
           // save previous values
@@ -1010,30 +1281,30 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
           println("\tld.p p0, @sp+");
           
           store(node->ty, to_reg == rec_reg ? -1 : to_reg, rec_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
         }
       }
       
       store(node->ty, to_reg == rec_reg ? -1 : to_reg, rec_reg);
-      indents--; return ret;
+      ctx->indents--; return ret;
     case ND_STMT_EXPR:
       for (Node *n = node->body; n; n = n->next)
         gen_stmt(n);
-      indents--; return ret;
+      ctx->indents--; return ret;
     case ND_COMMA:
       gen_expr(node->lhs, true, false);
       gen_expr(node->rhs, true, false);
-      indents--; return ret;
+      ctx->indents--; return ret;
     case ND_CAST:
       gen_expr(node->lhs, false, false);
       cast(node->lhs->ty, node->ty, get_reg_type(node->lhs->ty), to_reg);
-      indents--; return ret;
+      ctx->indents--; return ret;
     case ND_MEMZERO: {
       println("\tlea p0, @p6+%d", node->var->offset);
       if (node->var->ty->size <= 32) {
         println("\trepi %d", node->var->ty->size);
         println("\tld.b @p0+, 0");
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       else {
         int c = count();
@@ -1046,7 +1317,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         println("\tdjnz p1, __L_zeroize_%d", c);
         println("__L_zeroizebreak_%d:", c);
         println("\tld.p p1, @sp+");
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
     }
     case ND_COND: {
@@ -1061,7 +1332,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
       println("__L_else_%d:", c);
       gen_expr(node->els, true, false);
       println("__L_end_%d:", c);
-      indents--; return ret;
+      ctx->indents--; return ret;
     }
     case ND_NOT: {
       int c = count();
@@ -1073,7 +1344,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
       println("__L_not_%d:", c);
       println("\tldq p%d, $00", to_reg);
       println("__L_notnot_%d:", c);
-      indents--; return ret;
+      ctx->indents--; return ret;
     }
     case ND_BITNOT:
       gen_expr(node->lhs, true, false);
@@ -1084,7 +1355,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
       else {
         println("\tcpl.%c %c%d", get_suffix(node->ty->size), get_stack_reg(node->ty->size), to_reg);
       }
-      indents--; return ret;
+      ctx->indents--; return ret;
     case ND_LOGAND: {
       int c = count();
       gen_expr(node->lhs, true, false);
@@ -1100,7 +1371,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
       println("__L_false_%d:", c);
       println("\tldq p%d, $01", to_reg);
       println("__L_end_%d:", c);
-      indents--; return ret;
+      ctx->indents--; return ret;
     }
     case ND_LOGOR: {
       int c = count();
@@ -1117,27 +1388,27 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
       println("__L_true_%d:", c);
       println("\tldq p%d, $01", to_reg);
       println("__L_end_%d:", c);
-      indents--; return ret;
+      ctx->indents--; return ret;
     }
     case ND_FUNCALL: {
       if (node->lhs->kind == ND_VAR && !strcmp(node->lhs->var->name, "alloca")) {
         gen_expr(node->args, true, false);
         builtin_alloca(to_reg);
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       
       int stack_args = push_args(node);
       if (node->lhs->kind != ND_VAR || node->lhs->var->is_local) {
         if (gen_expr(node->lhs, false, false)) {
           if (node->lhs->ty->kind == TY_FLOAT)
-            to_fp_reg--;
+            ctx->to_fp_reg--;
           else if (node->lhs->ty->kind == TY_DOUBLE)
-            to_dp_reg--;
+            ctx->to_dp_reg--;
           else if (node->lhs->ty->kind == TY_LONG || node->lhs->ty->kind == TY_ENUM) {
-            to_lp_reg--;
+            ctx->to_lp_reg--;
           }
           else
-            to_gp_reg--;
+            ctx->to_gp_reg--;
         }
       }
       
@@ -1176,11 +1447,20 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
       }
       
       // make sure we're on a word boundary
-      if (depth % 2 == 1) {
+      if (ctx->depth % 2 == 1) {
         println("\tsbq.p sp, 1");
-        depth++;
+        ctx->depth++;
       }
       
+      if (opt_pg) {
+        bool direct = node->lhs->kind == ND_VAR && !node->lhs->var->is_local;
+        char *label = format("__prof_arc_%s_%d", ctx->current_fn->name, ctx->prof_arc_idx++);
+        strarray_push(&ctx->prof_arcs, format("%s %s %s", label, ctx->current_fn->name,
+                                         direct ? node->lhs->var->name : "*"));
+        println("\tadq.w @%s, 1", label);
+        println("\tadx.w @%s+2, 0", label);
+      }
+
       if (node->lhs->kind == ND_VAR && !node->lhs->var->is_local)
         println("\tcall %s", node->lhs->var->name);
       else
@@ -1191,43 +1471,43 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
       else if (stack_args > 0)
         println("\tadd.p sp, %d", stack_args);
 
-      depth -= stack_args;
+      ctx->depth -= stack_args;
       
       // It looks like the most significant bits in P0 may
       // contain garbage if a function return type is short or bool/char,
       // respectively. We clear the upper bits here.
       switch (node->ty->kind) {
         case TY_VOID:
-          indents--; return ret;
+          ctx->indents--; return ret;
         case TY_BOOL:
           println("\tldzx.b p%d, l0", to_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
         case TY_CHAR:
           if (node->ty->is_unsigned)
             println("\tldzx.b p%d, l0", to_reg);
           else
             println("\tldsx.b p%d, l0", to_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
         case TY_SHORT:
           if (node->ty->is_unsigned)
             println("\tldzx.w p%d, w0", to_reg);
           else
             println("\tldsx.w p%d, w0", to_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
         case TY_LONG:
         case TY_ENUM: {
           if (to_reg != 0) {
             println("\tld.w @__long_%d0, @__long_00", to_reg);
             println("\tld.w @__long_%d1, @__long_01", to_reg);
           }
-          indents--; return ret;
+          ctx->indents--; return ret;
         }
         case TY_FLOAT: {
           if (to_reg != 0) {
             println("\tld.w @__float_%d0, @__float_00", to_reg);
             println("\tld.w @__float_%d1, @__float_01", to_reg);
           }
-          indents--; return ret;
+          ctx->indents--; return ret;
         }
         case TY_DOUBLE: {
           if (to_reg != 0) {
@@ -1236,17 +1516,17 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
             println("\tld.w @__double_%d2, @__double_02", to_reg);
             println("\tld.w @__double_%d3, @__double_03", to_reg);
           }
-          indents--; return ret;
+          ctx->indents--; return ret;
         }
         default:
           if (to_reg != 0)
             println("\tld.p p%d, p0", to_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
       }
     }
     case ND_LABEL_VAL:
       println("\tlea p%d, @%s", to_reg, node->unique_label);
-      indents--; return ret;
+      ctx->indents--; return ret;
     default:
       break;
   }
@@ -1282,16 +1562,16 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
       switch (node->kind) {
         case ND_ADD:
           println("\tcall __add%s3", sz);
-          indents--; return ret;
+          ctx->indents--; return ret;
         case ND_SUB:
           println("\tcall __sub%s3", sz);
-          indents--; return ret;
+          ctx->indents--; return ret;
         case ND_MUL:
           println("\tcall __mul%s3", sz);
-          indents--; return ret;
+          ctx->indents--; return ret;
         case ND_DIV:
           println("\tcall __div%s3", sz);
-          indents--; return ret;
+          ctx->indents--; return ret;
         case ND_EQ:
         case ND_NE:
         case ND_LT:
@@ -1307,10 +1587,10 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
           }
           println("\tand.b l0, $01");
           println("\tldzx.b p%d, l0", to_reg);
-          indents--; return ret;
+          ctx->indents--; return ret;
         default:
           error_tok(node->tok, "invalid expression");
-          indents--; return ret;
+          ctx->indents--; return ret;
       }
     }
     default:
@@ -1346,13 +1626,13 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         println("\tadd.w @__long_%d0, w0", to_reg);
         println("\tld.w w0, @__long_%d1", rec_reg);
         println("\tadx.w @__long_%d1, w0", to_reg);
-        indents--; return ret;
+        ctx->indents--; return ret;
       case ND_SUB:
         println("\tld.w w0, @__long_%d0", rec_reg);
         println("\tsub.w @__long_%d0, w0", to_reg);
         println("\tld.w w0, @__long_%d1", rec_reg);
         println("\tsbx.w @__long_%d1, w0", to_reg);
-        indents--; return ret;
+        ctx->indents--; return ret;
       case ND_MUL:
         println("\tld.w @-sp, w1");
         
@@ -1378,7 +1658,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         println("\tld.w @__long_%d1, @sp+", to_reg);
         
         println("\tld.w w1, @sp+");
-        indents--; return ret;
+        ctx->indents--; return ret;
       case ND_DIV:
       case ND_MOD: {
         int c = count();
@@ -1388,14 +1668,14 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         // bit 23 of P0 is used to mark whether to negate the result
         if (!(node->ty->is_unsigned)) {
           println("\tcp.w @__long_%d1, 0", rec_reg);
-          println("\tjr p, __L_divskipnega_%d", c);
+          println("\tjr p, __L_divskipnegx_%d", c);
           println("\tneg.w @__long_%d0", rec_reg);
           println("\tngx.w @__long_%d1", rec_reg);
           println("\txor.p p0, $800000");
           println("__L_divskipnegx_%d:", c);
           
           println("\tcp.w @__long_%d1, 0", to_reg);
-          println("\tjr p, __L_divskipnegb_%d", c);
+          println("\tjr p, __L_divskipnegy_%d", c);
           println("\tneg.w @__long_%d0", to_reg);
           println("\tngx.w @__long_%d1", to_reg);
           println("\txor.p p0, $800000");
@@ -1486,7 +1766,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         }
         
         println("\tld.w w1, @sp+");
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       case ND_BITAND:
         println("\tld.w w0, @__long_%d0", rec_reg);
@@ -1519,7 +1799,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         println("__L_ne_%d:", c);
         println("\tldq p%d, $00", to_reg);
         println("__L_eq_%d:", c);
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       case ND_NE: {
         int c = count();
@@ -1534,7 +1814,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         println("__L_ne_%d:", c);
         println("\tldq p%d, $01", to_reg);
         println("__L_eq_%d:", c);
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       case ND_LT: {
         int c = count();
@@ -1552,7 +1832,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         println("__L_lt_%d:", c);
         println("\tldq p%d, $01", to_reg);
         println("__L_ge_%d:", c);
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       case ND_LE: {
         int c = count();
@@ -1570,7 +1850,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         println("__L_le_%d:", c);
         println("\tldq p%d, $01", to_reg);
         println("__L_gt_%d:", c);
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       case ND_SHL: {
         int c = count();
@@ -1584,7 +1864,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         }
         else {
           println("__L_shl_%d:", c);
-          println("\tsbq.%c %c%d, 1", get_suffix(node->rhs->ty->size), get_stack_reg(node->rhs->ty->size), to_gp_reg);
+          println("\tsbq.%c %c%d, 1", get_suffix(node->rhs->ty->size), get_stack_reg(node->rhs->ty->size), ctx->to_gp_reg);
         }
         
         println("\tsla.w @__long_%d0", to_reg);
@@ -1598,10 +1878,10 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
           println("\tld.w w1, @sp+");
         }
         else {
-          println("\tcp.%c %c%d, 0", get_suffix(node->rhs->ty->size), get_stack_reg(node->rhs->ty->size), to_gp_reg);
+          println("\tcp.%c %c%d, 0", get_suffix(node->rhs->ty->size), get_stack_reg(node->rhs->ty->size), ctx->to_gp_reg);
           println("\tjr ne, __L_shl_%d", c);
         }
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       case ND_SHR:{
         int c = count();
@@ -1615,7 +1895,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         }
         else {
           println("__L_shr_%d:", c);
-          println("\tsbq.%c %c%d, 1", get_suffix(node->rhs->ty->size), get_stack_reg(node->rhs->ty->size), to_gp_reg);
+          println("\tsbq.%c %c%d, 1", get_suffix(node->rhs->ty->size), get_stack_reg(node->rhs->ty->size), ctx->to_gp_reg);
         }
         if (node->lhs->ty->is_unsigned)
           println("\tsra.w @__long_%d1", to_reg);
@@ -1631,15 +1911,15 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
           println("\tld.w w1, @sp+");
         }
         else {
-          println("\tcp.%c %c%d, 0", get_suffix(node->rhs->ty->size), get_stack_reg(node->rhs->ty->size), to_gp_reg);
+          println("\tcp.%c %c%d, 0", get_suffix(node->rhs->ty->size), get_stack_reg(node->rhs->ty->size), ctx->to_gp_reg);
           println("\tjr ne, __L_shr_%d", c);
         }
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       default:
         break;
     }
-    indents--; return ret;
+    ctx->indents--; return ret;
   } 
   else {
     char suffix = get_suffix(node->ty->size);
@@ -1664,24 +1944,24 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
           reg = get_stack_reg(2);
         }
         println("\tld.%c %c%d, @sp+4", suffix, reg, pop_reg);
-        depth -= node->lhs->ty->align;
+        ctx->depth -= node->lhs->ty->align;
       }
     }
     
     switch (node->kind) {
       case ND_ADD:
         println("\tadd.%c %c%d, %c%d", suffix, reg, to_reg, reg, rec_reg);
-        indents--; return ret;
+        ctx->indents--; return ret;
       case ND_SUB:
         println("\tsub.%c %c%d, %c%d", suffix, reg, to_reg, reg, rec_reg);
-        indents--; return ret;
+        ctx->indents--; return ret;
       case ND_MUL:
         if (node->ty->is_unsigned)
           println("\tmulu.%c %c%d, %c%d", suffix, reg, to_reg, reg, rec_reg);
         else
           println("\tmuls.%c %c%d, %c%d", suffix, reg, to_reg, reg, rec_reg);
         println("\tld.p p1, @sp+");
-        indents--; return ret;
+        ctx->indents--; return ret;
       case ND_DIV:
       case ND_MOD:
         println("\tldq p0, $00");
@@ -1692,16 +1972,16 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         if (node->kind == ND_MOD)
           println("\tld.%c %c%d, %c0", suffix, reg, to_reg, reg);
         println("\tld.p p1, @sp+");
-        indents--; return ret;
+        ctx->indents--; return ret;
       case ND_BITAND:
         println("\tand.%c %c%d, %c%d", suffix, reg, to_reg, reg, rec_reg);
-        indents--; return ret;
+        ctx->indents--; return ret;
       case ND_BITOR:
         println("\tor.%c %c%d, %c%d", suffix, reg, to_reg, reg, rec_reg);
-        indents--; return ret;
+        ctx->indents--; return ret;
       case ND_BITXOR:
         println("\txor.%c %c%d, %c%d", suffix, reg, to_reg, reg, rec_reg);
-        indents--; return ret;
+        ctx->indents--; return ret;
       case ND_EQ: {
         int c = count();
         println("\tcp.%c %c%d, %c%d", suffix, reg, to_reg, reg, rec_reg);
@@ -1711,7 +1991,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         println("__L_ne_%d:", c);
         println("\tldq p%d, $00", to_reg);
         println("__L_eq_%d:", c);
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       case ND_NE: {
         int c = count();
@@ -1722,7 +2002,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         println("__L_ne_%d:", c);
         println("\tldq p%d, $01", to_reg);
         println("__L_eq_%d:", c);
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       case ND_LT: {
         int c = count();
@@ -1736,7 +2016,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         println("__L_lt_%d:", c);
         println("\tldq p%d, $01", to_reg);
         println("__L_ge_%d:", c);
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       case ND_LE: {
         int c = count();
@@ -1750,7 +2030,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         println("__L_le_%d:", c);
         println("\tldq p%d, $01", to_reg);
         println("__L_gt_%d:", c);
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       case ND_SHL: {
         int c = count();
@@ -1761,7 +2041,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
         println("\tsla.%c %c%d", suffix, reg, to_reg);
         println("\tjr.s __L_shl_%d", c);
         println("__L_shlbreak_%d:", c);
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       case ND_SHR:{
         int c = count();
@@ -1775,7 +2055,7 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
           println("\tsrl.%c %c%d", suffix, reg, to_reg);
         println("\tjr.s __L_shr_%d", c);
         println("__L_shrbreak_%d:", c);
-        indents--; return ret;
+        ctx->indents--; return ret;
       }
       default:
         error_tok(node->tok, "invalid expression");
@@ -1785,18 +2065,40 @@ static bool gen_expr(Node *node, bool collapse, bool override) {
 }
 
 static void gen_stmt(Node *node) {
-  //println("\t; .loc %d %d", node->tok->file->file_no, node->tok->line_no);
+  //println("\t; .loc %d %d", node->tok->file->file_no, tok_line_no(node->tok));
   switch (node->kind) {
     case ND_IF: {
       int c = count();
+      char *then_counter = branch_counter();
+      char *else_counter = branch_counter();
       gen_expr(node->cond, true, false);
       cmp_zero(node->cond->ty, get_reg_type(node->cond->ty));
+
+      // If the profile says that the else clause runs more often,
+      // place it first so that it is reached by the short jump
+      // and the then clause is moved out of line.
+      if (node->els && profile_count(else_counter) > profile_count(then_counter)) {
+        println("\tjr z, __L_else_%d", c);
+        println("\tjr.l __L_then_%d", c);
+        println("__L_else_%d:", c);
+        count_branch(else_counter);
+        gen_stmt(node->els);
+        println("\tjr.l __L_end_%d", c);
+        println("__L_then_%d:", c);
+        count_branch(then_counter);
+        gen_stmt(node->then);
+        println("__L_end_%d:", c);
+        return;
+      }
+
       println("\tjr nz, __L_then_%d", c);
       println("\tjr.l __L_else_%d", c);
       println("__L_then_%d:", c);
+      count_branch(then_counter);
       gen_stmt(node->then);
       println("\tjr.l __L_end_%d", c);
       println("__L_else_%d:", c);
+      count_branch(else_counter);
       if (node->els)
         gen_stmt(node->els);
       println("__L_end_%d:", c);
@@ -1834,19 +2136,43 @@ static void gen_stmt(Node *node) {
       println("%s:", node->brk_label);
       return;
     }
-    case ND_SWITCH:
+    case ND_SWITCH: {
       gen_expr(node->cond, true, false);
-      
-      for (Node *n = node->case_next; n; n = n->case_next) {
+
+      int ncases = 0;
+      for (Node *n = node->case_next; n; n = n->case_next)
+        ncases++;
+
+      Node **cases = calloc(ncases, sizeof(Node *));
+      char **counters = calloc(ncases, sizeof(char *));
+      int i = 0;
+      for (Node *n = node->case_next; n; n = n->case_next, i++) {
+        cases[i] = n;
+        counters[i] = branch_counter();
+      }
+      char *default_counter = branch_counter();
+
+      // Test the cases that were taken most often first.
+      for (int i = 1; i < ncases; i++) {
+        for (int j = i; j > 0; j--) {
+          if (profile_count(counters[j]) <= profile_count(counters[j - 1]))
+            break;
+          Node *n = cases[j]; cases[j] = cases[j - 1]; cases[j - 1] = n;
+          char *ctr = counters[j]; counters[j] = counters[j - 1]; counters[j - 1] = ctr;
+        }
+      }
+
+      for (int i = 0; i < ncases; i++) {
+        Node *n = cases[i];
         char suffix = get_suffix(node->cond->ty->size);
         char reg = get_stack_reg(node->cond->ty->size);
         
         int c = count();
         int to_reg;
         if (node->cond->ty->size == 4)
-          to_reg = to_lp_reg;
+          to_reg = ctx->to_lp_reg;
         else
-          to_reg = to_gp_reg;
+          to_reg = ctx->to_gp_reg;
         
         if (n->begin == n->end) {
           if (node->cond->ty->size == 4) {
@@ -1854,12 +2180,14 @@ static void gen_stmt(Node *node) {
             println("\tjr ne, __L_ne_%d", c);
             println("\tcp.w @__long_%d1, %hu", to_reg, (uint16_t)(n->begin >> 16));
             println("\tjr ne, __L_ne_%d", c);
+            count_branch(counters[i]);
             println("\tjr.l %s", n->label);
             println("__L_ne_%d:", c);
           }
           else {
             println("\tcp.%c %c%d, %d", suffix, reg, to_reg, (int32_t)(n->begin));
             println("\tjr ne, __L_ne_%d", c);
+            count_branch(counters[i]);
             println("\tjr.l %s", n->label);
             println("__L_ne_%d:", c);
           }
@@ -1876,6 +2204,7 @@ static void gen_stmt(Node *node) {
           println("\tjr ugt, __L_gt_%d", c);
           println("\tcp.w @__long_20, %hu", (uint16_t)((n->end - n->begin) & 0xffff));
           println("\tjr ugt, __L_gt_%d", c);
+          count_branch(counters[i]);
           println("\tjr.l %s", n->label);
           println("__L_gt_%d:", c);
         }
@@ -1887,11 +2216,13 @@ static void gen_stmt(Node *node) {
             println("\tsub.%c %c0, %d", suffix, reg, (int32_t)(n->begin));
           println("\tcp.%c %c0, %d", suffix, reg, (int32_t)(n->end - n->begin));
           println("\tjr ugt, __L_gt_%d", c);
+          count_branch(counters[i]);
           println("\tjr.l %s", n->label);
           println("__L_gt_%d:", c);
         }
       }
 
+      count_branch(default_counter);
       if (node->default_case)
         println("\tjr.l %s", node->default_case->label);
 
@@ -1899,6 +2230,7 @@ static void gen_stmt(Node *node) {
       gen_stmt(node->then);
       println("%s:", node->brk_label);
       return;
+    }
     case ND_CASE:
       println("%s:", node->label);
       gen_stmt(node->lhs);
@@ -1912,7 +2244,7 @@ static void gen_stmt(Node *node) {
       return;
     case ND_GOTO_EXPR:
       gen_expr(node->lhs, true, false);
-      println("\tjr.l p%d", to_gp_reg);
+      println("\tjr.l p%d", ctx->to_gp_reg);
       return;
     case ND_LABEL:
       println("%s:", node->unique_label);
@@ -1932,7 +2264,7 @@ static void gen_stmt(Node *node) {
         }
       }
       
-      println("\tjr.l __L_return_%s", current_fn->name);
+      println("\tjr.l __L_return_%s", ctx->current_fn->name);
       return;
     case ND_EXPR_STMT:
       gen_expr(node->lhs, true, false);
@@ -1996,6 +2328,11 @@ static void assign_lvar_offsets(Obj *prog) {
       var->offset = -bottom;
     }
     
+    // With -pg, the timer value at function entry is saved
+    // at the bottom of the frame.
+    if (opt_pg)
+      bottom = align_to(bottom, 2) + 4;
+
     fn->stack_size = align_to(bottom, 2);
   }
 }
@@ -2008,6 +2345,10 @@ static void emit_data(Obj *prog) {
     if (var->is_function || !var->is_definition)
       continue;
     
+    // Unreferenced static variables are discarded.
+    if (!var->is_live)
+      continue;
+    
     /*
     if (var->is_static)
       println("\t; .local %s", var->name);
@@ -2101,21 +2442,337 @@ static void store_gp(int from_reg, int offset, int sz) {
   unreachable();
 }
 
+static void emit_function(Obj *fn) {
+  //println("\t; .type %s, @function", fn->name);
+  println("%s:", fn->name);
+  ctx->current_fn = fn;
+  ctx->prof_branch_idx = 0;
+  
+  // Prologue
+  println("\tld.p @-sp, p6");
+  println("\tld.p p6, sp");
+  if (fn->stack_size <= 8)
+    println("\tsbq.p sp, %d", fn->stack_size);
+  else
+    println("\tsub.p sp, %d", fn->stack_size);
+  println("\tld.p @p6+%d, sp", fn->alloca_bottom->offset);
+  
+  // Save arg registers if function is variadic
+  if (fn->va_area) {
+    int gp = 0, fp = 0, dp = 0;
+    for (Obj *var = fn->params; var; var = var->next) {
+      if (var->ty->kind == TY_FLOAT)
+        fp++;
+      else if (var->ty->kind == TY_DOUBLE)
+        dp++;
+      else
+        gp += var->align;
+    }
+    
+    int off = fn->va_area->offset;
+    
+    // va_elem
+    println("\tld.p @p6+%d, %d", off, gp);                // gp_offset
+    println("\tld.p @p6+%d, %d", off + 4, fp * 4 + 20);   // fp_offset
+    println("\tld.p @p6+%d, %d", off + 8, dp * 8 + 28);   // dp_offset
+    println("\tld.p @p6+%d, p6", off + 12);               // overflow_arg_area
+    println("\tadd.p @p6+%d, 4", off + 12);
+    println("\tld.p @p6+%d, p6", off + 16);               // reg_save_area
+    println("\tadd.p @p6+%d, %d", off + 16, off + 24);
+    
+    // __reg_save_area__
+    println("\tld.p @p6+%d, p1", off + 24);
+    println("\tld.p @p6+%d, p2", off + 28);
+    println("\tld.p @p6+%d, p3", off + 32);
+    println("\tld.w @p6+%d, @__long_01", off + 36);
+    println("\tld.w @p6+%d, @__long_00", off + 38);
+    println("\tld.w @p6+%d, @__long_11", off + 40);
+    println("\tld.w @p6+%d, @__long_10", off + 42);
+    println("\tld.w @p6+%d, @__float_01", off + 44);
+    println("\tld.w @p6+%d, @__float_00", off + 46);
+    println("\tld.w @p6+%d, @__float_11", off + 48);
+    println("\tld.w @p6+%d, @__float_10", off + 50);
+    println("\tld.w @p6+%d, @__double_03", off + 52);
+    println("\tld.w @p6+%d, @__double_02", off + 54);
+    println("\tld.w @p6+%d, @__double_01", off + 56);
+    println("\tld.w @p6+%d, @__double_00", off + 58);
+    println("\tld.w @p6+%d, @__double_13", off + 60);
+    println("\tld.w @p6+%d, @__double_12", off + 62);
+    println("\tld.w @p6+%d, @__double_11", off + 64);
+    println("\tld.w @p6+%d, @__double_10", off + 66);
+  }
+
+  // Save passed-by-register arguments to the stack
+  int gp = 0, fp = 0, dp = 0, lp = 0;
+  for (Obj *var = fn->params; var; var = var->next) {
+    if (var->offset > 0)
+      continue;
+
+    Type *ty = var->ty;
+    
+    switch (ty->kind) {
+    case TY_STRUCT:
+    case TY_UNION:
+      store_gp(gp++, var->offset, 3);
+      break;
+    case TY_FLOAT:
+      store_fp(fp++, var->offset, ty->size);
+      break;
+    case TY_DOUBLE:
+      store_fp(dp++, var->offset, ty->size);
+      break;
+    case TY_LONG:
+    case TY_ENUM:
+      store_gp(lp++, var->offset, ty->size);
+      break;
+    default:
+      store_gp(gp++, var->offset, ty->size);
+    }
+  }
+  
+  // Count the call and record the timer for -pg. This runs after the
+  // arguments are saved, so no register is live.
+  if (opt_pg || opt_profile_generate) {
+    println("\tadq.w @__prof_calls_%s, 1", fn->name);
+    println("\tadx.w @__prof_calls_%s+2, 0", fn->name);
+  }
+
+  if (opt_pg) {
+    println("\tld.w @p6+%d, @$%06x", -fn->stack_size, opt_profile_timer);
+    println("\tld.w @p6+%d, @$%06x", -fn->stack_size + 2, opt_profile_timer + 2);
+  }
+
+  ctx->to_gp_reg = GP_SCRATCH_START;
+  ctx->to_fp_reg = 0;
+  ctx->to_dp_reg = 0;
+  ctx->to_lp_reg = 0;
+  
+  // Emit code
+  gen_stmt(fn->body);
+  assert(ctx->depth == 0);
+  
+  // [https://www.sigbus.info/n1570#5.1.2.2.3p1] The C spec defines
+  // a special rule for the main function. Reaching the end of the
+  // main function is equivalent to returning 0, even though the
+  // behavior is undefined for the other functions.
+  if (strcmp(fn->name, "main") == 0)
+    println("\tldq p0, $00");
+  
+  // Epilogue
+  println("__L_return_%s:", fn->name);
+
+  // Accumulate the ticks spent in this call. P0 holds the
+  // return value, but W1 and W2 are free.
+  if (opt_pg) {
+    println("\tld.w w1, @$%06x", opt_profile_timer);
+    println("\tld.w w2, @$%06x", opt_profile_timer + 2);
+    println("\tsub.w w1, @p6+%d", -fn->stack_size);
+    println("\tsbx.w w2, @p6+%d", -fn->stack_size + 2);
+    println("\tadd.w @__prof_ticks_%s, w1", fn->name);
+    println("\tadx.w @__prof_ticks_%s+2, w2", fn->name);
+  }
+
+  println("\tld.p sp, p6");
+  println("\tld.p p6, @sp+");
+  println("\tjp @sp+");
+}
+
+// A range of label numbers and the offset to add to them
+typedef struct {
+  int lo;
+  int hi;
+  int delta;
+} LabelRange;
+
+static bool is_label_char(char c) {
+  return isalnum((unsigned char)c) || c == '_';
+}
+
+// Copies the code of a function, renumbering the labels of count()
+// ("__L_<kind>_<n>", lo < n <= hi) and of the parser ("__L_<n>",
+// lo <= n < hi). Returns NULL if the code refers to a label outside
+// of the ranges.
+static char *move_labels(char *text, int len, LabelRange counts,
+                         LabelRange ids, int *size) {
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+  char *p = text;
+  char *end = text + len;
+
+  for (char *q = text; end - q > 4; q++) {
+    if (memcmp(q, "__L_", 4) || (q > text && is_label_char(q[-1])))
+      continue;
+
+    char *r = q + 4;
+    while (r < end && islower((unsigned char)*r))
+      r++;
+
+    LabelRange *range = &ids;
+    if (r > q + 4) {
+      if (r == end || *r != '_')
+        continue;
+      r++;
+      range = &counts;
+    }
+
+    char *num = r;
+    while (r < end && isdigit((unsigned char)*r))
+      r++;
+    if (r == num || (r < end && is_label_char(*r)))
+      continue;
+
+    int n = strtol(num, NULL, 10);
+    if (range == &counts ? (n <= range->lo || range->hi < n)
+                         : (n < range->lo || range->hi <= n)) {
+      fclose(out);
+      free(buf);
+      return NULL;
+    }
+
+    fwrite(p, 1, num - p, out);
+    fprintf(out, "%d", n + range->delta);
+    p = q = r;
+  }
+
+  fwrite(p, 1, end - p, out);
+  fclose(out);
+  *size = buflen;
+  return buf;
+}
+
+// The code of a function, generated or taken from the cache
+typedef struct {
+  Obj *fn;
+  char *text;
+  int len;
+  int labels;     // Number of labels made by count()
+  LabelRange ids; // How to move the parser's labels in `text`
+  bool is_new;    // Generated and not in the cache yet
+  bool failed;    // Generating the code failed with `trap`
+  GenContext gen;
+  ErrorTrap trap;
+} FnCode;
+
+static FnCode *fn_codes;
+static int num_fn_codes;
+static atomic_int next_fn_code;
+static atomic_bool codegen_failed;
+
+// An error does not exit the process from a code generation thread.
+// It is saved instead and reported by emit_text() once all threads
+// have finished, so that the first error in source order is reported
+// however the functions were scheduled.
+static void gen_function(FnCode *c) {
+  GenContext *saved = ctx;
+  if (setjmp(c->trap.env)) {
+    error_trap = NULL;
+    ctx = saved;
+    c->failed = true;
+    atomic_store(&codegen_failed, true);
+    return;
+  }
+
+  error_trap = &c->trap;
+  ctx = &c->gen;
+  ctx->output_fd = -1;
+  emit_function(c->fn);
+  flush_pending();
+  ctx = saved;
+  error_trap = NULL;
+
+  c->text = c->gen.out_buf;
+  c->len = c->gen.out_len;
+  c->labels = c->gen.label_count;
+}
+
+// The body of a code generation thread. Functions are handed out
+// one at a time, so that a long one doesn't hold up the others.
+// After an error, no more are taken, but those taken before are
+// finished since they come before it in source order.
+static void *gen_functions(void *arg) {
+  for (;;) {
+    if (atomic_load(&codegen_failed))
+      return NULL;
+    int i = atomic_fetch_add(&next_fn_code, 1);
+    if (i >= num_fn_codes)
+      return NULL;
+    if (!fn_codes[i].text)
+      gen_function(&fn_codes[i]);
+  }
+}
+
+static int codegen_threads(int n) {
+  int threads = opt_codegen_threads;
+  if (!threads)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  return MAX(1, MIN(threads, n));
+}
+
 static void emit_text(Obj *prog) {
   //println("\t; .text");
   println("#bank rom");
   println("__data_end:");
-  
+
+  num_fn_codes = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition && fn->is_live)
+      num_fn_codes++;
+  fn_codes = calloc(num_fn_codes, sizeof(FnCode));
+
+  int i = 0;
+  int todo = 0;
   for (Obj *fn = prog; fn; fn = fn->next) {
     if (!fn->is_function || !fn->is_definition)
       continue;
     
-    // No code is emitted for "static inline" functions
+    // No code is emitted for static functions
     // if no one is referencing them.
     if (!fn->is_live)
       continue;
-    
-    println("\t; %s:%d", fn->body->tok->file->name, fn->body->tok->line_no);
+
+    // Cached code has its labels numbered from zero.
+    FnCode *c = &fn_codes[i++];
+    c->fn = fn;
+    c->is_new = fn_cache_lookup(fn, &c->text, &c->len, &c->labels);
+    if (c->text) {
+      c->ids = (LabelRange){0, fn->last_id - fn->first_id, fn->first_id};
+      c->is_new = false;
+    } else {
+      c->ids = (LabelRange){INT_MIN, INT_MAX, 0};
+      todo++;
+    }
+  }
+
+  // The calling thread generates code too.
+  int threads = codegen_threads(todo);
+  pthread_t *tids = calloc(threads, sizeof(pthread_t));
+  atomic_store(&next_fn_code, 0);
+  atomic_store(&codegen_failed, false);
+  int started = 0;
+  for (; started < threads - 1; started++)
+    if (pthread_create(&tids[started], NULL, gen_functions, NULL))
+      break;
+  gen_functions(NULL);
+  for (int i = 0; i < started; i++)
+    pthread_join(tids[i], NULL);
+  free(tids);
+
+  for (int i = 0; i < num_fn_codes; i++) {
+    ErrorTrap *t = &fn_codes[i].trap;
+    if (!fn_codes[i].failed)
+      continue;
+    if (t->tok)
+      error_tok(t->tok, "%s", t->msg);
+    error("%s", t->msg);
+  }
+
+  // Concatenate the functions in source order, renumbering their labels
+  // to follow the ones before them.
+  for (int i = 0; i < num_fn_codes; i++) {
+    FnCode *c = &fn_codes[i];
+    Obj *fn = c->fn;
+    println("\t; %s:%d", fn->body->tok->file->name, tok_line_no(fn->body->tok));
     
     /*
     if (fn->is_static)
@@ -2123,121 +2780,81 @@ static void emit_text(Obj *prog) {
     else
       println("\t; .globl %s", fn->name);
     */
-    
-    //println("\t; .type %s, @function", fn->name);
-    println("%s:", fn->name);
-    current_fn = fn;
-    
-    // Prologue
-    println("\tld.p @-sp, p6");
-    println("\tld.p p6, sp");
-    if (fn->stack_size <= 8)
-      println("\tsbq.p sp, %d", fn->stack_size);
-    else
-      println("\tsub.p sp, %d", fn->stack_size);
-    println("\tld.p @p6+%d, sp", fn->alloca_bottom->offset);
-    
-    // Save arg registers if function is variadic
-    if (fn->va_area) {
-      int gp = 0, fp = 0, dp = 0;
-      for (Obj *var = fn->params; var; var = var->next) {
-        if (var->ty->kind == TY_FLOAT)
-          fp++;
-        else if (var->ty->kind == TY_DOUBLE)
-          dp++;
-        else
-          gp += var->align;
-      }
-      
-      int off = fn->va_area->offset;
-      
-      // va_elem
-      println("\tld.p @p6+%d, %d", off, gp);                // gp_offset
-      println("\tld.p @p6+%d, %d", off + 4, fp * 4 + 20);   // fp_offset
-      println("\tld.p @p6+%d, %d", off + 8, dp * 8 + 28);   // dp_offset
-      println("\tld.p @p6+%d, p6", off + 12);               // overflow_arg_area
-      println("\tadd.p @p6+%d, 4", off + 12);
-      println("\tld.p @p6+%d, p6", off + 16);               // reg_save_area
-      println("\tadd.p @p6+%d, %d", off + 16, off + 24);
-      
-      // __reg_save_area__
-      println("\tld.p @p6+%d, p1", off + 24);
-      println("\tld.p @p6+%d, p2", off + 28);
-      println("\tld.p @p6+%d, p3", off + 32);
-      println("\tld.w @p6+%d, @__long_01", off + 36);
-      println("\tld.w @p6+%d, @__long_00", off + 38);
-      println("\tld.w @p6+%d, @__long_11", off + 40);
-      println("\tld.w @p6+%d, @__long_10", off + 42);
-      println("\tld.w @p6+%d, @__float_01", off + 44);
-      println("\tld.w @p6+%d, @__float_00", off + 46);
-      println("\tld.w @p6+%d, @__float_11", off + 48);
-      println("\tld.w @p6+%d, @__float_10", off + 50);
-      println("\tld.w @p6+%d, @__double_03", off + 52);
-      println("\tld.w @p6+%d, @__double_02", off + 54);
-      println("\tld.w @p6+%d, @__double_01", off + 56);
-      println("\tld.w @p6+%d, @__double_00", off + 58);
-      println("\tld.w @p6+%d, @__double_13", off + 60);
-      println("\tld.w @p6+%d, @__double_12", off + 62);
-      println("\tld.w @p6+%d, @__double_11", off + 64);
-      println("\tld.w @p6+%d, @__double_10", off + 66);
-    }
-
-    // Save passed-by-register arguments to the stack
-    int gp = 0, fp = 0, dp = 0, lp = 0;
-    for (Obj *var = fn->params; var; var = var->next) {
-      if (var->offset > 0)
-        continue;
 
-      Type *ty = var->ty;
-      
-      switch (ty->kind) {
-      case TY_STRUCT:
-      case TY_UNION:
-        store_gp(gp++, var->offset, 3);
-        break;
-      case TY_FLOAT:
-        store_fp(fp++, var->offset, ty->size);
-        break;
-      case TY_DOUBLE:
-        store_fp(dp++, var->offset, ty->size);
-        break;
-      case TY_LONG:
-      case TY_ENUM:
-        store_gp(lp++, var->offset, ty->size);
-        break;
-      default:
-        store_gp(gp++, var->offset, ty->size);
-      }
+    flush_pending();
+    int size;
+    char *buf = move_labels(c->text, c->len, (LabelRange){0, c->labels, ctx->label_count},
+                            c->ids, &size);
+    out_mem(buf, size);
+    ctx->line_start = ctx->out_len;
+    ctx->label_count += c->labels;
+    free(buf);
+
+    for (int j = 0; j < c->gen.prof_arcs.len; j++)
+      strarray_push(&ctx->prof_arcs, c->gen.prof_arcs.data[j]);
+    for (int j = 0; j < c->gen.prof_branches.len; j++)
+      strarray_push(&ctx->prof_branches, c->gen.prof_branches.data[j]);
+
+    if (c->is_new) {
+      LabelRange ids = {fn->first_id, fn->last_id, -fn->first_id};
+      buf = move_labels(c->text, c->len, (LabelRange){0, c->labels, 0}, ids, &size);
+      if (buf)
+        fn_cache_store(fn, buf, size, c->labels);
+    }
+    free(c->gen.out_buf);
+  }
+
+  free(fn_codes);
+  fn_codes = NULL;
+}
+
+// Emit 32-bit counters for -pg and -fprofile-generate. A host-side
+// tool reads them back together with the "; arc" comments, which
+// describe call sites.
+static void emit_prof(Obj *prog) {
+  println("#bank bss");
+  println("#align 16");
+
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function || !fn->is_definition || !fn->is_live)
+      continue;
+    println("__prof_calls_%s:", fn->name);
+    println("#res 4");
+    if (opt_pg) {
+      println("__prof_ticks_%s:", fn->name);
+      println("#res 4");
     }
-    
-    to_gp_reg = GP_SCRATCH_START;
-    to_fp_reg = 0;
-    to_dp_reg = 0;
-    to_lp_reg = 0;
-    
-    // Emit code
-    gen_stmt(fn->body);
-    assert(depth == 0);
-    
-    // [https://www.sigbus.info/n1570#5.1.2.2.3p1] The C spec defines
-    // a special rule for the main function. Reaching the end of the
-    // main function is equivalent to returning 0, even though the
-    // behavior is undefined for the other functions.
-    if (strcmp(fn->name, "main") == 0)
-      println("\tldq p0, $00");
-    
-    // Epilogue
-    println("__L_return_%s:", fn->name);
-    println("\tld.p sp, p6");
-    println("\tld.p p6, @sp+");
-    println("\tjp @sp+");
+  }
+
+  for (int i = 0; i < ctx->prof_branches.len; i++) {
+    println("%s:", ctx->prof_branches.data[i]);
+    println("#res 4");
+  }
+
+  for (int i = 0; i < ctx->prof_arcs.len; i++) {
+    char *label = strndup(ctx->prof_arcs.data[i], strcspn(ctx->prof_arcs.data[i], " "));
+    println("\t; arc %s", ctx->prof_arcs.data[i] + strlen(label) + 1);
+    println("%s:", label);
+    println("#res 4");
   }
 }
 
 void codegen(Obj *prog, FILE *out) {
-  output_file = out;
-  
+  fflush(out);
+  GenContext gen = {.output_fd = fileno(out)};
+  ctx = &gen;
+
+  profile = (HashMap){};
+  if (opt_profile_use)
+    load_profile(opt_profile_use);
+
   assign_lvar_offsets(prog);
   emit_data(prog);
   emit_text(prog);
+  if (opt_pg || opt_profile_generate)
+    emit_prof(prog);
+  flush_pending();
+  write_all(gen.out_buf, gen.out_len);
+  free(gen.out_buf);
+  ctx = NULL;
 }
@@ -53,8 +53,8 @@ static void rehash(HashMap *map) {
 }
 
 static bool match(HashEntry *ent, char *key, int keylen) {
-  return ent->key && ent->key != TOMBSTONE &&
-         ent->keylen == keylen && memcmp(ent->key, key, keylen) == 0;
+  return ent->key && ent->key != TOMBSTONE && ent->keylen == keylen &&
+         (ent->key == key || memcmp(ent->key, key, keylen) == 0);
 }
 
 static HashEntry *get_entry(HashMap *map, char *key, int keylen) {
@@ -133,6 +133,29 @@ void hashmap_delete2(HashMap *map, char *key, int keylen) {
     ent->key = TOMBSTONE;
 }
 
+HashMap hashmap_copy(HashMap *map) {
+  HashMap map2 = *map;
+  if (map->buckets) {
+    map2.buckets = calloc(map->capacity, sizeof(HashEntry));
+    memcpy(map2.buckets, map->buckets, sizeof(HashEntry) * map->capacity);
+  }
+  return map2;
+}
+
+// Returns the entry at or after bucket `*idx` and advances `*idx`
+// past it, or returns NULL at the end of the map. Iterate over a map
+// with `int i = 0; while ((ent = hashmap_next(map, &i))) ...`.
+HashEntry *hashmap_next(HashMap *map, int *idx) {
+  for (; *idx < map->capacity; (*idx)++) {
+    HashEntry *ent = &map->buckets[*idx];
+    if (ent->key && ent->key != TOMBSTONE) {
+      (*idx)++;
+      return ent;
+    }
+  }
+  return NULL;
+}
+
 void hashmap_test(void) {
   HashMap *map = calloc(1, sizeof(HashMap));
 
@@ -1,14 +1,25 @@
 #include "chibicc.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 typedef enum {
-  FILE_NONE, FILE_C, FILE_ASM, FILE_OBJ, FILE_AR, FILE_DSO,
+  FILE_NONE, FILE_C, FILE_C_HEADER, FILE_ASM, FILE_OBJ, FILE_AR, FILE_DSO,
 } FileType;
 
 StringArray include_paths;
 bool opt_fcommon = true;
+bool opt_pg;
+int opt_profile_timer = 0xffff04;
+bool opt_profile_generate;
+char *opt_profile_use;
+int opt_codegen_threads;
+bool opt_server;
 
 static FileType opt_x;
 static StringArray opt_include;
+static char *opt_include_pch;
 static bool opt_E;
 static bool opt_M;
 static bool opt_MD;
@@ -20,9 +31,12 @@ static bool opt_cc1;
 static bool opt_hash_hash_hash;
 static bool opt_static;
 static bool opt_shared;
+static bool opt_whole_program;
+static bool opt_integrated_cc1;
 static char *opt_MF;
 static char *opt_MT;
 static char *opt_o;
+static int opt_j;
 
 static StringArray ld_extra_args;
 static StringArray std_include_paths;
@@ -41,6 +55,7 @@ static void usage(int status) {
 static bool take_arg(char *arg) {
   char *x[] = {
     "-o", "-I", "-idirafter", "-include", "-x", "-MF", "-MT", "-Xlinker",
+    "-j", "-include-pch",
   };
 
   for (int i = 0; i < sizeof(x) / sizeof(*x); i++)
@@ -75,6 +90,8 @@ static void define(char *str) {
 static FileType parse_opt_x(char *s) {
   if (!strcmp(s, "c"))
     return FILE_C;
+  if (!strcmp(s, "c-header"))
+    return FILE_C_HEADER;
   if (!strcmp(s, "assembler"))
     return FILE_ASM;
   if (!strcmp(s, "none"))
@@ -159,6 +176,58 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-pg") || !strcmp(argv[i], "-finstrument-functions")) {
+      opt_pg = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fprofile-timer=", 16)) {
+      opt_profile_timer = strtol(argv[i] + 16, NULL, 0);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fprofile-generate")) {
+      opt_profile_generate = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fprofile-use=", 14)) {
+      opt_profile_use = argv[i] + 14;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fcodegen-threads=", 18)) {
+      char *end;
+      opt_codegen_threads = strtol(argv[i] + 18, &end, 10);
+      if (*end || opt_codegen_threads < 1)
+        error("<command line>: invalid number of threads: %s", argv[i] + 18);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-j", 2)) {
+      char *arg = argv[i][2] ? argv[i] + 2 : argv[++i];
+      char *end;
+      opt_j = strtol(arg, &end, 10);
+      if (*end || opt_j < 1)
+        error("<command line>: invalid number of jobs: %s", arg);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fwhole-program")) {
+      opt_whole_program = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fintegrated-cc1")) {
+      opt_integrated_cc1 = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-integrated-cc1")) {
+      opt_integrated_cc1 = false;
+      continue;
+    }
+
     if (!strcmp(argv[i], "-c")) {
       opt_c = true;
       continue;
@@ -199,6 +268,11 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-include-pch")) {
+      opt_include_pch = argv[++i];
+      continue;
+    }
+
     if (!strcmp(argv[i], "-x")) {
       opt_x = parse_opt_x(argv[++i]);
       continue;
@@ -334,6 +408,16 @@ static void parse_args(int argc, char **argv) {
   if (input_paths.len == 0)
     error("no input files");
 
+  // Static functions in a precompiled header would be defined once for
+  // each translation unit under the same name.
+  if (opt_include_pch && opt_whole_program)
+    error("-include-pch cannot be combined with -fwhole-program");
+
+  // All inputs are compiled by one cc1, which has no single
+  // dependency file to write.
+  if (opt_MD && opt_whole_program)
+    error("-MD and -MMD cannot be combined with -fwhole-program");
+
   // -E implies that the input is the C macro language.
   if (opt_E)
     opt_x = FILE_C;
@@ -364,11 +448,6 @@ static char *replace_extn(char *tmpl, char *extn) {
   return format("%s%s", filename, extn);
 }
 
-static void cleanup(void) {
-  for (int i = 0; i < tmpfiles.len; i++)
-    unlink(tmpfiles.data[i]);
-}
-
 static char *create_tmpfile(void) {
   char *path = strdup("/tmp/chibicc-XXXXXX");
   int fd = mkstemp(path);
@@ -380,7 +459,9 @@ static char *create_tmpfile(void) {
   return path;
 }
 
-static void run_subprocess(char **argv) {
+// Starts a command. If `out` or `err` is not NULL, the command's
+// stdout or stderr is appended to that file.
+static pid_t spawn(char **argv, char *out, char *err) {
   // If -### is given, dump the subprocess's command line.
   if (opt_hash_hash_hash) {
     fprintf(stderr, "%s", argv[0]);
@@ -389,21 +470,44 @@ static void run_subprocess(char **argv) {
     fprintf(stderr, "\n");
   }
 
-  if (fork() == 0) {
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid = fork();
+  if (pid < 0)
+    error("fork failed: %s", strerror(errno));
+
+  if (pid == 0) {
     // Child process. Run a new command.
+    if (out)
+      dup2(open(out, O_WRONLY | O_APPEND), 1);
+    if (err)
+      dup2(open(err, O_WRONLY | O_APPEND), 2);
     execvp(argv[0], argv);
     fprintf(stderr, "exec failed: %s: %s\n", argv[0], strerror(errno));
     _exit(1);
   }
+  return pid;
+}
+
+static bool check_status(char **argv, int status) {
+  if (WIFSIGNALED(status))
+    fprintf(stderr, "%s: terminated by signal %d\n", argv[0], WTERMSIG(status));
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void run_subprocess(char **argv) {
+  pid_t pid = spawn(argv, NULL, NULL);
 
   // Wait for the child process to finish.
   int status;
-  while (wait(&status) > 0);
-  if (status != 0)
+  if (waitpid(pid, &status, 0) < 0)
+    error("waitpid failed: %s", strerror(errno));
+  if (!check_status(argv, status))
     exit(1);
 }
 
-static void run_cc1(int argc, char **argv, char *input, char *output) {
+static char **cc1_args(int argc, char **argv, char *input, char *output) {
   char **args = calloc(argc + 10, sizeof(char *));
   memcpy(args, argv, argc * sizeof(char *));
   args[argc++] = "-cc1";
@@ -417,8 +521,319 @@ static void run_cc1(int argc, char **argv, char *input, char *output) {
     args[argc++] = "-cc1-output";
     args[argc++] = output;
   }
+  return args;
+}
+
+static void run_cc1(int argc, char **argv, char *input, char *output) {
+  run_subprocess(cc1_args(argc, argv, input, output));
+}
+
+//
+// Jobserver
+//
+// GNU make shares its -j limit with recursive commands (those that
+// start with "+" or mention $(MAKE)) through MAKEFLAGS, which then
+// contains --jobserver-auth=R,W for a pipe or --jobserver-auth=fifo:PATH
+// for a named pipe. Each byte in the pipe is a token. Every process
+// may run one job for free; it must read a token before starting each
+// additional one and write the same byte back when the job is done.
+//
+
+static int max_jobs = 1;
+static int jobserver_rfd = -1;
+static int jobserver_wfd = -1;
+static char tokens[256];
+static int num_tokens;
+
+// SIGCHLD handler writes to this pipe so that we can wait for a child
+// and a token at the same time with poll().
+static int sigchld_pipe[2];
+
+static void on_sigchld(int sig) {
+  int saved = errno;
+  write(sigchld_pipe[1], "", 1);
+  errno = saved;
+}
+
+static void init_jobserver(void) {
+  char *flags = getenv("MAKEFLAGS");
+  if (!flags)
+    return;
+
+  // Use the last occurrence. --jobserver-fds is the pre-4.2 spelling.
+  char *auth = NULL;
+  for (char *p = flags; (p = strstr(p, "--jobserver-")); p++)
+    auth = p;
+  if (!auth)
+    return;
+
+  auth = strchr(auth, '=');
+  if (!auth)
+    return;
+  auth = strndup(auth + 1, strcspn(auth + 1, " "));
+
+  int rfd, wfd;
+  if (!strncmp(auth, "fifo:", 5)) {
+    rfd = wfd = open(auth + 5, O_RDWR | O_NONBLOCK);
+    if (rfd < 0)
+      return;
+    fcntl(rfd, F_SETFD, FD_CLOEXEC);
+  } else {
+    if (sscanf(auth, "%d,%d", &rfd, &wfd) != 2)
+      return;
+
+    // make doesn't pass the pipe to commands it doesn't consider
+    // recursive, even though MAKEFLAGS mentions it.
+    if (fcntl(rfd, F_GETFD) < 0 || fcntl(wfd, F_GETFD) < 0)
+      return;
+
+    // The pipe is shared with make and its other children, so we
+    // must not make it non-blocking. Open our own file description
+    // of it instead, if we can.
+    int fd = open(format("/proc/self/fd/%d", rfd), O_RDONLY | O_NONBLOCK);
+    if (fd >= 0) {
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      rfd = fd;
+    }
+  }
 
-  run_subprocess(args);
+  if (pipe(sigchld_pipe) < 0)
+    error("pipe failed: %s", strerror(errno));
+  for (int i = 0; i < 2; i++) {
+    fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+    fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  struct sigaction sa = {};
+  sa.sa_handler = on_sigchld;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa, NULL);
+
+  jobserver_rfd = rfd;
+  jobserver_wfd = wfd;
+}
+
+// Takes a token from the jobserver if one is available.
+static bool get_token(void) {
+  if (jobserver_rfd < 0 || num_tokens == sizeof(tokens))
+    return false;
+
+  struct pollfd fd = {jobserver_rfd, POLLIN};
+  if (poll(&fd, 1, 0) <= 0)
+    return false;
+
+  int n = read(jobserver_rfd, tokens + num_tokens, 1);
+  if (n == 1) {
+    num_tokens++;
+    return true;
+  }
+
+  // make has gone away. Keep the tokens we have, but don't ask for more.
+  if (n == 0) {
+    jobserver_rfd = -1;
+    max_jobs = MIN(max_jobs, num_tokens + 1);
+  }
+  return false;
+}
+
+static void put_tokens(int n) {
+  while (num_tokens > n) {
+    num_tokens--;
+    while (write(jobserver_wfd, tokens + num_tokens, 1) < 0 && errno == EINTR);
+  }
+}
+
+static void cleanup(void) {
+  for (int i = 0; i < tmpfiles.len; i++)
+    unlink(tmpfiles.data[i]);
+  put_tokens(0);
+}
+
+//
+// Parallel jobs
+//
+// Each input file is turned into a job of up to two commands, cc1 and
+// the assembler, which run one after the other. Up to -j jobs run at
+// a time (or as many as the jobserver allows). If more than one may
+// run, the output of each job is captured in temporary files and
+// copied out once the job and all jobs before it have finished, so
+// that diagnostics appear in the same order as in a serial build.
+//
+
+typedef struct Job Job;
+struct Job {
+  Job *next;
+  char **cmds[2];
+  int num_cmds;
+  int cur;
+  pid_t pid;
+  bool done;
+  char *out;
+  char *err;
+};
+
+static Job *jobs;
+static Job *last_job;
+static Job *next_job;
+static Job *next_output;
+static int num_running;
+
+static void start_job(Job *job) {
+  job->pid = spawn(job->cmds[job->cur], job->out, job->err);
+}
+
+// Starts as many queued jobs as possible without blocking.
+static void start_jobs(void) {
+  while (next_job && num_running < max_jobs) {
+    if (jobserver_rfd >= 0 && num_running > num_tokens && !get_token())
+      return;
+    start_job(next_job);
+    next_job = next_job->next;
+    num_running++;
+  }
+}
+
+static void copy_file(char *path, int fd) {
+  int in = open(path, O_RDONLY);
+  if (in < 0)
+    return;
+
+  char buf[4096];
+  int n;
+  while ((n = read(in, buf, sizeof(buf))) > 0)
+    write(fd, buf, n);
+  close(in);
+}
+
+static void print_outputs(void) {
+  for (; next_output && next_output->done; next_output = next_output->next) {
+    if (next_output->out)
+      copy_file(next_output->out, 1);
+    if (next_output->err)
+      copy_file(next_output->err, 2);
+  }
+}
+
+static Job *find_job(pid_t pid) {
+  for (Job *job = jobs; job; job = job->next)
+    if (job->pid == pid && !job->done)
+      return job;
+  return NULL;
+}
+
+// Waits for a child process to exit, or for a token to become
+// available if a job is waiting for one. Returns 0 in the latter case.
+static pid_t wait_child(int *status) {
+  if (jobserver_rfd < 0)
+    return waitpid(-1, status, 0);
+
+  for (;;) {
+    pid_t pid = waitpid(-1, status, WNOHANG);
+    if (pid)
+      return pid;
+
+    bool want_token = next_job && num_running < max_jobs;
+    struct pollfd fds[] = {
+      {sigchld_pipe[0], POLLIN},
+      {jobserver_rfd, POLLIN},
+    };
+    if (poll(fds, want_token ? 2 : 1, -1) < 0 && errno != EINTR)
+      error("poll failed: %s", strerror(errno));
+
+    char buf[64];
+    while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0);
+
+    if (want_token && fds[1].revents && get_token())
+      return 0;
+  }
+}
+
+// Stops starting new jobs, lets the running ones finish and exits.
+static noreturn void abort_jobs(void) {
+  next_job = NULL;
+  while (num_running > 0) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0)
+      break;
+    Job *job = find_job(pid);
+    if (job) {
+      job->done = true;
+      num_running--;
+    }
+  }
+  print_outputs();
+  exit(1);
+}
+
+static void wait_job(void) {
+  int status;
+  pid_t pid = wait_child(&status);
+  if (pid == 0)
+    return;
+  if (pid < 0)
+    error("waitpid failed: %s", strerror(errno));
+
+  Job *job = find_job(pid);
+  if (!job)
+    return;
+
+  if (!check_status(job->cmds[job->cur], status)) {
+    job->done = true;
+    num_running--;
+    abort_jobs();
+  }
+
+  if (++job->cur < job->num_cmds) {
+    start_job(job);
+    return;
+  }
+
+  job->done = true;
+  num_running--;
+  print_outputs();
+}
+
+// Adds a job that runs `cmd1` and then `cmd2`. Either may be NULL.
+// Blocks until the job has been started.
+static void add_job(char **cmd1, char **cmd2) {
+  Job *job = calloc(1, sizeof(Job));
+  if (cmd1)
+    job->cmds[job->num_cmds++] = cmd1;
+  if (cmd2)
+    job->cmds[job->num_cmds++] = cmd2;
+  if (job->num_cmds == 0)
+    return;
+
+  if (max_jobs > 1) {
+    job->out = create_tmpfile();
+    job->err = create_tmpfile();
+  }
+
+  if (last_job)
+    last_job = last_job->next = job;
+  else
+    jobs = last_job = job;
+
+  if (!next_job)
+    next_job = job;
+  if (!next_output)
+    next_output = job;
+
+  for (;;) {
+    start_jobs();
+    if (!next_job)
+      break;
+    wait_job();
+  }
+  put_tokens(MAX(num_running - 1, 0));
+}
+
+static void wait_all_jobs(void) {
+  while (num_running > 0) {
+    wait_job();
+    put_tokens(MAX(num_running - 1, 0));
+  }
 }
 
 // Print tokens to stdout. Used for -E.
@@ -504,7 +919,49 @@ static Token *append_tokens(Token *tok1, Token *tok2) {
   return tok1;
 }
 
-static void cc1(void) {
+static FileType get_file_type(char *filename) {
+  if (opt_x != FILE_NONE)
+    return opt_x;
+
+  if (endswith(filename, ".a"))
+    return FILE_AR;
+  if (endswith(filename, ".so"))
+    return FILE_DSO;
+  if (endswith(filename, ".o"))
+    return FILE_OBJ;
+  if (endswith(filename, ".c"))
+    return FILE_C;
+  if (endswith(filename, ".h"))
+    return FILE_C_HEADER;
+  if (endswith(filename, ".s"))
+    return FILE_ASM;
+
+  error("<command line>: unknown file extension: %s", filename);
+}
+
+static void emit_program(Obj *prog) {
+  // Traverse the AST to emit assembly. codegen() does its own
+  // buffering and writes to the file descriptor directly.
+  if (!output_file || !strcmp(output_file, "-")) {
+    codegen(prog, stdout);
+    return;
+  }
+
+  // The assembly is written to a temporary file that replaces the
+  // output only on success, so that an error does not leave a
+  // truncated output behind. cleanup() removes it otherwise.
+  char *tmp = format("%s.%d.tmp", output_file, getpid());
+  strarray_push(&tmpfiles, tmp);
+  FILE *out = open_file(tmp);
+  codegen(prog, out);
+  if (fclose(out))
+    error("cannot write output: %s: %s", output_file, strerror(errno));
+  if (rename(tmp, output_file) < 0)
+    error("cannot rename %s to %s: %s", tmp, output_file, strerror(errno));
+}
+
+// Tokenize and preprocess a single translation unit.
+static Token *read_tu(char *file) {
   Token *tok = NULL;
 
   // Process -include option
@@ -524,10 +981,63 @@ static void cc1(void) {
     tok = append_tokens(tok, tok2);
   }
 
-  // Tokenize and parse.
-  Token *tok2 = must_tokenize_file(base_file);
+  Token *tok2 = must_tokenize_file(file);
   tok = append_tokens(tok, tok2);
-  tok = preprocess(tok);
+
+  if (opt_include_pch)
+    read_pch(opt_include_pch);
+  return preprocess(tok);
+}
+
+// In whole-program mode, all C inputs are compiled at once so that
+// the parser can see every function definition and discard the ones
+// that are not reachable from main.
+static Obj *parse_all_inputs(void) {
+  StringArray arr = {};
+  for (int i = 0; i < input_paths.len; i++) {
+    char *path = input_paths.data[i];
+    if (!strncmp(path, "-l", 2) || !strncmp(path, "-Wl,", 4))
+      continue;
+    if (get_file_type(path) == FILE_C)
+      strarray_push(&arr, path);
+  }
+
+  Token **tus = calloc(arr.len, sizeof(Token *));
+  setup_preprocessor();
+  for (int i = 0; i < arr.len; i++) {
+    base_file = arr.data[i];
+    reset_preprocessor();
+    tus[i] = read_tu(base_file);
+  }
+  return parse_whole_program(tus, arr.len);
+}
+
+// Parallel compile jobs keep the CPUs busy already, so functions are
+// generated on one thread unless this is the only job: with -j and
+// several inputs, or under make -j, the job slots are all taken.
+static bool in_parallel_build(void) {
+  if (opt_j > 1 && input_paths.len > 1)
+    return true;
+  char *flags = getenv("MAKEFLAGS");
+  return flags && strstr(flags, "-j");
+}
+
+static void cc1(void) {
+  if (!opt_codegen_threads && in_parallel_build())
+    opt_codegen_threads = 1;
+
+  if (opt_whole_program) {
+    emit_program(parse_all_inputs());
+    return;
+  }
+
+  // A header is compiled to a precompiled header. What it defines is
+  // found by comparing with the macros we start with.
+  bool is_header = get_file_type(base_file) == FILE_C_HEADER;
+  if (is_header)
+    setup_preprocessor();
+
+  Token *tok = read_tu(base_file);
 
   // If -M or -MD are given, print file dependencies.
   if (opt_M || opt_MD) {
@@ -542,26 +1052,83 @@ static void cc1(void) {
     return;
   }
 
+  if (is_header) {
+    write_pch(output_file ? output_file : format("%s.gch", base_file), tok);
+    return;
+  }
+
+  // Assembly written to a file may be in the compile cache.
+  bool to_file = output_file && strcmp(output_file, "-");
+  char *key = to_file ? compile_cache_key(tok) : NULL;
+  if (key && cache_fetch(key, output_file))
+    return;
+
+  // Otherwise, the code of unchanged functions may be reused.
   Obj *prog = parse(tok);
+  fn_cache_begin(tok, prog, opt_include_pch);
+  emit_program(prog);
+  fn_cache_end();
+  if (key)
+    cache_store(key, output_file);
+}
 
-  // Open a temporary output buffer.
-  char *buf;
-  size_t buflen;
-  FILE *output_buf = open_memstream(&buf, &buflen);
+// With -fintegrated-cc1, the driver compiles each C input itself
+// instead of running a "-cc1" subprocess for it. Predefined macros
+// and include paths are set up once, and headers are tokenized once
+// for all translation units (see tokenize_header()).
+static bool integrated_init;
+static Arena macro_token_arena;
+static Arena macro_type_arena;
+
+static void integrated_cc1(char *argv0, char *input, char *output) {
+  if (!integrated_init) {
+    add_default_include_paths(argv0);
+    setup_preprocessor();
+
+    // The arenas are released after each translation unit, but what
+    // has been allocated so far belongs to predefined and -D macros,
+    // which all translation units share. Set it aside.
+    macro_token_arena = token_arena;
+    macro_type_arena = type_arena;
+    token_arena = type_arena = (Arena){};
+    integrated_init = true;
+  }
 
-  // Traverse the AST to emit assembly.
-  codegen(prog, output_buf);
-  fclose(output_buf);
+  base_file = input;
+  output_file = output;
+  reset_preprocessor();
+  reset_input_files();
+  cc1();
 
-  // Write the asembly text to a file.
-  FILE *out = open_file(output_file);
-  fwrite(buf, buflen, 1, out);
-  fclose(out);
+  arena_release(&token_arena);
+  arena_release(&node_arena);
+  arena_release(&type_arena);
+  arena_release(&obj_arena);
+}
+
+// Returns a command that compiles `input`, or NULL if it has been
+// compiled in this process.
+static char **compile(int argc, char **argv, char *input, char *output) {
+  if (opt_integrated_cc1) {
+    integrated_cc1(argv[0], input, output);
+    return NULL;
+  }
+  return cc1_args(argc, argv, input, output);
+}
+
+static char **assemble_args(char *input, char *output) {
+  StringArray arr = {};
+  strarray_push(&arr, "as");
+  strarray_push(&arr, "-c");
+  strarray_push(&arr, input);
+  strarray_push(&arr, "-o");
+  strarray_push(&arr, output);
+  strarray_push(&arr, NULL);
+  return arr.data;
 }
 
 static void assemble(char *input, char *output) {
-  char *cmd[] = {"as", "-c", input, "-o", output, NULL};
-  run_subprocess(cmd);
+  run_subprocess(assemble_args(input, output));
 }
 
 static char *find_file(char *pattern) {
@@ -671,38 +1238,87 @@ static void run_linker(StringArray *inputs, char *output) {
   run_subprocess(arr.data);
 }
 
-static FileType get_file_type(char *filename) {
-  if (opt_x != FILE_NONE)
-    return opt_x;
+static void compile_whole_program(int argc, char **argv) {
+  StringArray ld_args = {};
+  char *first = NULL;
 
-  if (endswith(filename, ".a"))
-    return FILE_AR;
-  if (endswith(filename, ".so"))
-    return FILE_DSO;
-  if (endswith(filename, ".o"))
-    return FILE_OBJ;
-  if (endswith(filename, ".c"))
-    return FILE_C;
-  if (endswith(filename, ".s"))
-    return FILE_ASM;
+  for (int i = 0; i < input_paths.len; i++) {
+    char *input = input_paths.data[i];
 
-  error("<command line>: unknown file extension: %s", filename);
-}
+    if (!strncmp(input, "-l", 2)) {
+      strarray_push(&ld_args, input);
+      continue;
+    }
 
-int main(int argc, char **argv) {
-  atexit(cleanup);
-  init_macros();
-  parse_args(argc, argv);
+    if (!strncmp(input, "-Wl,", 4)) {
+      char *s = strdup(input + 4);
+      char *arg = strtok(s, ",");
+      while (arg) {
+        strarray_push(&ld_args, arg);
+        arg = strtok(NULL, ",");
+      }
+      continue;
+    }
 
-  if (opt_cc1) {
-    add_default_include_paths(argv[0]);
-    cc1();
+    FileType type = get_file_type(input);
+    if (type == FILE_C) {
+      if (!first)
+        first = input;
+      continue;
+    }
+
+    if (type == FILE_ASM) {
+      if (opt_S || opt_c)
+        error("%s: assembly input cannot be combined with -fwhole-program -S or -c", input);
+      char *tmp = create_tmpfile();
+      assemble(input, tmp);
+      strarray_push(&ld_args, tmp);
+      continue;
+    }
+
+    strarray_push(&ld_args, input);
+  }
+
+  if (!first)
+    error("-fwhole-program: no C input files");
+
+  // All C inputs are compiled by a single cc1 process into
+  // a single assembly file.
+  if (opt_S) {
+    run_cc1(argc, argv, NULL, opt_o ? opt_o : replace_extn(first, ".s"));
+    return;
+  }
+
+  char *tmp = create_tmpfile();
+  run_cc1(argc, argv, NULL, tmp);
+
+  if (opt_c) {
+    assemble(tmp, opt_o ? opt_o : replace_extn(first, ".o"));
+    return;
+  }
+
+  char *obj = create_tmpfile();
+  assemble(tmp, obj);
+  strarray_push(&ld_args, obj);
+  run_linker(&ld_args, opt_o ? opt_o : "a.out");
+}
+
+static int run_driver(int argc, char **argv) {
+  if (opt_whole_program && !opt_E && !opt_M) {
+    compile_whole_program(argc, argv);
     return 0;
   }
 
   if (input_paths.len > 1 && opt_o && (opt_c || opt_S | opt_E))
     error("cannot specify '-o' with '-c,' '-S' or '-E' with multiple files");
 
+  if (!opt_server)
+    init_jobserver();
+  if (opt_j)
+    max_jobs = opt_j;
+  else if (jobserver_rfd >= 0)
+    max_jobs = sizeof(tokens) + 1;
+
   StringArray ld_args = {};
 
   for (int i = 0; i < input_paths.len; i++) {
@@ -742,42 +1358,441 @@ int main(int argc, char **argv) {
     // Handle .s
     if (type == FILE_ASM) {
       if (!opt_S)
-        assemble(input, output);
+        add_job(assemble_args(input, output), NULL);
       continue;
     }
 
-    assert(type == FILE_C);
+    assert(type == FILE_C || type == FILE_C_HEADER);
 
     // Just preprocess
     if (opt_E || opt_M) {
-      run_cc1(argc, argv, input, NULL);
+      add_job(compile(argc, argv, input, NULL), NULL);
+      continue;
+    }
+
+    // Precompile a header
+    if (type == FILE_C_HEADER) {
+      add_job(compile(argc, argv, input, opt_o ? opt_o : format("%s.gch", input)), NULL);
       continue;
     }
 
     // Compile
     if (opt_S) {
-      run_cc1(argc, argv, input, output);
+      add_job(compile(argc, argv, input, output), NULL);
       continue;
     }
 
     // Compile and assemble
     if (opt_c) {
       char *tmp = create_tmpfile();
-      run_cc1(argc, argv, input, tmp);
-      assemble(tmp, output);
+      add_job(compile(argc, argv, input, tmp), assemble_args(tmp, output));
       continue;
     }
 
     // Compile, assemble and link
     char *tmp1 = create_tmpfile();
     char *tmp2 = create_tmpfile();
-    run_cc1(argc, argv, input, tmp1);
-    assemble(tmp1, tmp2);
+    add_job(compile(argc, argv, input, tmp1), assemble_args(tmp1, tmp2));
     strarray_push(&ld_args, tmp2);
     continue;
   }
 
+  wait_all_jobs();
+
   if (ld_args.len > 0)
     run_linker(&ld_args, opt_o ? opt_o : "a.out");
   return 0;
 }
+
+//
+// Compile server
+//
+// `chibicc --server=<socket>` starts a daemon that compiles files for
+// clients connecting to a Unix domain socket. If CHIBICC_SERVER is
+// set to the socket's path, the driver is a client: it sends its
+// working directory, arguments and standard file descriptors to the
+// server and exits with the status the server returns. If it cannot
+// connect, it compiles the files itself.
+//
+// The server keeps the tokens of headers, their include guards and
+// snapshots of the preprocessor state after common #include lines in
+// memory (see tokenize_header() and apply_snapshot()). Each request
+// is handled in a forked child with -fintegrated-cc1, so that a
+// compile error, which exits the process, doesn't take down the
+// server. If the child has added to the caches and no other request
+// is in progress, it takes over as the server and the old one exits.
+//
+// The server exits when its socket file is removed.
+//
+
+typedef struct {
+  pid_t pid;
+} TakeoverRequest;
+
+extern char **environ;
+
+static int server_fds[3];
+static int takeover_fds[2];
+static pid_t *children;
+static int num_children;
+
+static bool is_cc1_command(int argc, char **argv) {
+  for (int i = 1; i < argc; i++)
+    if (!strcmp(argv[i], "-cc1"))
+      return true;
+  return false;
+}
+
+static bool write_all(int fd, char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool read_all(int fd, char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool set_socket_path(struct sockaddr_un *addr, char *path) {
+  *addr = (struct sockaddr_un){.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr->sun_path))
+    return false;
+  strcpy(addr->sun_path, path);
+  return true;
+}
+
+// Returns the exit status of the compilation, or -1 if the server
+// is not running.
+static int run_client(char *path, int argc, char **argv) {
+  struct sockaddr_un addr;
+  if (!set_socket_path(&addr, path))
+    return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+
+  // A request is the working directory, the environment, an empty
+  // string and the arguments, each terminated by '\0'. Its length is
+  // sent first, along with the file descriptors.
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd)))
+    error("getcwd failed: %s", strerror(errno));
+  fwrite(cwd, 1, strlen(cwd) + 1, out);
+  for (char **env = environ; *env; env++)
+    if (**env)
+      fwrite(*env, 1, strlen(*env) + 1, out);
+  fputc('\0', out);
+  for (int i = 0; i < argc; i++)
+    fwrite(argv[i], 1, strlen(argv[i]) + 1, out);
+  fclose(out);
+
+  uint32_t len = buflen;
+  int fds[] = {0, 1, 2};
+  char control[CMSG_SPACE(sizeof(fds))] = {};
+  struct iovec iov = {&len, sizeof(len)};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(fd, &msg, 0) != sizeof(len) || !write_all(fd, buf, buflen)) {
+    close(fd);
+    return -1;
+  }
+
+  // The server closes the connection without replying if the
+  // compilation fails.
+  char status;
+  if (!read_all(fd, &status, 1))
+    return 1;
+  return status;
+}
+
+// Reads a request and makes this process look like the client's
+// driver process. Returns the arguments.
+static char **read_request(int conn, int *argc) {
+  uint32_t len;
+  int fds[3];
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = {&len, sizeof(len)};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+
+  struct cmsghdr *cmsg;
+  if (recvmsg(conn, &msg, 0) != sizeof(len) || !(cmsg = CMSG_FIRSTHDR(&msg)) ||
+      cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    error("--server: malformed request");
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  char *buf = calloc(1, len + 1);
+  if (!read_all(conn, buf, len))
+    error("--server: malformed request");
+
+  if (chdir(buf))
+    error("--server: cannot change directory to %s: %s", buf, strerror(errno));
+  for (int i = 0; i < 3; i++) {
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+
+  // Compile with the client's environment, which has CHIBICC_CACHE,
+  // MAKEFLAGS and the like.
+  StringArray env = {};
+  char *p = buf + strlen(buf) + 1;
+  for (; p < buf + len && *p; p += strlen(p) + 1)
+    strarray_push(&env, p);
+  if (p >= buf + len)
+    error("--server: malformed request");
+  strarray_push(&env, NULL);
+  environ = env.data;
+
+  StringArray args = {};
+  for (p++; p < buf + len; p += strlen(p) + 1)
+    strarray_push(&args, p);
+  *argc = args.len;
+  strarray_push(&args, NULL);
+  return args.data;
+}
+
+// Puts back the options that parse_args() and run_driver() have
+// changed, so that the next request starts from scratch.
+static void reset_options(void) {
+  include_paths = (StringArray){};
+  opt_fcommon = true;
+  opt_pg = false;
+  opt_profile_timer = 0xffff04;
+  opt_profile_generate = false;
+  opt_profile_use = NULL;
+  opt_codegen_threads = 0;
+
+  opt_x = FILE_NONE;
+  opt_include = (StringArray){};
+  opt_include_pch = NULL;
+  opt_E = opt_M = opt_MD = opt_MMD = opt_MP = false;
+  opt_S = opt_c = opt_cc1 = opt_hash_hash_hash = false;
+  opt_static = opt_shared = opt_whole_program = false;
+  opt_integrated_cc1 = false;
+  opt_MF = opt_MT = opt_o = NULL;
+  opt_j = 0;
+
+  ld_extra_args = (StringArray){};
+  std_include_paths = (StringArray){};
+  input_paths = (StringArray){};
+  base_file = output_file = NULL;
+
+  cleanup();
+  tmpfiles = (StringArray){};
+
+  jobs = last_job = next_job = next_output = NULL;
+  num_running = 0;
+  max_jobs = 1;
+
+  integrated_init = false;
+  arena_release(&macro_token_arena);
+  arena_release(&macro_type_arena);
+}
+
+// Handles a request in a child of the server. Returns if this
+// process is to be the server from now on.
+static void serve(int conn) {
+  int argc;
+  char **argv = read_request(conn, &argc);
+  int updates = cache_updates;
+
+  init_macros();
+  parse_args(argc, argv);
+  opt_integrated_cc1 = true;
+  char status = run_driver(argc, argv);
+
+  fflush(NULL);
+  write_all(conn, &status, 1);
+  close(conn);
+  for (int i = 0; i < 3; i++)
+    dup2(server_fds[i], i);
+
+  if (cache_updates == updates)
+    exit(0);
+
+  // Ask the server whether we should take over. SIGUSR1 and SIGUSR2
+  // are blocked, so the answer cannot get lost.
+  TakeoverRequest req = {getpid()};
+  write_all(takeover_fds[1], (char *)&req, sizeof(req));
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+  int sig;
+  sigwait(&set, &sig);
+  if (sig != SIGUSR1)
+    exit(0);
+
+  reset_options();
+  num_children = 0;
+}
+
+static void remove_child(pid_t pid) {
+  for (int i = 0; i < num_children; i++) {
+    if (children[i] == pid) {
+      children[i] = children[--num_children];
+      return;
+    }
+  }
+}
+
+static noreturn void run_server(char *path) {
+  // Requests change the working directory, so the socket's path must
+  // not depend on it.
+  if (path[0] != '/') {
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+      error("getcwd failed: %s", strerror(errno));
+    path = format("%s/%s", cwd, path);
+  }
+
+  struct sockaddr_un addr;
+  if (!set_socket_path(&addr, path))
+    error("--server: socket path too long: %s", path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    error("--server: socket failed: %s", strerror(errno));
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 64))
+    error("--server: cannot listen on %s: %s", path, strerror(errno));
+
+  struct stat st;
+  if (stat(path, &st))
+    error("--server: %s: %s", path, strerror(errno));
+
+  // Detach from the caller once the socket is ready.
+  pid_t pid = fork();
+  if (pid < 0)
+    error("fork failed: %s", strerror(errno));
+  if (pid > 0)
+    _exit(0);
+  setsid();
+
+  opt_server = true;
+  init_macros();
+
+  for (int i = 0; i < 3; i++)
+    server_fds[i] = dup(i);
+  if (pipe(takeover_fds))
+    error("pipe failed: %s", strerror(errno));
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+
+  for (;;) {
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+      remove_child(pid);
+
+    struct stat st2;
+    if (stat(path, &st2) || st2.st_ino != st.st_ino || st2.st_dev != st.st_dev)
+      exit(0);
+
+    struct pollfd fds[] = {{takeover_fds[0], POLLIN}, {sock, POLLIN}};
+    if (poll(fds, 2, 1000) <= 0)
+      continue;
+
+    if (fds[0].revents & POLLIN) {
+      TakeoverRequest req;
+      if (read_all(takeover_fds[0], (char *)&req, sizeof(req))) {
+        if (num_children == 1 && children[0] == req.pid) {
+          kill(req.pid, SIGUSR1);
+          exit(0);
+        }
+        kill(req.pid, SIGUSR2);
+        remove_child(req.pid);
+      }
+    }
+
+    if (fds[1].revents & POLLIN) {
+      int conn = accept(sock, NULL, NULL);
+      if (conn < 0)
+        continue;
+
+      pid = fork();
+      if (pid == 0) {
+        serve(conn);
+        continue;
+      }
+
+      close(conn);
+      if (pid > 0) {
+        children = realloc(children, sizeof(pid_t) * (num_children + 1));
+        children[num_children++] = pid;
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  atexit(cleanup);
+
+  if (argc == 2 && !strncmp(argv[1], "--server=", 9))
+    run_server(argv[1] + 9);
+
+  if (argc == 2 && !strcmp(argv[1], "--cache-stats")) {
+    print_cache_stats();
+    return 0;
+  }
+
+  char *server = getenv("CHIBICC_SERVER");
+  if (server && *server && !is_cc1_command(argc, argv)) {
+    int status = run_client(server, argc, argv);
+    if (status >= 0)
+      return status;
+  }
+
+  init_macros();
+  parse_args(argc, argv);
+
+  if (opt_cc1) {
+    add_default_include_paths(argv[0]);
+    cc1();
+    return 0;
+  }
+  return run_driver(argc, argv);
+}
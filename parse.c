@@ -88,6 +88,9 @@ static Obj *globals;
 
 static Scope *scope = &(Scope){};
 
+// Initializers only live while a declaration is being parsed.
+static Arena init_arena;
+
 // Points to the function object the parser is currently parsing.
 static Obj *current_fn;
 
@@ -105,6 +108,30 @@ static Node *current_switch;
 
 static Obj *builtin_alloca;
 
+// In whole-program mode, the 1-based index of the translation unit
+// being parsed. Otherwise 0.
+static int tu_index;
+
+// Serial number for anonymous global variables
+static int unique_id;
+
+// The state of the parser after a header, as written to a precompiled
+// header
+typedef struct {
+  Obj *globals;
+  Obj *builtin_alloca;
+  int unique_id;
+  int num_vars;
+  char **var_names;
+  VarScope **vars;
+  int num_tags;
+  char **tag_names;
+  Type **tags;
+} ParserState;
+
+// Set by read_parser_state() for the next translation unit
+static ParserState *pch_state;
+
 static bool is_typename(Token *tok);
 static Type *declspec(Token **rest, Token *tok, VarAttr *attr);
 static Type *typename(Token **rest, Token *tok);
@@ -172,7 +199,7 @@ static void leave_scope(void) {
 // Find a variable by name.
 static VarScope *find_var(Token *tok) {
   for (Scope *sc = scope; sc; sc = sc->next) {
-    VarScope *sc2 = hashmap_get2(&sc->vars, tok->loc, tok->len);
+    VarScope *sc2 = hashmap_get2(&sc->vars, tok->ident, tok->len);
     if (sc2)
       return sc2;
   }
@@ -181,15 +208,54 @@ static VarScope *find_var(Token *tok) {
 
 static Type *find_tag(Token *tok) {
   for (Scope *sc = scope; sc; sc = sc->next) {
-    Type *ty = hashmap_get2(&sc->tags, tok->loc, tok->len);
+    Type *ty = hashmap_get2(&sc->tags, tok->ident, tok->len);
     if (ty)
       return ty;
   }
   return NULL;
 }
 
+#define NODE_SIZE(member) (offsetof(Node, member) + sizeof(((Node *)0)->member))
+
+// Returns the size of a node of a given kind, which is just enough
+// for the kind-specific members it uses.
+int node_size(NodeKind kind) {
+  switch (kind) {
+  case ND_IF:
+  case ND_COND:
+  case ND_FOR:
+  case ND_DO:
+    return NODE_SIZE(cont_label);
+  case ND_SWITCH:
+    return NODE_SIZE(default_case);
+  case ND_CASE:
+    return NODE_SIZE(case_next);
+  case ND_GOTO:
+  case ND_LABEL:
+  case ND_LABEL_VAL:
+    return NODE_SIZE(goto_next);
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    return NODE_SIZE(body);
+  case ND_MEMBER:
+    return NODE_SIZE(member);
+  case ND_FUNCALL:
+    return NODE_SIZE(ret_buffer);
+  case ND_ASM:
+    return NODE_SIZE(asm_str);
+  case ND_VAR:
+  case ND_VLA_PTR:
+  case ND_MEMZERO:
+    return NODE_SIZE(var);
+  case ND_NUM:
+    return NODE_SIZE(fval);
+  default:
+    return offsetof(Node, cond);
+  }
+}
+
 static Node *new_node(NodeKind kind, Token *tok) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = arena_alloc(&node_arena, node_size(kind));
   node->kind = kind;
   node->tok = tok;
   return node;
@@ -231,6 +297,11 @@ static Node *new_ulong(long val, Token *tok) {
 static Node *new_var_node(Obj *var, Token *tok) {
   Node *node = new_node(ND_VAR, tok);
   node->var = var;
+
+  // Remember which global objects a function refers to, so that
+  // unreferenced static functions and variables can be discarded.
+  if (current_fn && !var->is_local)
+    strarray_push(&current_fn->refs, var->name);
   return node;
 }
 
@@ -243,22 +314,20 @@ static Node *new_vla_ptr(Obj *var, Token *tok) {
 Node *new_cast(Node *expr, Type *ty) {
   add_type(expr);
 
-  Node *node = calloc(1, sizeof(Node));
-  node->kind = ND_CAST;
-  node->tok = expr->tok;
+  Node *node = new_node(ND_CAST, expr->tok);
   node->lhs = expr;
   node->ty = copy_type(ty);
   return node;
 }
 
 static VarScope *push_scope(char *name) {
-  VarScope *sc = calloc(1, sizeof(VarScope));
+  VarScope *sc = arena_alloc(&obj_arena, sizeof(VarScope));
   hashmap_put(&scope->vars, name, sc);
   return sc;
 }
 
 static Initializer *new_initializer(Type *ty, bool is_flexible) {
-  Initializer *init = calloc(1, sizeof(Initializer));
+  Initializer *init = arena_alloc(&init_arena, sizeof(Initializer));
   init->ty = ty;
 
   if (ty->kind == TY_ARRAY) {
@@ -267,7 +336,7 @@ static Initializer *new_initializer(Type *ty, bool is_flexible) {
       return init;
     }
 
-    init->children = calloc(ty->array_len, sizeof(Initializer *));
+    init->children = arena_alloc(&init_arena, sizeof(Initializer *) * ty->array_len);
     for (int i = 0; i < ty->array_len; i++)
       init->children[i] = new_initializer(ty->base, false);
     return init;
@@ -279,11 +348,11 @@ static Initializer *new_initializer(Type *ty, bool is_flexible) {
     for (Member *mem = ty->members; mem; mem = mem->next)
       len++;
 
-    init->children = calloc(len, sizeof(Initializer *));
+    init->children = arena_alloc(&init_arena, sizeof(Initializer *) * len);
 
     for (Member *mem = ty->members; mem; mem = mem->next) {
       if (is_flexible && ty->is_flexible && !mem->next) {
-        Initializer *child = calloc(1, sizeof(Initializer));
+        Initializer *child = arena_alloc(&init_arena, sizeof(Initializer));
         child->ty = mem->ty;
         child->is_flexible = true;
         init->children[mem->idx] = child;
@@ -298,7 +367,7 @@ static Initializer *new_initializer(Type *ty, bool is_flexible) {
 }
 
 static Obj *new_var(char *name, Type *ty) {
-  Obj *var = calloc(1, sizeof(Obj));
+  Obj *var = arena_alloc(&obj_arena, sizeof(Obj));
   var->name = name;
   var->ty = ty;
   var->align = ty->align;
@@ -324,8 +393,7 @@ static Obj *new_gvar(char *name, Type *ty) {
 }
 
 static char *new_unique_name(void) {
-  static int id = 0;
-  return format("__L_%d", id++);
+  return format("__L_%d", unique_id++);
 }
 
 static Obj *new_anon_gvar(Type *ty) {
@@ -338,14 +406,22 @@ static Obj *new_string_literal(char *p, Type *ty) {
   return var;
 }
 
+// In whole-program mode, static objects in different translation
+// units may have the same name, so we give them unique names.
+static char *static_name(char *name) {
+  if (tu_index)
+    return format("__tu%d_%s", tu_index, name);
+  return name;
+}
+
 static char *get_ident(Token *tok) {
   if (tok->kind != TK_IDENT)
     error_tok(tok, "expected an identifier");
-  return strndup(tok->loc, tok->len);
+  return tok->ident;
 }
 
 static Type *find_typedef(Token *tok) {
-  if (tok->kind == TK_IDENT) {
+  if (tok->kind == TK_IDENT && (tok->ident[-1] & IDENT_TYPEDEF)) {
     VarScope *sc = find_var(tok);
     if (sc)
       return sc->type_def;
@@ -354,7 +430,7 @@ static Type *find_typedef(Token *tok) {
 }
 
 static void push_tag_scope(Token *tok, Type *ty) {
-  hashmap_put2(&scope->tags, tok->loc, tok->len, ty);
+  hashmap_put2(&scope->tags, tok->ident, tok->len, ty);
 }
 
 // declspec = ("void" | "_Bool" | "char" | "short" | "int" | "long"
@@ -1254,7 +1330,7 @@ static Type *copy_struct_type(Type *ty) {
   Member head = {};
   Member *cur = &head;
   for (Member *mem = ty->members; mem; mem = mem->next) {
-    Member *m = calloc(1, sizeof(Member));
+    Member *m = arena_alloc(&type_arena, sizeof(Member));
     *m = *mem;
     cur = cur->next = m;
   }
@@ -1442,7 +1518,7 @@ write_gvar_data(Relocation *cur, Initializer *init, Type *ty, char *buf, int off
     return cur;
   }
 
-  Relocation *rel = calloc(1, sizeof(Relocation));
+  Relocation *rel = arena_alloc(&obj_arena, sizeof(Relocation));
   rel->offset = offset;
   rel->label = label;
   rel->addend = val;
@@ -1466,9 +1542,9 @@ static void gvar_initializer(Token **rest, Token *tok, Obj *var) {
 
 // Returns true if a given token represents a type.
 static bool is_typename(Token *tok) {
-  static HashMap map;
+  static bool init;
 
-  if (map.capacity == 0) {
+  if (!init) {
     static char *kw[] = {
       "void", "_Bool", "char", "short", "int", "long", "struct", "union",
       "typedef", "enum", "static", "extern", "_Alignas", "signed", "unsigned",
@@ -1477,10 +1553,13 @@ static bool is_typename(Token *tok) {
     };
 
     for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-      hashmap_put(&map, kw[i], (void *)1);
+      intern(kw[i], strlen(kw[i]))[-1] |= IDENT_TYPENAME;
+    init = true;
   }
 
-  return hashmap_get2(&map, tok->loc, tok->len) || find_typedef(tok);
+  if (!tok->ident)
+    return false;
+  return (tok->ident[-1] & IDENT_TYPENAME) || find_typedef(tok);
 }
 
 // asm-stmt = "asm" ("volatile" | "inline")* "(" string-literal ")"
@@ -1715,7 +1794,7 @@ static Node *stmt(Token **rest, Token *tok) {
 
   if (tok->kind == TK_IDENT && equal(tok->next, ":")) {
     Node *node = new_node(ND_LABEL, tok);
-    node->label = strndup(tok->loc, tok->len);
+    node->label = tok->ident;
     node->unique_label = new_unique_name();
     node->lhs = stmt(rest, tok->next->next);
     node->goto_next = labels;
@@ -2465,7 +2544,7 @@ static void struct_members(Token **rest, Token *tok, Type *ty) {
     // Anonymous struct member
     if ((basety->kind == TY_STRUCT || basety->kind == TY_UNION) &&
         consume(&tok, tok, ";")) {
-      Member *mem = calloc(1, sizeof(Member));
+      Member *mem = arena_alloc(&type_arena, sizeof(Member));
       mem->ty = basety;
       mem->idx = idx++;
       mem->align = attr.align ? attr.align : mem->ty->align;
@@ -2479,7 +2558,7 @@ static void struct_members(Token **rest, Token *tok, Type *ty) {
         tok = skip(tok, ",");
       first = false;
 
-      Member *mem = calloc(1, sizeof(Member));
+      Member *mem = arena_alloc(&type_arena, sizeof(Member));
       mem->ty = declarator(&tok, tok, basety);
       mem->name = mem->ty->name;
       mem->idx = idx++;
@@ -2573,7 +2652,7 @@ static Type *struct_union_decl(Token **rest, Token *tok) {
   if (tag) {
     // If this is a redefinition, overwrite a previous type.
     // Otherwise, register the struct type.
-    Type *ty2 = hashmap_get2(&scope->tags, tag->loc, tag->len);
+    Type *ty2 = hashmap_get2(&scope->tags, tag->ident, tag->len);
     if (ty2) {
       *ty2 = *ty;
       return ty2;
@@ -2975,14 +3054,6 @@ static Node *primary(Token **rest, Token *tok) {
     VarScope *sc = find_var(tok);
     *rest = tok->next;
 
-    // For "static inline" function
-    if (sc && sc->var && sc->var->is_function) {
-      if (current_fn)
-        strarray_push(&current_fn->refs, sc->var->name);
-      else
-        sc->var->is_root = true;
-    }
-
     if (sc) {
       if (sc->var)
         return new_var_node(sc->var, tok);
@@ -3029,7 +3100,9 @@ static Token *parse_typedef(Token *tok, Type *basety) {
     Type *ty = declarator(&tok, tok, basety);
     if (!ty->name)
       error_tok(ty->name_pos, "typedef name omitted");
-    push_scope(get_ident(ty->name))->type_def = ty;
+    char *name = get_ident(ty->name);
+    name[-1] |= IDENT_TYPEDEF;
+    push_scope(name)->type_def = ty;
   }
   return tok;
 }
@@ -3075,19 +3148,47 @@ static Obj *find_func(char *name) {
   return NULL;
 }
 
-static void mark_live(Obj *var) {
-  if (!var->is_function || var->is_live)
+// Mark a given object and everything it refers to as live. Functions
+// refer to other objects by name through `refs`, and initialized
+// variables refer to other objects through their relocations.
+static void mark_live(Obj *var, HashMap *map) {
+  if (var->is_live)
     return;
   var->is_live = true;
 
   for (int i = 0; i < var->refs.len; i++) {
-    Obj *fn = find_func(var->refs.data[i]);
-    if (fn)
-      mark_live(fn);
+    Obj *var2 = hashmap_get(map, var->refs.data[i]);
+    if (var2)
+      mark_live(var2, map);
+  }
+
+  for (Relocation *rel = var->rel; rel; rel = rel->next) {
+    Obj *var2 = hashmap_get(map, *rel->label);
+    if (var2)
+      mark_live(var2, map);
   }
 }
 
+// Static functions and variables are not visible from other
+// translation units, so we don't have to emit them unless they are
+// reachable from a non-static object. This is our equivalent of the
+// linker's section garbage collection, and it matters because
+// program images are ROM-size-bound.
+static void gc_globals(Obj *prog) {
+  // If there are both a declaration and a definition of the same
+  // name, references resolve to the definition.
+  HashMap map = {};
+  for (Obj *var = prog; var; var = var->next)
+    if (var->is_definition || !hashmap_get(&map, var->name))
+      hashmap_put(&map, var->name, var);
+
+  for (Obj *var = prog; var; var = var->next)
+    if (var->is_root)
+      mark_live(var, &map);
+}
+
 static Token *function(Token *tok, Type *basety, VarAttr *attr) {
+  int first_id = unique_id;
   Type *ty = declarator(&tok, tok, basety);
   if (!ty->name)
     error_tok(ty->name_pos, "function name omitted");
@@ -3109,9 +3210,11 @@ static Token *function(Token *tok, Type *basety, VarAttr *attr) {
     fn->is_definition = equal(tok, "{");
     fn->is_static = attr->is_static || (attr->is_inline && !attr->is_extern);
     fn->is_inline = attr->is_inline;
+    if (fn->is_static)
+      fn->name = static_name(fn->name);
   }
 
-  fn->is_root = !(fn->is_static && fn->is_inline);
+  fn->is_root = !fn->is_static;
 
   if (consume(&tok, tok, ";"))
     return tok;
@@ -3133,12 +3236,17 @@ static Token *function(Token *tok, Type *basety, VarAttr *attr) {
     fn->va_area = new_lvar("__va_area__", array_of(ty_char, 74));
   fn->alloca_bottom = new_lvar("__alloca_size__", pointer_to(ty_char));
 
+  fn->body_begin = tok;
   tok = skip(tok, "{");
 
   fn->body = compound_stmt(&tok, tok);
+  fn->body_end = tok;
   fn->locals = locals;
   leave_scope();
   resolve_goto_labels();
+  fn->first_id = first_id;
+  fn->last_id = unique_id;
+  current_fn = NULL;
   return tok;
 }
 
@@ -3155,8 +3263,12 @@ static Token *global_variable(Token *tok, Type *basety, VarAttr *attr) {
       error_tok(ty->name_pos, "variable name omitted");
 
     Obj *var = new_gvar(get_ident(ty->name), ty);
+    var->tok = ty->name;
     var->is_definition = !attr->is_extern;
     var->is_static = attr->is_static;
+    var->is_root = !attr->is_static;
+    if (var->is_static)
+      var->name = static_name(var->name);
     if (attr->align)
       var->align = attr->align;
 
@@ -3179,8 +3291,20 @@ static bool is_function(Token *tok) {
   return ty->kind == TY_FUNC;
 }
 
-// Remove redundant tentative definitions.
+// Remove redundant tentative definitions. A tentative definition is
+// dropped if there is an initialized definition of the same name or
+// another tentative one is kept. Two initialized definitions of the
+// same name are an error.
 static void scan_globals(void) {
+  HashMap defs = {};
+  for (Obj *var = globals; var; var = var->next) {
+    if (var->is_function || !var->is_definition || var->is_tentative)
+      continue;
+    if (hashmap_get(&defs, var->name))
+      error_tok(var->tok, "redefinition of %s", var->name);
+    hashmap_put(&defs, var->name, var);
+  }
+
   Obj head;
   Obj *cur = &head;
 
@@ -3190,16 +3314,10 @@ static void scan_globals(void) {
       continue;
     }
 
-    // Find another definition of the same identifier.
-    Obj *var2 = globals;
-    for (; var2; var2 = var2->next)
-      if (var != var2 && var2->is_definition && !strcmp(var->name, var2->name))
-        break;
-
-    // If there's another definition, the tentative definition
-    // is redundant
-    if (!var2)
+    if (!hashmap_get(&defs, var->name)) {
+      hashmap_put(&defs, var->name, var);
       cur = cur->next = var;
+    }
   }
 
   cur->next = NULL;
@@ -3214,11 +3332,35 @@ static void declare_builtin_functions(void) {
 }
 
 // program = (typedef | function-definition | global-variable)*
-Obj *parse(Token *tok) {
-  declare_builtin_functions();
+// Starts with the global scope of a precompiled header.
+static void restore_parser_state(ParserState *st) {
+  for (int i = 0; i < st->num_vars; i++) {
+    hashmap_put(&scope->vars, st->var_names[i], st->vars[i]);
+    if (st->vars[i]->type_def)
+      st->var_names[i][-1] |= IDENT_TYPEDEF;
+  }
+  for (int i = 0; i < st->num_tags; i++)
+    hashmap_put(&scope->tags, st->tag_names[i], st->tags[i]);
+
+  globals = st->globals;
+  builtin_alloca = st->builtin_alloca;
+  unique_id = st->unique_id;
+}
+
+static Obj *parse_tu(Token *tok) {
+  scope = calloc(1, sizeof(Scope));
   globals = NULL;
+  if (pch_state)
+    restore_parser_state(pch_state);
+  else
+    declare_builtin_functions();
+  pch_state = NULL;
 
   while (tok->kind != TK_EOF) {
+    // Initializers of the previous declaration have been lowered to
+    // nodes or data by now.
+    arena_release(&init_arena);
+
     VarAttr attr = {};
     Type *basety = declspec(&tok, tok, &attr);
 
@@ -3238,11 +3380,101 @@ Obj *parse(Token *tok) {
     tok = global_variable(tok, basety, &attr);
   }
 
-  for (Obj *var = globals; var; var = var->next)
-    if (var->is_root)
-      mark_live(var);
-
   // Remove redundant tentative definitions.
   scan_globals();
   return globals;
 }
+
+Obj *parse(Token *tok) {
+  unique_id = 0;
+  Obj *prog = parse_tu(tok);
+
+  // Discard unreferenced static objects.
+  gc_globals(prog);
+  return prog;
+}
+
+// Parse all translation units of a program into a single list of
+// objects. Like GCC's -fwhole-program, we assume that no one outside
+// of the program refers to its objects, so everything that is not
+// reachable from main() is discarded.
+Obj *parse_whole_program(Token **tus, int len) {
+  Obj head = {};
+  Obj *cur = &head;
+
+  for (int i = 0; i < len; i++) {
+    tu_index = i + 1;
+    for (cur->next = parse_tu(tus[i]); cur->next; cur = cur->next);
+  }
+  tu_index = 0;
+
+  // Tentative definitions are resolved across translation units too.
+  globals = head.next;
+  scan_globals();
+
+  for (Obj *var = globals; var; var = var->next)
+    var->is_root = var->is_definition && !strcmp(var->name, "main");
+
+  gc_globals(globals);
+  return globals;
+}
+
+static uint32_t write_var_scope(VarScope *sc) {
+  uint32_t off = pch_alloc(sc, sizeof(VarScope));
+  pch_obj(off + offsetof(VarScope, var), sc->var);
+  pch_type(off + offsetof(VarScope, type_def), sc->type_def);
+  pch_type(off + offsetof(VarScope, enum_ty), sc->enum_ty);
+  return off;
+}
+
+static uint32_t write_names(char **names, int len) {
+  uint32_t off = pch_alloc(names, sizeof(char *) * len);
+  for (int i = 0; i < len; i++)
+    pch_ident(off + sizeof(char *) * i, names[i]);
+  return off;
+}
+
+// Parses a header and writes the global scope and the objects it
+// has declared.
+uint32_t write_parser_state(Token *tok) {
+  unique_id = 0;
+  parse_tu(tok);
+
+  ParserState st = {globals, builtin_alloca, unique_id};
+  HashEntry *ent;
+
+  st.var_names = calloc(scope->vars.capacity, sizeof(char *));
+  st.vars = calloc(scope->vars.capacity, sizeof(VarScope *));
+  for (int i = 0; (ent = hashmap_next(&scope->vars, &i));) {
+    st.var_names[st.num_vars] = strndup(ent->key, ent->keylen);
+    st.vars[st.num_vars++] = ent->val;
+  }
+
+  st.tag_names = calloc(scope->tags.capacity, sizeof(char *));
+  st.tags = calloc(scope->tags.capacity, sizeof(Type *));
+  for (int i = 0; (ent = hashmap_next(&scope->tags, &i));) {
+    st.tag_names[st.num_tags] = strndup(ent->key, ent->keylen);
+    st.tags[st.num_tags++] = ent->val;
+  }
+
+  uint32_t off = pch_alloc(&st, sizeof(st));
+  pch_obj(off + offsetof(ParserState, globals), st.globals);
+  pch_obj(off + offsetof(ParserState, builtin_alloca), st.builtin_alloca);
+  pch_ptr(off + offsetof(ParserState, var_names), write_names(st.var_names, st.num_vars));
+  pch_ptr(off + offsetof(ParserState, tag_names), write_names(st.tag_names, st.num_tags));
+
+  uint32_t vars = pch_alloc(st.vars, sizeof(VarScope *) * st.num_vars);
+  for (int i = 0; i < st.num_vars; i++)
+    pch_ptr(vars + sizeof(VarScope *) * i, write_var_scope(st.vars[i]));
+  pch_ptr(off + offsetof(ParserState, vars), vars);
+
+  uint32_t tags = pch_alloc(st.tags, sizeof(Type *) * st.num_tags);
+  for (int i = 0; i < st.num_tags; i++)
+    pch_type(tags + sizeof(Type *) * i, st.tags[i]);
+  pch_ptr(off + offsetof(ParserState, tags), tags);
+  return off;
+}
+
+void read_parser_state(void *state) {
+  pch_state = state;
+}
@@ -0,0 +1,523 @@
+// This file reads and writes precompiled headers.
+//
+// A precompiled header is an image of the objects that the
+// preprocessor and the parser have created for a header: macros,
+// tokens, types, global variables and functions. Pointers in the image
+// are offsets from its beginning, and a relocation table lists where
+// they are. read_pch() maps the file and adds the address at which it
+// was mapped to each of them, so that the objects can be used in
+// place without being copied.
+//
+// Identifiers must be compared by address (see intern()), so pointers
+// to them are listed separately and replaced with the strings of the
+// same spelling that this process has interned.
+//
+// A reference to an object that hasn't been written yet is queued
+// instead of being followed, so that writing a long linked list
+// doesn't recurse deeply.
+
+#include "chibicc.h"
+
+#define PCH_MAGIC "chibipch"
+
+typedef struct {
+  char magic[8];
+  uint32_t layout;
+  uint32_t size;
+  uint32_t relocs;
+  uint32_t num_relocs;
+  uint32_t idents;
+  uint32_t num_idents;
+  uint32_t files;
+  uint32_t num_files;
+  uint32_t pp_state;
+  uint32_t parser_state;
+  int64_t exe_size;
+  int64_t exe_mtime_sec;
+  int64_t exe_mtime_nsec;
+} PchHeader;
+
+// A source file the image depends on. If it has been modified, the
+// image is stale.
+typedef struct {
+  File *file;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size;
+} PchFile;
+
+typedef enum {
+  REF_TOKEN,
+  REF_TOKEN_LIST,
+  REF_TYPE,
+  REF_MEMBER,
+  REF_OBJ,
+  REF_NODE,
+  REF_RELOCATION,
+  REF_LABEL,
+} RefKind;
+
+// A pointer to be written to `slot` once the object it points to has
+// been written
+typedef struct {
+  RefKind kind;
+  uint32_t slot;
+  void *ptr;
+} Ref;
+
+static char *image;
+static uint32_t image_len;
+static uint32_t image_cap;
+
+// Maps the address of each object written so far to its offset.
+static HashMap offsets;
+
+static uint32_t *relocs;
+static int num_relocs;
+static uint32_t *idents;
+static int num_idents;
+
+static Ref *refs;
+static int num_refs;
+static Ref *labels;
+static int num_labels;
+
+// Pointers in the image are only valid for the compiler that wrote it.
+static uint32_t layout(void) {
+  return (sizeof(Token) << 24) ^ (sizeof(Type) << 16) ^ (sizeof(Obj) << 8) ^
+         sizeof(Node) ^ 1;
+}
+
+// The layout does not change with every rebuild of the compiler, so
+// the image also records the size and mtime of the compiler binary,
+// as the compile cache does.
+static void set_compiler(PchHeader *h) {
+  struct stat st;
+  if (stat("/proc/self/exe", &st))
+    return;
+  h->exe_size = st.st_size;
+  h->exe_mtime_sec = st.st_mtim.tv_sec;
+  h->exe_mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+static void push_u32(uint32_t **arr, int *len, uint32_t val) {
+  if ((*len & (*len - 1)) == 0)
+    *arr = realloc(*arr, sizeof(uint32_t) * (*len ? *len * 2 : 1));
+  (*arr)[(*len)++] = val;
+}
+
+static void push_ref(Ref **arr, int *len, RefKind kind, uint32_t slot, void *ptr) {
+  if ((*len & (*len - 1)) == 0)
+    *arr = realloc(*arr, sizeof(Ref) * (*len ? *len * 2 : 1));
+  (*arr)[(*len)++] = (Ref){kind, slot, ptr};
+}
+
+static uint32_t find_offset(void *ptr) {
+  return (uintptr_t)hashmap_get2(&offsets, (char *)&ptr, sizeof(ptr));
+}
+
+static void add_offset(void *ptr, uint32_t off) {
+  void **key = calloc(1, sizeof(void *));
+  *key = ptr;
+  hashmap_put2(&offsets, (char *)key, sizeof(void *), (void *)(uintptr_t)off);
+}
+
+// Copies an object to the image and returns its offset. The pointers
+// in the copy must be overwritten by the caller.
+uint32_t pch_alloc(void *ptr, int size) {
+  uint32_t off = align_to(image_len, 16);
+  if (off + size > image_cap) {
+    image_cap = MAX(image_cap * 2, off + size);
+    image = realloc(image, image_cap);
+  }
+  memset(image + image_len, 0, off - image_len);
+  memcpy(image + off, ptr, size);
+  image_len = off + size;
+  add_offset(ptr, off);
+  return off;
+}
+
+// Writes a pointer to the object at offset `off` to `slot`.
+void pch_ptr(uint32_t slot, uint32_t off) {
+  *(uint64_t *)(image + slot) = off;
+  if (off)
+    push_u32(&relocs, &num_relocs, slot);
+}
+
+static uint32_t write_bytes(char *p, int len) {
+  if (!p)
+    return 0;
+  uint32_t off = find_offset(p);
+  return off ? off : pch_alloc(p, len);
+}
+
+void pch_bytes(uint32_t slot, char *p, int len) {
+  pch_ptr(slot, write_bytes(p, len));
+}
+
+void pch_str(uint32_t slot, char *s) {
+  pch_ptr(slot, s ? write_bytes(s, strlen(s) + 1) : 0);
+}
+
+void pch_ident(uint32_t slot, char *s) {
+  pch_str(slot, s);
+  if (s)
+    push_u32(&idents, &num_idents, slot);
+}
+
+static void add_ref(RefKind kind, uint32_t slot, void *ptr) {
+  uint32_t off = ptr ? find_offset(ptr) : 0;
+  if (off || !ptr)
+    pch_ptr(slot, off);
+  else
+    push_ref(&refs, &num_refs, kind, slot, ptr);
+}
+
+void pch_token(uint32_t slot, Token *tok) { add_ref(REF_TOKEN, slot, tok); }
+void pch_tokens(uint32_t slot, Token *tok) { add_ref(REF_TOKEN_LIST, slot, tok); }
+void pch_type(uint32_t slot, Type *ty) { add_ref(REF_TYPE, slot, ty); }
+void pch_obj(uint32_t slot, Obj *var) { add_ref(REF_OBJ, slot, var); }
+static void pch_member(uint32_t slot, Member *mem) { add_ref(REF_MEMBER, slot, mem); }
+static void pch_node(uint32_t slot, Node *node) { add_ref(REF_NODE, slot, node); }
+
+#define SLOT(off, type, member) ((off) + offsetof(type, member))
+
+static uint32_t write_file(File *file) {
+  uint32_t off = find_offset(file);
+  if (off)
+    return off;
+
+  off = pch_alloc(file, sizeof(File));
+  pch_str(SLOT(off, File, name), file->name);
+  pch_str(SLOT(off, File, contents), file->contents);
+  pch_str(SLOT(off, File, display_name), file->display_name);
+  pch_ptr(SLOT(off, File, line_starts), 0);
+  ((File *)(image + off))->num_lines = 0;
+  return off;
+}
+
+// The tokens that declarations refer to are written without their
+// successors. Hidesets are only used during preprocessing.
+static uint32_t write_token(Token *tok, bool follow) {
+  uint32_t off = pch_alloc(tok, sizeof(Token));
+  if (follow && tok->kind != TK_EOF)
+    pch_tokens(SLOT(off, Token, next), tok->next);
+  else
+    pch_ptr(SLOT(off, Token, next), 0);
+
+  pch_type(SLOT(off, Token, ty), tok->ty);
+  if (tok->kind == TK_STR)
+    pch_bytes(SLOT(off, Token, str), tok->str, tok->ty->size);
+  else
+    pch_ptr(SLOT(off, Token, str), 0);
+  pch_ident(SLOT(off, Token, ident), tok->ident);
+
+  char *contents = tok->file->contents;
+  if (tok->loc < contents)
+    error("%s: internal error: token out of its file", tok->file->name);
+  uint32_t file = write_file(tok->file);
+  uint32_t loc = find_offset(contents) + (tok->loc - contents);
+  pch_ptr(SLOT(off, Token, loc), loc);
+  pch_ptr(SLOT(off, Token, file), file);
+
+  pch_str(SLOT(off, Token, filename), tok->filename);
+  pch_ptr(SLOT(off, Token, hideset), 0);
+  pch_token(SLOT(off, Token, origin), tok->origin);
+  return off;
+}
+
+static uint32_t write_type(Type *ty) {
+  uint32_t off = pch_alloc(ty, sizeof(Type));
+  pch_type(SLOT(off, Type, origin), ty->origin);
+  pch_type(SLOT(off, Type, base), ty->base);
+  pch_token(SLOT(off, Type, name), ty->name);
+  pch_token(SLOT(off, Type, name_pos), ty->name_pos);
+  pch_node(SLOT(off, Type, vla_len), ty->vla_len);
+  pch_obj(SLOT(off, Type, vla_size), ty->vla_size);
+  pch_member(SLOT(off, Type, members), ty->members);
+  pch_type(SLOT(off, Type, return_ty), ty->return_ty);
+  pch_type(SLOT(off, Type, params), ty->params);
+  pch_type(SLOT(off, Type, next), ty->next);
+  return off;
+}
+
+static uint32_t write_member(Member *mem) {
+  uint32_t off = pch_alloc(mem, sizeof(Member));
+  pch_member(SLOT(off, Member, next), mem->next);
+  pch_type(SLOT(off, Member, ty), mem->ty);
+  pch_token(SLOT(off, Member, tok), mem->tok);
+  pch_token(SLOT(off, Member, name), mem->name);
+  return off;
+}
+
+static uint32_t write_obj(Obj *var) {
+  uint32_t off = pch_alloc(var, sizeof(Obj));
+  pch_obj(SLOT(off, Obj, next), var->next);
+  pch_str(SLOT(off, Obj, name), var->name);
+  add_offset(&var->name, SLOT(off, Obj, name));
+  pch_type(SLOT(off, Obj, ty), var->ty);
+  pch_token(SLOT(off, Obj, tok), var->tok);
+  pch_bytes(SLOT(off, Obj, init_data), var->init_data, var->ty->size);
+  add_ref(REF_RELOCATION, SLOT(off, Obj, rel), var->rel);
+  pch_obj(SLOT(off, Obj, params), var->params);
+  pch_node(SLOT(off, Obj, body), var->body);
+  pch_obj(SLOT(off, Obj, locals), var->locals);
+  pch_obj(SLOT(off, Obj, va_area), var->va_area);
+  pch_obj(SLOT(off, Obj, alloca_bottom), var->alloca_bottom);
+  // The bodies of functions defined in the header are not kept as
+  // tokens, so their code is not cached (see fn_cache_begin()).
+  pch_ptr(SLOT(off, Obj, body_begin), 0);
+  pch_ptr(SLOT(off, Obj, body_end), 0);
+
+  uint32_t data = 0;
+  if (var->refs.len) {
+    data = pch_alloc(var->refs.data, sizeof(char *) * var->refs.len);
+    for (int i = 0; i < var->refs.len; i++)
+      pch_str(data + sizeof(char *) * i, var->refs.data[i]);
+  }
+  pch_ptr(SLOT(off, Obj, refs.data), data);
+  ((Obj *)(image + off))->refs.capacity = var->refs.len;
+  return off;
+}
+
+static uint32_t write_node(Node *node) {
+  uint32_t off = pch_alloc(node, node_size(node->kind));
+  pch_node(SLOT(off, Node, next), node->next);
+  pch_type(SLOT(off, Node, ty), node->ty);
+  pch_token(SLOT(off, Node, tok), node->tok);
+  pch_node(SLOT(off, Node, lhs), node->lhs);
+  pch_node(SLOT(off, Node, rhs), node->rhs);
+
+  switch (node->kind) {
+  case ND_IF:
+  case ND_COND:
+  case ND_FOR:
+  case ND_DO:
+  case ND_SWITCH:
+    pch_node(SLOT(off, Node, cond), node->cond);
+    pch_node(SLOT(off, Node, then), node->then);
+    pch_node(SLOT(off, Node, els), node->els);
+    pch_node(SLOT(off, Node, init), node->init);
+    pch_node(SLOT(off, Node, inc), node->inc);
+    pch_str(SLOT(off, Node, brk_label), node->brk_label);
+    pch_str(SLOT(off, Node, cont_label), node->cont_label);
+    if (node->kind == ND_SWITCH) {
+      pch_node(SLOT(off, Node, case_next), node->case_next);
+      pch_node(SLOT(off, Node, default_case), node->default_case);
+    }
+    break;
+  case ND_CASE:
+    pch_str(SLOT(off, Node, label), node->label);
+    pch_str(SLOT(off, Node, unique_label), node->unique_label);
+    pch_node(SLOT(off, Node, goto_next), node->goto_next);
+    pch_ptr(SLOT(off, Node, brk_label), 0);
+    pch_ptr(SLOT(off, Node, cont_label), 0);
+    pch_node(SLOT(off, Node, case_next), node->case_next);
+    break;
+  case ND_GOTO:
+  case ND_LABEL:
+  case ND_LABEL_VAL:
+    pch_str(SLOT(off, Node, label), node->label);
+    pch_str(SLOT(off, Node, unique_label), node->unique_label);
+    add_offset(&node->unique_label, SLOT(off, Node, unique_label));
+    pch_node(SLOT(off, Node, goto_next), node->goto_next);
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    pch_node(SLOT(off, Node, body), node->body);
+    break;
+  case ND_MEMBER:
+    pch_member(SLOT(off, Node, member), node->member);
+    break;
+  case ND_FUNCALL:
+    pch_type(SLOT(off, Node, func_ty), node->func_ty);
+    pch_node(SLOT(off, Node, args), node->args);
+    pch_obj(SLOT(off, Node, ret_buffer), node->ret_buffer);
+    break;
+  case ND_ASM:
+    pch_str(SLOT(off, Node, asm_str), node->asm_str);
+    break;
+  case ND_VAR:
+  case ND_VLA_PTR:
+  case ND_MEMZERO:
+    pch_obj(SLOT(off, Node, var), node->var);
+    break;
+  default:
+    break;
+  }
+  return off;
+}
+
+// A relocation refers to the name of a variable or a label by the
+// address of the member that holds it.
+static uint32_t write_relocation(Relocation *rel) {
+  uint32_t off = pch_alloc(rel, sizeof(Relocation));
+  add_ref(REF_RELOCATION, SLOT(off, Relocation, next), rel->next);
+  push_ref(&labels, &num_labels, REF_LABEL, SLOT(off, Relocation, label), rel->label);
+  return off;
+}
+
+static void write_refs(void) {
+  while (num_refs > 0) {
+    Ref r = refs[--num_refs];
+    uint32_t off = find_offset(r.ptr);
+
+    if (!off) {
+      switch (r.kind) {
+      case REF_TOKEN:
+        off = write_token(r.ptr, false);
+        break;
+      case REF_TOKEN_LIST:
+        off = write_token(r.ptr, true);
+        break;
+      case REF_TYPE:
+        off = write_type(r.ptr);
+        break;
+      case REF_MEMBER:
+        off = write_member(r.ptr);
+        break;
+      case REF_OBJ:
+        off = write_obj(r.ptr);
+        break;
+      case REF_NODE:
+        off = write_node(r.ptr);
+        break;
+      case REF_RELOCATION:
+        off = write_relocation(r.ptr);
+        break;
+      default:
+        unreachable();
+      }
+    }
+    pch_ptr(r.slot, off);
+  }
+
+  for (int i = 0; i < num_labels; i++) {
+    uint32_t off = find_offset(labels[i].ptr);
+    if (!off)
+      error("internal error: unresolved relocation in a precompiled header");
+    pch_ptr(labels[i].slot, off);
+  }
+}
+
+static uint32_t write_u32_array(uint32_t *arr, int len) {
+  uint32_t off = align_to(image_len, 16);
+  int size = sizeof(uint32_t) * len;
+  image = realloc(image, off + size);
+  memset(image + image_len, 0, off - image_len);
+  memcpy(image + off, arr, size);
+  image_len = image_cap = off + size;
+  return off;
+}
+
+// Writes the state of the preprocessor and the parser after `tok`,
+// the tokens of a header, to a file.
+void write_pch(char *path, Token *tok) {
+  image_len = 0;
+  offsets = (HashMap){};
+  num_relocs = num_idents = num_refs = num_labels = 0;
+
+  PchHeader hdr = {PCH_MAGIC};
+  pch_alloc(&hdr, sizeof(hdr));
+
+  // The header itself and the files it includes
+  File **files = get_input_files();
+  int num_files = 0;
+  while (files[num_files])
+    num_files++;
+
+  PchFile *deps = calloc(num_files, sizeof(PchFile));
+  for (int i = 0; i < num_files; i++) {
+    struct stat st;
+    if (stat(files[i]->name, &st))
+      error("%s: %s", files[i]->name, strerror(errno));
+    deps[i].mtime_sec = st.st_mtim.tv_sec;
+    deps[i].mtime_nsec = st.st_mtim.tv_nsec;
+    deps[i].size = st.st_size;
+  }
+
+  uint32_t deps_off = pch_alloc(deps, sizeof(PchFile) * num_files);
+  for (int i = 0; i < num_files; i++)
+    pch_ptr(deps_off + sizeof(PchFile) * i, write_file(files[i]));
+
+  uint32_t pp_state = write_preprocessor_state();
+  uint32_t parser_state = write_parser_state(tok);
+  write_refs();
+
+  uint32_t idents_off = write_u32_array(idents, num_idents);
+  uint32_t relocs_off = write_u32_array(relocs, num_relocs);
+
+  PchHeader *h = (PchHeader *)image;
+  h->layout = layout();
+  set_compiler(h);
+  h->size = image_len;
+  h->relocs = relocs_off;
+  h->num_relocs = num_relocs;
+  h->idents = idents_off;
+  h->num_idents = num_idents;
+  h->files = deps_off;
+  h->num_files = num_files;
+  h->pp_state = pp_state;
+  h->parser_state = parser_state;
+
+  // Write to a temporary file first so that a concurrent reader
+  // never sees a partial image.
+  char *tmp = format("%s.tmp%d", path, getpid());
+  FILE *out = fopen(tmp, "w");
+  if (!out)
+    error("cannot open output file: %s: %s", tmp, strerror(errno));
+  fwrite(image, 1, image_len, out);
+  if (fclose(out) || rename(tmp, path)) {
+    unlink(tmp);
+    error("cannot write %s: %s", path, strerror(errno));
+  }
+}
+
+// Maps a precompiled header written by write_pch() and restores the
+// state of the preprocessor and the parser from it.
+void read_pch(char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    error("-include-pch: %s: %s", path, strerror(errno));
+
+  struct stat st;
+  char *base = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= sizeof(PchHeader))
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  PchHeader *hdr = (PchHeader *)base;
+  if (base == MAP_FAILED || memcmp(hdr->magic, PCH_MAGIC, 8) ||
+      hdr->size != st.st_size)
+    error("-include-pch: %s: not a precompiled header", path);
+  PchHeader cur = {};
+  set_compiler(&cur);
+  if (hdr->layout != layout() || hdr->exe_size != cur.exe_size ||
+      hdr->exe_mtime_sec != cur.exe_mtime_sec ||
+      hdr->exe_mtime_nsec != cur.exe_mtime_nsec)
+    error("-include-pch: %s: precompiled header was written by a different compiler", path);
+
+  uint32_t *relocs = (uint32_t *)(base + hdr->relocs);
+  for (int i = 0; i < hdr->num_relocs; i++)
+    *(char **)(base + relocs[i]) += (uintptr_t)base;
+
+  uint32_t *idents = (uint32_t *)(base + hdr->idents);
+  for (int i = 0; i < hdr->num_idents; i++) {
+    char **p = (char **)(base + idents[i]);
+    *p = intern(*p, strlen(*p));
+  }
+
+  PchFile *deps = (PchFile *)(base + hdr->files);
+  for (int i = 0; i < hdr->num_files; i++) {
+    char *name = deps[i].file->name;
+    if (stat(name, &st) || st.st_mtim.tv_sec != deps[i].mtime_sec ||
+        st.st_mtim.tv_nsec != deps[i].mtime_nsec || st.st_size != deps[i].size)
+      error("-include-pch: %s: %s has been modified since the precompiled header was built",
+            path, name);
+    add_input_file(deps[i].file);
+    add_pch_file(deps[i].file);
+  }
+
+  read_preprocessor_state(base + hdr->pp_state);
+  read_parser_state(base + hdr->parser_state);
+}
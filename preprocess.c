@@ -17,6 +17,11 @@
 // "hideset". Hideset is initially empty, and every time we expand a
 // macro, the macro name is added to the resulting tokens' hidesets.
 //
+// Macro names are interned, so a hideset is a sorted array of their
+// addresses. Hidesets are hash-consed: tokens with the same set of
+// names share one Hideset object, and the unions and intersections
+// computed during macro expansion are memoized.
+//
 // The above macro expansion algorithm is explained in this document
 // written by Dave Prossor, which is used as a basis for the
 // standard's wording:
@@ -48,6 +53,20 @@ struct Macro {
   char *va_args_name;
   Token *body;
   macro_handler_fn *handler;
+
+  // The full expansion of an object-like macro and the names it
+  // depends on. It stays valid until one of those names is defined or
+  // undefined. NULL if it can't be cached.
+  Token *expansion;
+  char **deps;
+  int num_deps;
+  int expansion_gen;
+  int expansion_epoch;
+
+  // Most macros are used once, if at all, so the expansion is cached
+  // only when a macro is used a second time. This is the epoch of the
+  // first use.
+  int use_epoch;
 };
 
 // `#if` can be nested, so we use a stack to manage nested `#if`s.
@@ -61,14 +80,105 @@ struct CondIncl {
 
 typedef struct Hideset Hideset;
 struct Hideset {
-  Hideset *next;
+  int len;
+  char *names[];
+};
+
+// The tokens of an included file are shared with the header cache
+// rather than copied into the token stream. When the end of the file
+// is reached, preprocessing continues with `rest`.
+typedef struct IncludeFrame IncludeFrame;
+struct IncludeFrame {
+  IncludeFrame *next;
+  Token *rest;
+};
+
+// Result of search_include_paths(). `path` is NULL if the file was
+// not found, and `idx` is the index of the include path it is in.
+typedef struct {
+  char *path;
+  int idx;
+} IncludeResult;
+
+// Result of detect_include_guard() for the cached tokens of a file
+typedef struct {
+  Token *tok;
   char *name;
+} IncludeGuard;
+
+// A macro defined (or undefined if `macro` is NULL) while a snapshot
+// was being recorded
+typedef struct MacroChange MacroChange;
+struct MacroChange {
+  MacroChange *next;
+  char *name;
+  Macro *macro;
 };
 
+// The state of the preprocessor after the #include lines at the
+// beginning of a file. See apply_snapshot().
+typedef struct {
+  Token *tok;
+  MacroChange *changes;
+  HashMap pragma_once;
+  int counter;
+  File **files;
+  int num_files;
+} Snapshot;
+
 static HashMap macros;
+
+// Incremented whenever a macro is defined or undefined.
+// `macro_changes` maps each name to the value it had when the name
+// last changed.
+static int macro_gen;
+static HashMap macro_changes;
+
+// Incremented for each translation unit and whenever the set of
+// macros is replaced, invalidating all cached macro expansions.
+static int macro_epoch;
 static CondIncl *cond_incl;
+static IncludeFrame *includes;
 static HashMap pragma_once;
+static HashMap include_guards;
+static HashMap include_cache;
 static int include_next_idx;
+static int counter;
+
+// The macros that each translation unit starts with, and a hash of
+// the -D and -U options that made them.
+static HashMap initial_macros;
+static uint64_t options_hash;
+static uint64_t initial_options_hash;
+
+// Include guards of the headers in a precompiled header read by
+// read_preprocessor_state(), keyed by file_id() because they may
+// have been included by different names. The guard is "" if a
+// header has "#pragma once". The headers are known to be unchanged.
+static HashMap pch_guards;
+static bool has_pch;
+
+// The Files of the precompiled header, keyed by file_id(), until
+// they are included. They are renamed after the path they are
+// included by, so that the output does not depend on the name a
+// header had when the precompiled header was built.
+static HashMap pch_files;
+
+static HashMap snapshots;
+static bool use_snapshots;
+static Arena snapshot_token_arena;
+static Arena snapshot_type_arena;
+
+// Set while a snapshot is being recorded
+static bool recording;
+static bool uses_volatile_macro;
+static MacroChange **last_change;
+
+// Hidesets and macro arguments only live during preprocessing.
+static Arena pp_arena;
+static HashMap hidesets;
+static HashMap hideset_unions;
+static HashMap hideset_intersections;
 
 static Token *preprocess2(Token *tok);
 static Macro *find_macro(Token *tok);
@@ -89,9 +199,10 @@ static Token *skip_line(Token *tok) {
 }
 
 static Token *copy_token(Token *tok) {
-  Token *t = calloc(1, sizeof(Token));
+  Token *t = arena_alloc(&token_arena, sizeof(Token));
   *t = *tok;
   t->next = NULL;
+  t->is_shared = false;
   return t;
 }
 
@@ -99,52 +210,137 @@ static Token *new_eof(Token *tok) {
   Token *t = copy_token(tok);
   t->kind = TK_EOF;
   t->len = 0;
+  t->ident = NULL;
   return t;
 }
 
+// The empty hideset is NULL.
+static Hideset *intern_hideset(char **names, int len) {
+  if (len == 0)
+    return NULL;
+
+  int keylen = len * sizeof(char *);
+  Hideset *hs = hashmap_get2(&hidesets, (char *)names, keylen);
+  if (hs)
+    return hs;
+
+  hs = arena_alloc(&pp_arena, sizeof(Hideset) + keylen);
+  hs->len = len;
+  memcpy(hs->names, names, keylen);
+  hashmap_put2(&hidesets, (char *)hs->names, keylen, hs);
+  return hs;
+}
+
 static Hideset *new_hideset(char *name) {
-  Hideset *hs = calloc(1, sizeof(Hideset));
-  hs->name = name;
+  return intern_hideset(&name, 1);
+}
+
+// Memoized results are looked up by the pair of operands. An empty
+// result is stored as `empty_hideset` because the map can't hold NULL.
+static Hideset empty_hideset;
+
+static Hideset *find_memo(HashMap *map, Hideset *hs1, Hideset *hs2) {
+  Hideset *key[] = {hs1, hs2};
+  return hashmap_get2(map, (char *)key, sizeof(key));
+}
+
+static Hideset *put_memo(HashMap *map, Hideset *hs1, Hideset *hs2, Hideset *hs) {
+  Hideset **key = arena_alloc(&pp_arena, sizeof(Hideset *) * 2);
+  key[0] = hs1;
+  key[1] = hs2;
+  hashmap_put2(map, (char *)key, sizeof(Hideset *) * 2, hs ? hs : &empty_hideset);
   return hs;
 }
 
 static Hideset *hideset_union(Hideset *hs1, Hideset *hs2) {
-  Hideset head = {};
-  Hideset *cur = &head;
-
-  for (; hs1; hs1 = hs1->next)
-    cur = cur->next = new_hideset(hs1->name);
-  cur->next = hs2;
-  return head.next;
+  if (!hs1 || hs1 == hs2)
+    return hs2;
+  if (!hs2)
+    return hs1;
+
+  Hideset *hs = find_memo(&hideset_unions, hs1, hs2);
+  if (hs)
+    return hs;
+
+  char **names = arena_alloc(&pp_arena, sizeof(char *) * (hs1->len + hs2->len));
+  int i = 0, j = 0, len = 0;
+  while (i < hs1->len && j < hs2->len) {
+    uintptr_t x = (uintptr_t)hs1->names[i];
+    uintptr_t y = (uintptr_t)hs2->names[j];
+    if (x < y) {
+      names[len++] = hs1->names[i++];
+    } else if (x > y) {
+      names[len++] = hs2->names[j++];
+    } else {
+      names[len++] = hs1->names[i++];
+      j++;
+    }
+  }
+  while (i < hs1->len)
+    names[len++] = hs1->names[i++];
+  while (j < hs2->len)
+    names[len++] = hs2->names[j++];
+  return put_memo(&hideset_unions, hs1, hs2, intern_hideset(names, len));
 }
 
-static bool hideset_contains(Hideset *hs, char *s, int len) {
-  for (; hs; hs = hs->next)
-    if (strlen(hs->name) == len && !strncmp(hs->name, s, len))
+static bool hideset_contains(Hideset *hs, char *name) {
+  if (!hs || !name)
+    return false;
+
+  int lo = 0, hi = hs->len;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (hs->names[mid] == name)
       return true;
+    if ((uintptr_t)hs->names[mid] < (uintptr_t)name)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
   return false;
 }
 
 static Hideset *hideset_intersection(Hideset *hs1, Hideset *hs2) {
-  Hideset head = {};
-  Hideset *cur = &head;
+  if (!hs1 || !hs2)
+    return NULL;
+  if (hs1 == hs2)
+    return hs1;
+
+  Hideset *hs = find_memo(&hideset_intersections, hs1, hs2);
+  if (hs)
+    return (hs == &empty_hideset) ? NULL : hs;
+
+  char **names = arena_alloc(&pp_arena, sizeof(char *) * MIN(hs1->len, hs2->len));
+  int len = 0;
+  for (int i = 0; i < hs1->len; i++)
+    if (hideset_contains(hs2, hs1->names[i]))
+      names[len++] = hs1->names[i];
+  return put_memo(&hideset_intersections, hs1, hs2, intern_hideset(names, len));
+}
 
-  for (; hs1; hs1 = hs1->next)
-    if (hideset_contains(hs2, hs1->name, strlen(hs1->name)))
-      cur = cur->next = new_hideset(hs1->name);
-  return head.next;
+// Adds `hs` to the hidesets of the tokens of a macro expansion up to
+// `end`. The tokens are fresh copies, so they are changed in place.
+static void add_hideset(Token *tok, Token *end, Hideset *hs, Token *origin) {
+  for (; tok != end; tok = tok->next) {
+    tok->hideset = hideset_union(tok->hideset, hs);
+    tok->origin = origin;
+  }
 }
 
-static Token *add_hideset(Token *tok, Hideset *hs) {
-  Token head = {};
-  Token *cur = &head;
+// The first token of a macro expansion takes the place of the macro
+// token, so it gets the macro token's spacing.
+static Token *start_expansion(Token *tok, Token *macro_token) {
+  if (tok->kind == TK_EOF)
+    return tok;
 
-  for (; tok; tok = tok->next) {
+  if (tok->is_shared) {
     Token *t = copy_token(tok);
-    t->hideset = hideset_union(t->hideset, hs);
-    cur = cur->next = t;
+    t->next = tok->next;
+    tok = t;
   }
-  return head.next;
+  tok->at_bol = macro_token->at_bol;
+  tok->has_space = macro_token->has_space;
+  return tok;
 }
 
 // Append tok2 to the end of tok1.
@@ -318,20 +514,44 @@ static CondIncl *push_cond_incl(Token *tok, bool included) {
 }
 
 static Macro *find_macro(Token *tok) {
-  if (tok->kind != TK_IDENT)
+  if (tok->kind != TK_IDENT || !(tok->ident[-1] & IDENT_MACRO))
     return NULL;
-  return hashmap_get2(&macros, tok->loc, tok->len);
+  return hashmap_get2(&macros, tok->ident, tok->len);
+}
+
+static void record_change(char *name, Macro *m) {
+  MacroChange *c = calloc(1, sizeof(MacroChange));
+  c->name = name;
+  c->macro = m;
+  *last_change = c;
+  last_change = &c->next;
+}
+
+static void macro_changed(char *name) {
+  hashmap_put(&macro_changes, name, (void *)(intptr_t)++macro_gen);
 }
 
 static Macro *add_macro(char *name, bool is_objlike, Token *body) {
   Macro *m = calloc(1, sizeof(Macro));
+  name = intern(name, strlen(name));
+  name[-1] |= IDENT_MACRO;
   m->name = name;
   m->is_objlike = is_objlike;
   m->body = body;
   hashmap_put(&macros, name, m);
+  macro_changed(name);
+  if (recording)
+    record_change(name, m);
   return m;
 }
 
+static void delete_macro(char *name) {
+  hashmap_delete(&macros, name);
+  macro_changed(intern(name, strlen(name)));
+  if (recording)
+    record_change(name, NULL);
+}
+
 static MacroParam *read_macro_params(Token **rest, Token *tok, char **va_args_name) {
   MacroParam head = {};
   MacroParam *cur = &head;
@@ -368,7 +588,7 @@ static MacroParam *read_macro_params(Token **rest, Token *tok, char **va_args_na
 static void read_macro_definition(Token **rest, Token *tok) {
   if (tok->kind != TK_IDENT)
     error_tok(tok, "macro name must be an identifier");
-  char *name = strndup(tok->loc, tok->len);
+  char *name = tok->ident;
   tok = tok->next;
 
   if (!tok->has_space && equal(tok, "(")) {
@@ -410,7 +630,7 @@ static MacroArg *read_macro_arg_one(Token **rest, Token *tok, bool read_rest) {
 
   cur->next = new_eof(tok);
 
-  MacroArg *arg = calloc(1, sizeof(MacroArg));
+  MacroArg *arg = arena_alloc(&pp_arena, sizeof(MacroArg));
   arg->tok = head.next;
   *rest = tok;
   return arg;
@@ -435,7 +655,7 @@ read_macro_args(Token **rest, Token *tok, MacroParam *params, char *va_args_name
   if (va_args_name) {
     MacroArg *arg;
     if (equal(tok, ")")) {
-      arg = calloc(1, sizeof(MacroArg));
+      arg = arena_alloc(&pp_arena, sizeof(MacroArg));
       arg->tok = new_eof(tok);
     } else {
       if (pp != params)
@@ -514,8 +734,9 @@ static bool has_varargs(MacroArg *args) {
   return false;
 }
 
-// Replace func-like macro parameters with given arguments.
-static Token *subst(Token *tok, MacroArg *args) {
+// Replace func-like macro parameters with given arguments. The
+// result is followed by `next`.
+static Token *subst(Token *tok, MacroArg *args, Token *next) {
   Token head = {};
   Token *cur = &head;
 
@@ -621,20 +842,97 @@ static Token *subst(Token *tok, MacroArg *args) {
     continue;
   }
 
-  cur->next = tok;
+  cur->next = next;
   return head.next;
 }
 
+// Returns true if none of the names a cached expansion depends on has
+// been defined or undefined since it was made.
+static bool expansion_is_valid(Macro *m) {
+  if (m->expansion_epoch != macro_epoch)
+    return false;
+  if (m->expansion_gen == macro_gen)
+    return true;
+
+  for (int i = 0; i < m->num_deps; i++)
+    if ((intptr_t)hashmap_get(&macro_changes, m->deps[i]) > m->expansion_gen)
+      return false;
+  m->expansion_gen = macro_gen;
+  return true;
+}
+
+static void add_dep(StringArray *deps, HashMap *seen, char *name) {
+  if (!hashmap_get(seen, name)) {
+    hashmap_put(seen, name, name);
+    strarray_push(deps, name);
+  }
+}
+
+// An object-like macro expands to the same tokens wherever it is used
+// if all macros it refers to, directly or indirectly, are object-like
+// macros without handlers. Returns its full expansion in that case,
+// or NULL otherwise. Macros that refer to each other are not cached.
+//
+// Either way, the result depends on the identifiers in the macro's
+// body and on what the macros among them depend on, so only a change
+// to one of those makes it stale.
+static Token *cached_expansion(Macro *m) {
+  if (expansion_is_valid(m))
+    return m->expansion;
+
+  m->expansion = NULL;
+  m->deps = NULL;
+  m->num_deps = 0;
+  m->expansion_gen = macro_gen;
+  m->expansion_epoch = macro_epoch;
+
+  StringArray deps = {};
+  HashMap seen = {};
+  bool ok = true;
+
+  for (Token *t = m->body; ok && t->kind != TK_EOF; t = t->next) {
+    if (t->kind != TK_IDENT)
+      continue;
+    add_dep(&deps, &seen, t->ident);
+
+    Macro *m2 = find_macro(t);
+    if (!m2 || m2 == m)
+      continue;
+    if (m2->handler || !m2->is_objlike || !cached_expansion(m2))
+      ok = false;
+    for (int i = 0; i < m2->num_deps; i++)
+      add_dep(&deps, &seen, m2->deps[i]);
+  }
+
+  free(seen.buckets);
+  m->deps = deps.data;
+  m->num_deps = deps.len;
+  if (!ok)
+    return NULL;
+
+  Token *end = new_eof(m->body);
+  Token *body = append(m->body, end);
+  add_hideset(body, end, new_hideset(m->name), NULL);
+  m->expansion = preprocess2(body);
+  return m->expansion;
+}
+
 // If tok is a macro, expand it and return true.
 // Otherwise, do nothing and return false.
 static bool expand_macro(Token **rest, Token *tok) {
-  if (hideset_contains(tok->hideset, tok->loc, tok->len))
+  if (hideset_contains(tok->hideset, tok->ident))
     return false;
 
   Macro *m = find_macro(tok);
   if (!m)
     return false;
 
+  // These expand differently in each translation unit.
+  if (recording &&
+      (!strcmp(m->name, "__DATE__") || !strcmp(m->name, "__TIME__") ||
+       !strcmp(m->name, "__TIMESTAMP__") || !strcmp(m->name, "__BASE_FILE__")))
+    uses_volatile_macro = true;
+
   // Built-in dynamic macro application such as __LINE__
   if (m->handler) {
     *rest = m->handler(tok);
@@ -643,14 +941,30 @@ static bool expand_macro(Token **rest, Token *tok) {
   }
 
   // Object-like macro application
+  Token *exp = NULL;
+  if (m->is_objlike) {
+    if (m->use_epoch == macro_epoch)
+      exp = cached_expansion(m);
+    m->use_epoch = macro_epoch;
+  }
+  if (exp) {
+    Token head = {};
+    Token *cur = &head;
+    for (Token *t = exp; t->kind != TK_EOF; t = t->next) {
+      cur = cur->next = copy_token(t);
+      cur->hideset = hideset_union(t->hideset, tok->hideset);
+      cur->origin = tok;
+    }
+    cur->next = tok->next;
+    *rest = start_expansion(head.next, tok);
+    return true;
+  }
+
   if (m->is_objlike) {
     Hideset *hs = hideset_union(tok->hideset, new_hideset(m->name));
-    Token *body = add_hideset(m->body, hs);
-    for (Token *t = body; t->kind != TK_EOF; t = t->next)
-      t->origin = tok;
-    *rest = append(body, tok->next);
-    (*rest)->at_bol = tok->at_bol;
-    (*rest)->has_space = tok->has_space;
+    Token *body = append(m->body, tok->next);
+    add_hideset(body, tok->next, hs, tok);
+    *rest = start_expansion(body, tok);
     return true;
   }
 
@@ -672,13 +986,9 @@ static bool expand_macro(Token **rest, Token *tok) {
   Hideset *hs = hideset_intersection(macro_token->hideset, rparen->hideset);
   hs = hideset_union(hs, new_hideset(m->name));
 
-  Token *body = subst(m->body, args);
-  body = add_hideset(body, hs);
-  for (Token *t = body; t->kind != TK_EOF; t = t->next)
-    t->origin = macro_token;
-  *rest = append(body, tok->next);
-  (*rest)->at_bol = macro_token->at_bol;
-  (*rest)->has_space = macro_token->has_space;
+  Token *body = subst(m->body, args, tok->next);
+  add_hideset(body, tok->next, hs, macro_token);
+  *rest = start_expansion(body, macro_token);
   return true;
 }
 
@@ -686,28 +996,30 @@ char *search_include_paths(char *filename) {
   if (filename[0] == '/')
     return filename;
 
-  static HashMap cache;
-  char *cached = hashmap_get(&cache, filename);
-  if (cached)
-    return cached;
-
-  // Search a file from the include paths.
-  for (int i = 0; i < include_paths.len; i++) {
-    char *path = format("%s/%s", include_paths.data[i], filename);
-    if (!file_exists(path))
-      continue;
-    hashmap_put(&cache, filename, path);
-    include_next_idx = i + 1;
-    return path;
+  IncludeResult *res = hashmap_get(&include_cache, filename);
+  if (!res) {
+    // Search a file from the include paths.
+    res = calloc(1, sizeof(IncludeResult));
+    for (int i = 0; i < include_paths.len; i++) {
+      if (file_exists_in(include_paths.data[i], filename)) {
+        res->path = format("%s/%s", include_paths.data[i], filename);
+        res->idx = i;
+        break;
+      }
+    }
+    hashmap_put(&include_cache, filename, res);
   }
-  return NULL;
+
+  if (res->path)
+    include_next_idx = res->idx + 1;
+  return res->path;
 }
 
 static char *search_include_next(char *filename) {
   for (; include_next_idx < include_paths.len; include_next_idx++) {
-    char *path = format("%s/%s", include_paths.data[include_next_idx], filename);
-    if (file_exists(path))
-      return path;
+    char *dir = include_paths.data[include_next_idx];
+    if (file_exists_in(dir, filename))
+      return format("%s/%s", dir, filename);
   }
   return NULL;
 }
@@ -769,9 +1081,10 @@ static char *detect_include_guard(Token *tok) {
     return NULL;
 
   char *macro = strndup(tok->loc, tok->len);
+  char *ident = tok->ident;
   tok = tok->next;
 
-  if (!is_hash(tok) || !equal(tok->next, "define") || !equal(tok->next->next, macro))
+  if (!is_hash(tok) || !equal(tok->next, "define") || tok->next->next->ident != ident)
     return NULL;
 
   // Read until the end of the file.
@@ -792,6 +1105,15 @@ static char *detect_include_guard(Token *tok) {
   return NULL;
 }
 
+// Returns a string identifying the file at a given path no matter
+// which name it is referred to by.
+static char *file_id(char *path) {
+  struct stat st;
+  if (stat(path, &st))
+    return NULL;
+  return format("%lx:%lx", (unsigned long)st.st_dev, (unsigned long)st.st_ino);
+}
+
 static Token *include_file(Token *tok, char *path, Token *filename_tok) {
   // Check for "#pragma once"
   if (hashmap_get(&pragma_once, path))
@@ -800,30 +1122,53 @@ static Token *include_file(Token *tok, char *path, Token *filename_tok) {
   // If we read the same file before, and if the file was guarded
   // by the usual #ifndef ... #endif pattern, we may be able to
   // skip the file without opening it.
-  static HashMap include_guards;
-  char *guard_name = hashmap_get(&include_guards, path);
-  if (guard_name && hashmap_get(&macros, guard_name))
+  IncludeGuard *guard = hashmap_get(&include_guards, path);
+  if (guard && guard->name && hashmap_get(&macros, guard->name) &&
+      guard->tok == find_header(path))
     return tok;
 
-  Token *tok2 = tokenize_file(path);
+  if (has_pch) {
+    char *id = file_id(path);
+    File *file = id ? hashmap_get(&pch_files, id) : NULL;
+    if (file) {
+      if (!strcmp(file->display_name, file->name))
+        file->display_name = path;
+      file->name = path;
+      hashmap_delete(&pch_files, id);
+    }
+
+    char *name = id ? hashmap_get(&pch_guards, id) : NULL;
+    if (name && (!*name || hashmap_get(&macros, name)))
+      return tok;
+  }
+
+  Token *tok2 = tokenize_header(path);
   if (!tok2)
     error_tok(filename_tok, "%s: cannot open file: %s", path, strerror(errno));
 
-  guard_name = detect_include_guard(tok2);
-  if (guard_name)
-    hashmap_put(&include_guards, path, guard_name);
+  if (!guard || guard->tok != tok2) {
+    guard = calloc(1, sizeof(IncludeGuard));
+    guard->tok = tok2;
+    guard->name = detect_include_guard(tok2);
+    hashmap_put(&include_guards, path, guard);
+  }
 
-  return append(tok2, tok);
+  IncludeFrame *frame = arena_alloc(&pp_arena, sizeof(IncludeFrame));
+  frame->rest = tok;
+  frame->next = includes;
+  includes = frame;
+  return tok2;
 }
 
 // Read #line arguments
 static void read_line_marker(Token **rest, Token *tok) {
   Token *start = tok;
-  tok = preprocess(copy_line(rest, tok));
+  tok = preprocess2(copy_line(rest, tok));
+  convert_pp_tokens(tok);
 
   if (tok->kind != TK_NUM || tok->ty->kind != TY_INT)
     error_tok(tok, "invalid line marker");
-  start->file->line_delta = tok->val - start->line_no;
+  start->file->line_delta = tok->val - get_line_no(start->file, start->loc);
 
   tok = tok->next;
   if (tok->kind == TK_EOF)
@@ -840,16 +1185,27 @@ static Token *preprocess2(Token *tok) {
   Token head = {};
   Token *cur = &head;
 
-  while (tok->kind != TK_EOF) {
+  for (;;) {
+    // Return to the includer at the end of an included file.
+    if (tok->kind == TK_EOF && tok->is_shared) {
+      tok = includes->rest;
+      includes = includes->next;
+      continue;
+    }
+
+    if (tok->kind == TK_EOF)
+      break;
+
     // If it is a macro, expand it.
     if (expand_macro(&tok, tok))
       continue;
 
     // Pass through if it is not a "#".
     if (!is_hash(tok)) {
-      tok->line_delta = tok->file->line_delta;
-      tok->filename = tok->file->display_name;
-      cur = cur->next = tok;
+      Token *t = tok->is_shared ? copy_token(tok) : tok;
+      t->line_delta = tok->file->line_delta;
+      t->filename = tok->file->display_name;
+      cur = cur->next = t;
       tok = tok->next;
       continue;
     }
@@ -862,9 +1218,9 @@ static Token *preprocess2(Token *tok) {
       char *filename = read_include_filename(&tok, tok->next, &is_dquote);
 
       if (filename[0] != '/' && is_dquote) {
-        char *path = format("%s/%s", dirname(strdup(start->file->name)), filename);
-        if (file_exists(path)) {
-          tok = include_file(tok, path, start->next->next);
+        char *dir = dirname(strdup(start->file->name));
+        if (file_exists_in(dir, filename)) {
+          tok = include_file(tok, format("%s/%s", dir, filename), start->next->next);
           continue;
         }
       }
@@ -891,7 +1247,7 @@ static Token *preprocess2(Token *tok) {
       tok = tok->next;
       if (tok->kind != TK_IDENT)
         error_tok(tok, "macro name must be an identifier");
-      undef_macro(strndup(tok->loc, tok->len));
+      delete_macro(strndup(tok->loc, tok->len));
       tok = skip_line(tok->next);
       continue;
     }
@@ -990,13 +1346,47 @@ static Token *preprocess2(Token *tok) {
   return head.next;
 }
 
+static void hash_option(char *s) {
+  for (; *s; s++)
+    options_hash = (options_hash ^ (unsigned char)*s) * 0x100000001b3;
+  options_hash = (options_hash ^ 0xff) * 0x100000001b3;
+}
+
 void define_macro(char *name, char *buf) {
   Token *tok = tokenize(new_file("<built-in>", 1, buf));
   add_macro(name, true, tok);
+  hash_option(name);
+  hash_option(buf);
 }
 
 void undef_macro(char *name) {
-  hashmap_delete(&macros, name);
+  delete_macro(name);
+  hash_option(name);
+}
+
+// When more than one translation unit is preprocessed in the same
+// process, each of them has to start with the same set of macros.
+// This function is called once after the command line is processed
+// and saves the macros defined so far. reset_preprocessor() restores
+// them for each translation unit.
+void setup_preprocessor(void) {
+  initial_macros = hashmap_copy(&macros);
+  initial_options_hash = options_hash;
+  use_snapshots = true;
+
+  // Include paths may have changed too.
+  include_cache = (HashMap){};
+}
+
+void reset_preprocessor(void) {
+  macros = hashmap_copy(&initial_macros);
+  pragma_once = (HashMap){};
+  pch_guards = (HashMap){};
+  pch_files = (HashMap){};
+  has_pch = false;
+  cond_incl = NULL;
+  includes = NULL;
+  counter = 0;
 }
 
 static Macro *add_builtin(char *name, macro_handler_fn *fn) {
@@ -1014,14 +1404,13 @@ static Token *file_macro(Token *tmpl) {
 static Token *line_macro(Token *tmpl) {
   while (tmpl->origin)
     tmpl = tmpl->origin;
-  int i = tmpl->line_no + tmpl->file->line_delta;
+  int i = get_line_no(tmpl->file, tmpl->loc) + tmpl->file->line_delta;
   return new_num_token(i, tmpl);
 }
 
 // __COUNTER__ is expanded to serial values starting from 0.
 static Token *counter_macro(Token *tmpl) {
-  static int i = 0;
-  return new_num_token(i++, tmpl);
+  return new_num_token(counter++, tmpl);
 }
 
 // __TIMESTAMP__ is expanded to a string describing the last
@@ -1058,6 +1447,8 @@ static char *format_time(struct tm *tm) {
 }
 
 void init_macros(void) {
+  macros = (HashMap){};
+
   // Define predefined macros
   define_macro("__C99_MACRO_WITH_VA_ARGS", "1");
   define_macro("__ELF__", "1");
@@ -1096,6 +1487,7 @@ void init_macros(void) {
   struct tm *tm = localtime(&now);
   define_macro("__DATE__", format_date(tm));
   define_macro("__TIME__", format_time(tm));
+  options_hash = 0xcbf29ce484222325;
 }
 
 typedef enum {
@@ -1180,15 +1572,274 @@ static void join_adjacent_string_literals(Token *tok) {
   }
 }
 
+// Returns the first token after the #include lines at the beginning
+// of a file.
+static Token *skip_include_lines(Token *tok) {
+  while (is_hash(tok) && equal(tok->next, "include")) {
+    tok = tok->next->next;
+    while (!tok->at_bol && tok->kind != TK_EOF)
+      tok = tok->next;
+  }
+  return tok;
+}
+
+// The output of the #include lines [tok, end) depends only on the
+// initial macros, the include paths, the directory of the file and
+// the contents of the headers. The last are checked separately.
+static char *snapshot_key(Token *tok, Token *end) {
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+
+  char cwd[PATH_MAX];
+  fprintf(out, "%s\n", getcwd(cwd, sizeof(cwd)) ? cwd : "");
+  for (int i = 0; i < include_paths.len; i++)
+    fprintf(out, "%s\n", include_paths.data[i]);
+  fprintf(out, "%lx\n%s\n", (unsigned long)initial_options_hash,
+          dirname(strdup(tok->file->name)));
+  fwrite(tok->loc, 1, end->loc - tok->loc, out);
+  fclose(out);
+  return buf;
+}
+
+static bool is_valid_snapshot(Snapshot *snap) {
+  for (int i = 0; i < snap->num_files; i++) {
+    Token *tok = find_header(snap->files[i]->name);
+    if (!tok || tok->file != snap->files[i])
+      return false;
+  }
+  return true;
+}
+
+static Snapshot *record_snapshot(Token *tok, Token *end) {
+  Snapshot *snap = calloc(1, sizeof(Snapshot));
+  int first_file = 0;
+  while (get_input_files()[first_file])
+    first_file++;
+
+  recording = true;
+  uses_volatile_macro = false;
+  last_change = &snap->changes;
+
+  swap_arenas(&token_arena, &snapshot_token_arena);
+  swap_arenas(&type_arena, &snapshot_type_arena);
+
+  // Preprocess the #include lines by themselves.
+  Token *last = tok;
+  while (last->next != end)
+    last = last->next;
+  last->next = new_eof(end);
+  snap->tok = preprocess2(tok);
+  convert_pp_tokens(snap->tok);
+  swap_arenas(&token_arena, &snapshot_token_arena);
+  swap_arenas(&type_arena, &snapshot_type_arena);
+
+  recording = false;
+  last->next = end;
+
+  snap->pragma_once = hashmap_copy(&pragma_once);
+  snap->counter = counter;
+
+  File **files = get_input_files() + first_file;
+  while (files[snap->num_files])
+    snap->num_files++;
+  snap->files = calloc(snap->num_files, sizeof(File *));
+  memcpy(snap->files, files, snap->num_files * sizeof(File *));
+
+  if (cond_incl || uses_volatile_macro || !is_valid_snapshot(snap))
+    return snap;
+
+  hashmap_put(&snapshots, snapshot_key(tok, end), snap);
+  cache_updates++;
+  return snap;
+}
+
+// Many source files start with the same #include lines. If they are
+// compiled in the same process (with -fintegrated-cc1 or --server),
+// the headers are expanded once, and the macros they define and the
+// tokens they produce are reused for the other files. Returns the
+// snapshot whose tokens come first in the output and sets `rest` to
+// the first token after the #include lines, or returns NULL.
+static Snapshot *apply_snapshot(Token **rest, Token *tok) {
+  Token *end = skip_include_lines(tok);
+  if (end == tok)
+    return NULL;
+
+  Snapshot *snap = hashmap_get(&snapshots, snapshot_key(tok, end));
+  if (!snap || !is_valid_snapshot(snap)) {
+    *rest = end;
+    return record_snapshot(tok, end);
+  }
+
+  for (MacroChange *c = snap->changes; c; c = c->next) {
+    if (c->macro)
+      hashmap_put(&macros, c->name, c->macro);
+    else
+      hashmap_delete(&macros, c->name);
+  }
+  macro_epoch++;
+
+  pragma_once = hashmap_copy(&snap->pragma_once);
+  counter = snap->counter;
+  for (int i = 0; i < snap->num_files; i++)
+    add_input_file(snap->files[i]);
+
+  *rest = end;
+  return snap;
+}
+
 // Entry point function of the preprocessor.
 Token *preprocess(Token *tok) {
+  macro_epoch++;
+  Snapshot *snap = use_snapshots && !has_pch ? apply_snapshot(&tok, tok) : NULL;
   tok = preprocess2(tok);
+  if (snap)
+    tok = append(snap->tok, tok);
   if (cond_incl)
     error_tok(cond_incl->tok, "unterminated conditional directive");
   convert_pp_tokens(tok);
   join_adjacent_string_literals(tok);
 
-  for (Token *t = tok; t; t = t->next)
-    t->line_no += t->line_delta;
+  // Hidesets and macro arguments are not needed after preprocessing.
+  arena_release(&pp_arena);
+  hidesets = hideset_unions = hideset_intersections = (HashMap){};
   return tok;
 }
+
+// The state of the preprocessor after a header, as written to a
+// precompiled header. Only the macros that the header has defined or
+// undefined are written; `macros[i]` is NULL for the latter.
+typedef struct {
+  uint64_t options_hash;
+  int counter;
+  int num_macros;
+  char **macro_names;
+  Macro **macros;
+  int num_guards;
+  char **guard_paths;
+  char **guard_names;
+} PreprocessorState;
+
+static uint32_t write_macro(Macro *m) {
+  uint32_t off = pch_alloc(m, sizeof(Macro));
+  pch_ident(off + offsetof(Macro, name), m->name);
+
+  uint32_t slot = off + offsetof(Macro, params);
+  for (MacroParam *p = m->params; p; p = p->next) {
+    uint32_t off2 = pch_alloc(p, sizeof(MacroParam));
+    pch_ptr(slot, off2);
+    pch_str(off2 + offsetof(MacroParam, name), p->name);
+    slot = off2 + offsetof(MacroParam, next);
+  }
+  pch_ptr(slot, 0);
+
+  pch_str(off + offsetof(Macro, va_args_name), m->va_args_name);
+  pch_tokens(off + offsetof(Macro, body), m->body);
+  pch_ptr(off + offsetof(Macro, handler), 0);
+  pch_ptr(off + offsetof(Macro, expansion), 0);
+  pch_ptr(off + offsetof(Macro, deps), 0);
+  return off;
+}
+
+static uint32_t write_strings(char **arr, int len, bool is_ident) {
+  uint32_t off = pch_alloc(arr, sizeof(char *) * len);
+  for (int i = 0; i < len; i++) {
+    if (is_ident)
+      pch_ident(off + sizeof(char *) * i, arr[i]);
+    else
+      pch_str(off + sizeof(char *) * i, arr[i]);
+  }
+  return off;
+}
+
+// Called after a header has been preprocessed. The macros are
+// compared with those saved by setup_preprocessor().
+uint32_t write_preprocessor_state(void) {
+  PreprocessorState st = {options_hash, counter};
+  HashEntry *ent;
+
+  int cap = macros.capacity + initial_macros.capacity;
+  st.macro_names = calloc(cap, sizeof(char *));
+  st.macros = calloc(cap, sizeof(Macro *));
+  for (int i = 0; (ent = hashmap_next(&macros, &i));) {
+    Macro *m = ent->val;
+    if (!m->handler && hashmap_get(&initial_macros, ent->key) != m) {
+      st.macro_names[st.num_macros] = ent->key;
+      st.macros[st.num_macros++] = ent->val;
+    }
+  }
+  for (int i = 0; (ent = hashmap_next(&initial_macros, &i));)
+    if (!hashmap_get(&macros, ent->key))
+      st.macro_names[st.num_macros++] = ent->key;
+
+  File **files = get_input_files();
+  int num_files = 0;
+  while (files[num_files])
+    num_files++;
+
+  st.guard_paths = calloc(num_files, sizeof(char *));
+  st.guard_names = calloc(num_files, sizeof(char *));
+  for (int i = 0; i < num_files; i++) {
+    char *path = files[i]->name;
+    char *id = file_id(path);
+    if (!id)
+      continue;
+
+    IncludeGuard *guard = hashmap_get(&include_guards, path);
+    if (hashmap_get(&pragma_once, path)) {
+      st.guard_paths[st.num_guards] = id;
+      st.guard_names[st.num_guards++] = "";
+    } else if (guard && guard->name && guard->tok == find_header(path)) {
+      st.guard_paths[st.num_guards] = id;
+      st.guard_names[st.num_guards++] = guard->name;
+    }
+  }
+
+  uint32_t off = pch_alloc(&st, sizeof(st));
+  pch_ptr(off + offsetof(PreprocessorState, macro_names),
+          write_strings(st.macro_names, st.num_macros, true));
+
+  uint32_t arr = pch_alloc(st.macros, sizeof(Macro *) * st.num_macros);
+  for (int i = 0; i < st.num_macros; i++)
+    pch_ptr(arr + sizeof(Macro *) * i, st.macros[i] ? write_macro(st.macros[i]) : 0);
+  pch_ptr(off + offsetof(PreprocessorState, macros), arr);
+
+  pch_ptr(off + offsetof(PreprocessorState, guard_paths),
+          write_strings(st.guard_paths, st.num_guards, false));
+  pch_ptr(off + offsetof(PreprocessorState, guard_names),
+          write_strings(st.guard_names, st.num_guards, false));
+  return off;
+}
+
+// Called by read_pch() for each file of a precompiled header.
+void add_pch_file(File *file) {
+  char *id = file_id(file->name);
+  if (id)
+    hashmap_put(&pch_files, id, file);
+}
+
+void read_preprocessor_state(void *state) {
+  PreprocessorState *st = state;
+  if (st->options_hash != options_hash)
+    error("-include-pch: precompiled header was built with different -D or -U options");
+
+  for (int i = 0; i < st->num_macros; i++) {
+    char *name = st->macro_names[i];
+    if (st->macros[i]) {
+      name[-1] |= IDENT_MACRO;
+      st->macros[i]->num_deps = 0;
+      st->macros[i]->expansion_epoch = 0;
+      st->macros[i]->use_epoch = 0;
+      hashmap_put(&macros, name, st->macros[i]);
+    } else {
+      hashmap_delete(&macros, name);
+    }
+  }
+
+  for (int i = 0; i < st->num_guards; i++)
+    hashmap_put(&pch_guards, st->guard_paths[i], st->guard_names[i]);
+
+  counter = st->counter;
+  has_pch = true;
+  macro_epoch++;
+}
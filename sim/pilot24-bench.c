@@ -0,0 +1,393 @@
+// pilot24-bench: compiles a corpus of C programs with chibicc and
+// reports how fast the compiler ran and how good its output is.
+//
+// For each program it prints "<program> <metric> <value>" lines:
+//
+//   compile_ms, compile_rss_kb   compiler wall time (best of -n runs)
+//                                and peak resident set size
+//   rom, bss                     bytes of each bank
+//   insns, cycles                static instruction count and the sum
+//                                of their costs in the timing table
+//   fn.<name>.{size,insns,cycles}
+//                                the same for each function
+//   obj.<name>.{rom,bss}         bytes of each data object
+//   run.status                   "ok" if the program ran to completion
+//                                in the simulator within the cycle
+//                                limit (-l) and exited with the
+//                                expected status, "wrong" if it exited
+//                                with another one, "error" if it did
+//                                not finish, "skipped" if it was not run
+//   run.exit                     the exit status of a "wrong" run
+//   run.insns, run.cycles        instructions and cycles executed
+//
+// Each program states what its run should produce in a comment line
+// near the top: "// exit: <status>" gives the expected exit status,
+// and "// skip: <reason>" marks a program the simulator cannot run.
+// The reason a run failed is printed to stderr.
+//
+// `pilot24-bench -d <old> <new>` compares two such result files, e.g.
+// those of two compiler builds, and prints the metrics that differ.
+
+#include "chibicc.h"
+#include <fcntl.h>
+#include <sys/resource.h>
+
+typedef struct Result Result;
+struct Result {
+  Result *next;
+  char *key;
+  char *val;
+};
+
+static char *chibicc = "./chibicc";
+static char *sim = "./pilot24-sim";
+static char *timing_file;
+static char *max_cycles = "10000000";
+static int repeat = 5;
+static char *tmpdir;
+
+void error(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+static void usage(int status) {
+  fprintf(stderr, "pilot24-bench [ -c <chibicc> ] [ -s <pilot24-sim> ] "
+          "[ -t <timing-file> ] [ -n <runs> ] [ -l <max-cycles> ] <file>...\n"
+          "pilot24-bench -d <old-results> <new-results>\n");
+  exit(status);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs a command and returns its exit status, or -1 if it was killed.
+// If `out` is not NULL, the command's file descriptor `fd` is captured
+// into it; the other output stream goes to /dev/null.
+static int run(char **argv, int fd, char **out) {
+  int fds[2];
+  if (out && pipe(fds) < 0)
+    error("pipe: %s", strerror(errno));
+
+  pid_t pid = fork();
+  if (pid < 0)
+    error("fork: %s", strerror(errno));
+
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    if (out) {
+      close(fds[0]);
+      dup2(fds[1], fd);
+    }
+    execvp(argv[0], argv);
+    fprintf(stderr, "exec failed: %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+
+  if (out) {
+    close(fds[1]);
+    size_t len;
+    FILE *mem = open_memstream(out, &len);
+    char buf[4096];
+    int n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0)
+      fwrite(buf, 1, n, mem);
+    fputc('\0', mem);
+    fclose(mem);
+    close(fds[0]);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// The compiler driver runs the real compiler in a subprocess, so its
+// peak RSS is only visible through RUSAGE_CHILDREN of a process that
+// waited for it. We fork a fresh process to do that for each
+// measurement, so that earlier runs do not affect the maximum.
+static int measure(char **argv, long *rss_kb) {
+  int fds[2];
+  if (pipe(fds) < 0)
+    error("pipe: %s", strerror(errno));
+
+  pid_t pid = fork();
+  if (pid < 0)
+    error("fork: %s", strerror(errno));
+
+  if (pid == 0) {
+    close(fds[0]);
+    int status = run(argv, 2, NULL);
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    long rss = ru.ru_maxrss;
+    write(fds[1], &rss, sizeof(rss));
+    _exit(status < 0 ? 1 : status);
+  }
+
+  close(fds[1]);
+  if (read(fds[0], rss_kb, sizeof(*rss_kb)) != sizeof(*rss_kb))
+    *rss_kb = 0;
+  close(fds[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static char *basename_noext(char *path) {
+  char *p = strrchr(path, '/');
+  p = strdup(p ? p + 1 : path);
+  char *dot = strrchr(p, '.');
+  if (dot)
+    *dot = '\0';
+  return p;
+}
+
+static char **sim_command(char *opt, char *asm_file) {
+  StringArray args = {};
+  strarray_push(&args, sim);
+  if (timing_file) {
+    strarray_push(&args, "-t");
+    strarray_push(&args, timing_file);
+  }
+  strarray_push(&args, "-c");
+  strarray_push(&args, max_cycles);
+  strarray_push(&args, opt);
+  strarray_push(&args, asm_file);
+  strarray_push(&args, NULL);
+  return args.data;
+}
+
+// Reads the "// exit:" or "// skip:" line of a program. Returns the
+// expected exit status, or -1 if the program is to be skipped.
+static int expected_exit(char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    error("cannot open %s: %s", path, strerror(errno));
+
+  char line[1024];
+  int status = -2;
+  while (status == -2 && fgets(line, sizeof(line), fp)) {
+    if (strncmp(line, "//", 2))
+      break;
+    if (sscanf(line, "// exit: %d", &status) == 1)
+      continue;
+    if (!strncmp(line, "// skip:", 8))
+      status = -1;
+  }
+  fclose(fp);
+
+  if (status == -2)
+    error("%s: no \"// exit:\" or \"// skip:\" line", path);
+  return status;
+}
+
+static void bench(char *path) {
+  char *name = basename_noext(path);
+  int expected = expected_exit(path);
+  char *asm_file = format("%s/%s.s", tmpdir, name);
+
+  double best = 0;
+  long rss = 0;
+  for (int i = 0; i < repeat; i++) {
+    double start = now();
+    long kb;
+    if (measure((char *[]){chibicc, "-S", "-o", asm_file, path, NULL}, &kb))
+      error("%s: compilation failed", path);
+    double t = now() - start;
+    if (i == 0 || t < best)
+      best = t;
+    rss = MAX(rss, kb);
+  }
+  printf("%s compile_ms %.3f\n", name, best * 1000);
+  printf("%s compile_rss_kb %ld\n", name, rss);
+
+  // Static metrics
+  char *out;
+  if (run(sim_command("-a", asm_file), 1, &out))
+    error("%s: %s -a failed", path, sim);
+
+  for (char *line = strtok(out, "\n"); line; line = strtok(NULL, "\n")) {
+    char key[256], bank[8];
+    long a, b, c;
+    if (sscanf(line, "function %255s %ld %ld %ld", key, &a, &b, &c) == 4) {
+      printf("%s fn.%s.size %ld\n", name, key, a);
+      printf("%s fn.%s.insns %ld\n", name, key, b);
+      printf("%s fn.%s.cycles %ld\n", name, key, c);
+    } else if (sscanf(line, "object %255s %7s %ld", key, bank, &a) == 3) {
+      printf("%s obj.%s.%s %ld\n", name, key, bank, a);
+    } else if (sscanf(line, "instructions %ld", &a) == 1) {
+      printf("%s insns %ld\n", name, a);
+    } else if (sscanf(line, "%255s %ld", key, &a) == 2) {
+      printf("%s %s %ld\n", name, key, a);
+    }
+  }
+
+  // Dynamic metrics. Stats are printed only if the program ran to
+  // completion, so their absence means the run failed.
+  if (expected < 0) {
+    printf("%s run.status skipped\n", name);
+    fflush(stdout);
+    unlink(asm_file);
+    return;
+  }
+
+  int status = run(sim_command("-s", asm_file), 2, &out);
+
+  long insns, cycles;
+  char *p = strstr(out, "instructions ");
+  char *q = strstr(out, "cycles ");
+  if (p && q && sscanf(p, "instructions %ld", &insns) == 1 &&
+      sscanf(q, "cycles %ld", &cycles) == 1) {
+    if (status == expected) {
+      printf("%s run.status ok\n", name);
+    } else {
+      printf("%s run.status wrong\n", name);
+      printf("%s run.exit %d\n", name, status);
+      fprintf(stderr, "%s: exited with %d, expected %d\n", path, status, expected);
+    }
+    printf("%s run.insns %ld\n", name, insns);
+    printf("%s run.cycles %ld\n", name, cycles);
+  } else {
+    printf("%s run.status error\n", name);
+    out[strcspn(out, "\n")] = '\0';
+    fprintf(stderr, "%s: %s\n", path, *out ? out : "simulator failed");
+  }
+  fflush(stdout);
+  unlink(asm_file);
+}
+
+//
+// Diff mode
+//
+
+static Result *read_results(char *path, HashMap *map) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    error("cannot open %s: %s", path, strerror(errno));
+
+  Result head = {};
+  Result *cur = &head;
+  char line[1024];
+  while (fgets(line, sizeof(line), fp)) {
+    char prog[256], metric[512], val[256];
+    if (sscanf(line, "%255s %511s %255s", prog, metric, val) != 3)
+      continue;
+    Result *r = calloc(1, sizeof(Result));
+    r->key = format("%s %s", prog, metric);
+    r->val = strdup(val);
+    hashmap_put(map, r->key, r);
+    cur = cur->next = r;
+  }
+  fclose(fp);
+  return head.next;
+}
+
+static bool is_number(char *s, double *val) {
+  char *end;
+  *val = strtod(s, &end);
+  return end != s && *end == '\0';
+}
+
+// Wall time and RSS are noisy, so they are reported only when they
+// change by more than a few percent.
+static bool is_noise(char *key, double old, double new) {
+  if (!strstr(key, " compile_"))
+    return false;
+  return old && (new - old) / old < 0.05 && (old - new) / old < 0.05;
+}
+
+static void diff(char *old_path, char *new_path) {
+  HashMap old_map = {};
+  HashMap new_map = {};
+  Result *old = read_results(old_path, &old_map);
+  Result *new = read_results(new_path, &new_map);
+
+  printf("%-40s %12s %12s %12s %8s\n", "metric", "old", "new", "delta", "%");
+
+  for (Result *r = new; r; r = r->next) {
+    Result *o = hashmap_get(&old_map, r->key);
+    if (!o) {
+      printf("%-40s %12s %12s\n", r->key, "-", r->val);
+      continue;
+    }
+
+    double a, b;
+    if (!is_number(o->val, &a) || !is_number(r->val, &b)) {
+      if (strcmp(o->val, r->val))
+        printf("%-40s %12s %12s\n", r->key, o->val, r->val);
+      continue;
+    }
+
+    if (a == b || is_noise(r->key, a, b))
+      continue;
+    printf("%-40s %12g %12g %+12g", r->key, a, b, b - a);
+    if (a)
+      printf(" %+7.1f%%", (b - a) * 100 / a);
+    printf("\n");
+  }
+
+  for (Result *r = old; r; r = r->next)
+    if (!hashmap_get(&new_map, r->key))
+      printf("%-40s %12s %12s\n", r->key, r->val, "-");
+}
+
+int main(int argc, char **argv) {
+  StringArray inputs = {};
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--help"))
+      usage(0);
+
+    if (!strcmp(argv[i], "-d")) {
+      if (argc != i + 3)
+        usage(1);
+      diff(argv[i + 1], argv[i + 2]);
+      return 0;
+    }
+
+    if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "-s") ||
+        !strcmp(argv[i], "-t") || !strcmp(argv[i], "-n") ||
+        !strcmp(argv[i], "-l")) {
+      if (!argv[i + 1])
+        usage(1);
+      if (argv[i][1] == 'c')
+        chibicc = argv[++i];
+      else if (argv[i][1] == 's')
+        sim = argv[++i];
+      else if (argv[i][1] == 't')
+        timing_file = argv[++i];
+      else if (argv[i][1] == 'l')
+        max_cycles = argv[++i];
+      else
+        repeat = MAX(atoi(argv[++i]), 1);
+      continue;
+    }
+
+    if (argv[i][0] == '-' && argv[i][1] != '\0')
+      error("unknown argument: %s", argv[i]);
+
+    strarray_push(&inputs, argv[i]);
+  }
+
+  if (inputs.len == 0)
+    usage(1);
+
+  tmpdir = strdup("/tmp/pilot24-bench-XXXXXX");
+  if (!mkdtemp(tmpdir))
+    error("mkdtemp failed: %s", strerror(errno));
+
+  for (int i = 0; i < inputs.len; i++)
+    bench(inputs.data[i]);
+
+  rmdir(tmpdir);
+  return 0;
+}
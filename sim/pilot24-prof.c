@@ -0,0 +1,254 @@
+// pilot24-prof: turns the counters of a program compiled with
+// `chibicc -pg` into a flat profile and a call graph.
+//
+// The counters are read from a file of "<name> <value>" lines, as
+// written by `pilot24-sim -g` or dumped from hardware. The assembly
+// files that chibicc emitted supply the source location of each
+// function (the "; file:line" comment before its label) and the
+// caller and callee of each call-site counter (the "; arc" comment
+// before its label).
+//
+// Ticks are measured from function entry to exit, so they include the
+// time spent in callees. Self ticks are estimated by charging each
+// caller the share of its callees' ticks that corresponds to the
+// number of calls it made, as gprof does.
+
+#include "chibicc.h"
+
+typedef struct Func Func;
+typedef struct Arc Arc;
+
+struct Func {
+  char *name;
+  char *loc;
+  uint64_t calls;
+  uint64_t ticks;
+  double self;
+};
+
+struct Arc {
+  Arc *next;
+  Func *caller;
+  Func *callee; // NULL for indirect calls
+  uint64_t count;
+};
+
+static HashMap counters;
+static HashMap funcs;
+static Func **func_list;
+static int func_len;
+static Arc *arcs;
+
+void error(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+static void usage(int status) {
+  fprintf(stderr, "pilot24-prof <counter-file> <asm-file>...\n");
+  exit(status);
+}
+
+static char *read_file(char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    error("cannot open %s: %s", path, strerror(errno));
+
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+
+  for (;;) {
+    char buf2[4096];
+    int n = fread(buf2, 1, sizeof(buf2), fp);
+    if (n == 0)
+      break;
+    fwrite(buf2, 1, n, out);
+  }
+
+  fclose(fp);
+  fputc('\0', out);
+  fclose(out);
+  return buf;
+}
+
+static uint64_t get_counter(char *name) {
+  uint64_t *val = hashmap_get(&counters, name);
+  return val ? *val : 0;
+}
+
+static void read_counters(char *path) {
+  char *p = read_file(path);
+  for (char *line = strtok(p, "\n"); line; line = strtok(NULL, "\n")) {
+    char name[256];
+    unsigned long long val;
+    if (sscanf(line, "%255s %llu", name, &val) != 2)
+      error("%s: malformed line: %s", path, line);
+    uint64_t *v = calloc(1, sizeof(uint64_t));
+    *v = val;
+    hashmap_put(&counters, strdup(name), v);
+  }
+}
+
+static Func *get_func(char *name) {
+  Func *fn = hashmap_get(&funcs, name);
+  if (fn)
+    return fn;
+
+  fn = calloc(1, sizeof(Func));
+  fn->name = name;
+  fn->calls = get_counter(format("__prof_calls_%s", name));
+  fn->ticks = get_counter(format("__prof_ticks_%s", name));
+  hashmap_put(&funcs, name, fn);
+
+  func_list = realloc(func_list, sizeof(Func *) * (func_len + 1));
+  func_list[func_len++] = fn;
+  return fn;
+}
+
+static bool is_label(char *line) {
+  int len = strlen(line);
+  return len > 1 && line[len - 1] == ':' && !isspace(line[0]) && line[0] != '#';
+}
+
+static void read_asm(char *path) {
+  char *comment = NULL;
+
+  for (char *line = strtok(read_file(path), "\n"); line; line = strtok(NULL, "\n")) {
+    char *p = line;
+    while (isspace(*p))
+      p++;
+
+    if (*p == ';') {
+      comment = p + 1;
+      while (isspace(*comment))
+        comment++;
+      continue;
+    }
+
+    if (comment && is_label(line)) {
+      char *label = strndup(line, strlen(line) - 1);
+      char caller[256], callee[256];
+
+      if (sscanf(comment, "arc %255s %255s", caller, callee) == 2) {
+        Func *from = get_func(strdup(caller));
+        Func *to = strcmp(callee, "*") ? get_func(strdup(callee)) : NULL;
+
+        // Merge call sites with the same caller and callee.
+        Arc *arc = arcs;
+        while (arc && (arc->caller != from || arc->callee != to))
+          arc = arc->next;
+        if (!arc) {
+          arc = calloc(1, sizeof(Arc));
+          arc->caller = from;
+          arc->callee = to;
+          arc->next = arcs;
+          arcs = arc;
+        }
+        arc->count += get_counter(label);
+      } else if (strchr(comment, ':')) {
+        get_func(label)->loc = strdup(comment);
+      }
+    }
+    comment = NULL;
+  }
+}
+
+static void compute_self_ticks(void) {
+  for (int i = 0; i < func_len; i++)
+    func_list[i]->self = func_list[i]->ticks;
+
+  for (Arc *arc = arcs; arc; arc = arc->next) {
+    Func *callee = arc->callee;
+    if (!callee || callee == arc->caller || callee->calls == 0)
+      continue;
+    arc->caller->self -= (double)callee->ticks * arc->count / callee->calls;
+  }
+
+  for (int i = 0; i < func_len; i++)
+    if (func_list[i]->self < 0)
+      func_list[i]->self = 0;
+}
+
+static int compare_self(const void *x, const void *y) {
+  Func *a = *(Func **)x;
+  Func *b = *(Func **)y;
+  if (a->self != b->self)
+    return (a->self < b->self) ? 1 : -1;
+  return strcmp(a->name, b->name);
+}
+
+static void print_flat_profile(void) {
+  double total = 0;
+  for (int i = 0; i < func_len; i++)
+    total += func_list[i]->self;
+
+  printf("Flat profile:\n\n");
+  printf("%7s %12s %12s %10s %12s  %s\n",
+         "%self", "self ticks", "total ticks", "calls", "ticks/call", "name");
+
+  for (int i = 0; i < func_len; i++) {
+    Func *fn = func_list[i];
+    if (fn->calls == 0)
+      continue;
+    printf("%7.2f %12.0f %12llu %10llu %12.1f  %s",
+           total ? fn->self * 100 / total : 0.0, fn->self,
+           (unsigned long long)fn->ticks, (unsigned long long)fn->calls,
+           (double)fn->ticks / fn->calls, fn->name);
+    if (fn->loc)
+      printf(" (%s)", fn->loc);
+    printf("\n");
+  }
+}
+
+static void print_call_graph(void) {
+  printf("\nCall graph:\n");
+
+  for (int i = 0; i < func_len; i++) {
+    Func *fn = func_list[i];
+    if (fn->calls == 0)
+      continue;
+
+    printf("\n%s", fn->name);
+    if (fn->loc)
+      printf(" (%s)", fn->loc);
+    printf("\n");
+
+    bool found = false;
+    for (Arc *arc = arcs; arc; arc = arc->next) {
+      if (arc->callee == fn && arc->count) {
+        printf("    called by %-24s %10llu\n", arc->caller->name,
+               (unsigned long long)arc->count);
+        found = true;
+      }
+    }
+    if (!found)
+      printf("    called by <spontaneous>\n");
+
+    for (Arc *arc = arcs; arc; arc = arc->next)
+      if (arc->caller == fn && arc->count)
+        printf("    calls     %-24s %10llu\n",
+               arc->callee ? arc->callee->name : "<indirect>",
+               (unsigned long long)arc->count);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 2 && !strcmp(argv[1], "--help"))
+    usage(0);
+  if (argc < 3)
+    usage(1);
+
+  read_counters(argv[1]);
+  for (int i = 2; i < argc; i++)
+    read_asm(argv[i]);
+
+  compute_self_ticks();
+  qsort(func_list, func_len, sizeof(Func *), compare_self);
+  print_flat_profile();
+  print_call_graph();
+  return 0;
+}
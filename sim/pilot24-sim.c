@@ -0,0 +1,1387 @@
+// pilot24-sim: a cycle-counting simulator for the Pilot24 assembly
+// that chibicc emits.
+//
+// The simulator reads one or more assembly files, lays them out in
+// memory the same way the banks in the source describe, and executes
+// the program starting from `main`. Instructions are interpreted
+// directly from their textual form; the byte size of each instruction
+// is only an estimate used to assign addresses to code labels.
+//
+// Memory map:
+//
+//   0x000000  rom bank (initialized data and code)
+//   0x200000  bss bank
+//   0xfe0000  runtime pseudo-registers (__long_NN, __float_NN, ...)
+//   0xff0000  initial stack pointer (the stack grows down)
+//   0xffff00  write a byte to stdout
+//   0xffff01  write a byte to exit the program with that status
+//   0xffff04  32-bit free-running cycle counter (read only)
+//
+// Returning from the entry function also exits the program, with the
+// low byte of P0 as the exit status.
+
+#include "chibicc.h"
+
+#define ROM_BASE   0x000000
+#define BSS_BASE   0x200000
+#define PREG_BASE  0xfe0000
+#define STACK_TOP  0xff0000
+#define IO_PUTCHAR 0xffff00
+#define IO_EXIT    0xffff01
+#define IO_TIMER   0xffff04
+#define HALT_ADDR  0xfffffc
+#define MEM_SIZE   0x1000000
+#define ADDR_MASK  0xffffff
+
+#define REG_SP 7
+#define REG_F  8
+
+typedef enum {
+  I_LD, I_LDQ, I_LDSX, I_LDZX, I_LEA,
+  I_ADD, I_ADQ, I_ADX, I_SUB, I_SBQ, I_SBX, I_CP,
+  I_AND, I_OR, I_XOR, I_NEG, I_NGX, I_CPL,
+  I_SLA, I_SRA, I_SRL, I_RL, I_RR,
+  I_MULU, I_MULS, I_DIVU, I_DIVS,
+  I_JR, I_JP, I_CALL, I_DJNZ, I_REPI,
+} Opcode;
+
+static char *opcode_names[] = {
+  "ld", "ldq", "ldsx", "ldzx", "lea",
+  "add", "adq", "adx", "sub", "sbq", "sbx", "cp",
+  "and", "or", "xor", "neg", "ngx", "cpl",
+  "sla", "sra", "srl", "rl", "rr",
+  "mulu", "muls", "divu", "divs",
+  "jr", "jp", "call", "djnz", "repi",
+};
+
+typedef enum {
+  CC_ALWAYS, CC_Z, CC_NZ, CC_C, CC_NC, CC_UGT, CC_ULE,
+  CC_LT, CC_GE, CC_GT, CC_LE, CC_P, CC_M, CC_V, CC_NV,
+} CondCode;
+
+static struct { char *name; CondCode cc; } cond_names[] = {
+  {"z", CC_Z}, {"eq", CC_Z}, {"nz", CC_NZ}, {"ne", CC_NZ},
+  {"c", CC_C}, {"ult", CC_C}, {"nc", CC_NC}, {"uge", CC_NC},
+  {"ugt", CC_UGT}, {"ule", CC_ULE}, {"lt", CC_LT}, {"ge", CC_GE},
+  {"gt", CC_GT}, {"le", CC_LE}, {"p", CC_P}, {"m", CC_M},
+  {"v", CC_V}, {"nv", CC_NV},
+};
+
+typedef enum {
+  OP_NONE, OP_REG, OP_IMM, OP_MEM,
+} OperandKind;
+
+typedef enum {
+  MEM_PLAIN,   // @reg
+  MEM_POSTINC, // @reg+
+  MEM_PREDEC,  // @-reg
+  MEM_DISP,    // @reg+disp or @sym+disp
+} MemMode;
+
+typedef struct {
+  OperandKind kind;
+  int reg;       // register number, or -1 for an absolute address
+  int width;     // width of a register view in bytes
+  MemMode mode;
+  char *sym;     // symbol to be resolved after layout
+  int32_t val;   // immediate value or displacement
+} Operand;
+
+typedef struct {
+  Opcode op;
+  char *name;    // mnemonic as written, e.g. "ld.w"
+  int sz;        // operand size in bytes
+  CondCode cc;
+  Operand a, b;
+  int nops;
+  uint32_t addr;
+  int size;      // estimated encoding size in bytes
+  int cycles;
+  int fn;        // index of the enclosing function
+  char *file;
+  int line_no;
+} Insn;
+
+typedef struct {
+  char *name;
+  uint32_t addr;
+  int size;
+  uint64_t insns;
+  uint64_t cycles;
+} Func;
+
+typedef struct {
+  char *name;
+  uint32_t addr;
+} Symbol;
+
+// A data label and the bytes reserved or initialized after it
+typedef struct {
+  char *name;
+  bool in_rom;
+  int size;
+} Object;
+
+// A data directive whose value needs a symbol
+typedef struct Fixup Fixup;
+struct Fixup {
+  Fixup *next;
+  uint32_t addr;
+  int sz;
+  char *sym;
+  int32_t addend;
+  char *file;
+  int line_no;
+};
+
+static uint8_t *mem;
+static uint32_t regs[9];
+static bool flag_c, flag_z, flag_s, flag_v;
+
+static Insn **insns;
+static int insns_len;
+static int *code_index;
+static uint32_t rom_end = ROM_BASE;
+static uint32_t bss_end = BSS_BASE;
+
+static Func *funcs;
+static int funcs_len;
+
+static Object *objs;
+static int objs_len;
+static bool in_obj;
+
+static HashMap symbols;
+static Fixup *fixups;
+static HashMap timing;
+
+static uint64_t insn_count;
+static uint64_t cycle_count;
+static uint64_t max_cycles = 1000000000;
+static bool halted;
+static int exit_status;
+
+// A label that starts a function if an instruction follows it,
+// or a data object if a data directive follows it
+static char *pending_fn;
+static char *pending_obj;
+
+static char *cur_file;
+static int cur_line;
+static int file_no;
+
+void error(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+__attribute__((format(printf, 1, 2)))
+static noreturn void asm_error(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "%s:%d: ", cur_file, cur_line);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+static void usage(int status) {
+  fprintf(stderr, "pilot24-sim [ -s ] [ -p ] [ -a ] [ -t <timing-file> ] "
+          "[ -c <max-cycles> ] [ -e <entry> ] [ -g <counter-file> ] "
+          "<file>...\n");
+  exit(status);
+}
+
+//
+// Timing table
+//
+
+static struct { char *name; int cycles; } default_timing[] = {
+  {"ld", 1}, {"ldq", 1}, {"ldsx", 1}, {"ldzx", 1}, {"lea", 1},
+  {"add", 1}, {"adq", 1}, {"adx", 1}, {"sub", 1}, {"sbq", 1},
+  {"sbx", 1}, {"cp", 1}, {"and", 1}, {"or", 1}, {"xor", 1},
+  {"neg", 1}, {"ngx", 1}, {"cpl", 1}, {"sla", 1}, {"sra", 1},
+  {"srl", 1}, {"rl", 1}, {"rr", 1},
+  {"mulu.b", 4}, {"mulu.w", 8}, {"mulu.p", 12},
+  {"muls.b", 4}, {"muls.w", 8}, {"muls.p", 12},
+  {"divu.b", 10}, {"divu.w", 18}, {"divu.p", 26},
+  {"divs.b", 10}, {"divs.w", 18}, {"divs.p", 26},
+  {"jr", 2}, {"jr.s", 2}, {"jr.l", 3}, {"jp", 3}, {"call", 4},
+  {"djnz", 2}, {"repi", 1},
+
+  // Extra cycles for each memory operand access and for a taken branch
+  {"mem", 1}, {"taken", 1},
+};
+
+static void set_timing(char *name, int cycles) {
+  hashmap_put(&timing, name, (void *)(intptr_t)(cycles + 1));
+}
+
+static int get_timing(char *name) {
+  intptr_t val = (intptr_t)hashmap_get(&timing, name);
+  return val ? val - 1 : -1;
+}
+
+static void init_timing(void) {
+  for (int i = 0; i < sizeof(default_timing) / sizeof(*default_timing); i++)
+    set_timing(default_timing[i].name, default_timing[i].cycles);
+}
+
+static char *read_file(char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    error("cannot open %s: %s", path, strerror(errno));
+
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+
+  for (;;) {
+    char buf2[4096];
+    int n = fread(buf2, 1, sizeof(buf2), fp);
+    if (n == 0)
+      break;
+    fwrite(buf2, 1, n, out);
+  }
+
+  fclose(fp);
+  fputc('\0', out);
+  fclose(out);
+  return buf;
+}
+
+// A timing file has one "<mnemonic> <cycles>" pair per line.
+// A mnemonic with a size suffix (e.g. "mulu.w") takes precedence
+// over the one without it.
+static void read_timing_file(char *path) {
+  cur_file = path;
+  cur_line = 0;
+
+  for (char *line = read_file(path); line && *line;) {
+    char *next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
+    cur_line++;
+    char name[32];
+    int cycles;
+    char c;
+
+    if (sscanf(line, " %c", &c) == 1 && c != '#' && c != ';') {
+      if (sscanf(line, " %31s %d", name, &cycles) != 2 || cycles < 0)
+        asm_error("malformed timing entry");
+      set_timing(strdup(name), cycles);
+    }
+    line = next;
+  }
+}
+
+//
+// Assembler
+//
+
+static char *skip_space(char *p) {
+  while (isspace(*p))
+    p++;
+  return p;
+}
+
+static void trim(char *p) {
+  int len = strlen(p);
+  while (len > 0 && isspace(p[len - 1]))
+    p[--len] = '\0';
+}
+
+static bool is_symchar(char c) {
+  return isalnum(c) || c == '_' || c == '.' || c == '$';
+}
+
+// Labels generated by the compiler are local to each file.
+static char *local_name(char *name) {
+  if (!strncmp(name, "__L_", 4))
+    return format("%s@%d", name, file_no);
+  return name;
+}
+
+static bool parse_num(char *s, int64_t *val) {
+  char *end;
+  if (*s == '$') {
+    *val = strtoll(s + 1, &end, 16);
+    return end != s + 1 && *end == '\0';
+  }
+
+  if (!isdigit(*s) && !((*s == '-' || *s == '+') && isdigit(s[1])))
+    return false;
+
+  *val = strtoll(s, &end, 0);
+  if (*end == '\0')
+    return true;
+
+  // The compiler sometimes writes hexadecimal constants without
+  // their '$' prefix.
+  *val = strtoll(s, &end, 16);
+  return *end == '\0';
+}
+
+// Parses "number", "symbol", "symbol+number" or "symbol-number".
+static void parse_expr(char *s, char **sym, int32_t *val) {
+  int64_t n;
+  if (parse_num(s, &n)) {
+    *sym = NULL;
+    *val = n;
+    return;
+  }
+
+  char *p = s;
+  while (is_symchar(*p))
+    p++;
+  if (p == s)
+    asm_error("bad expression: %s", s);
+
+  *sym = local_name(strndup(s, p - s));
+  *val = 0;
+  if (*p == '\0')
+    return;
+
+  if (*p == '+')
+    p++;
+  if (!parse_num(p, &n))
+    asm_error("bad expression: %s", s);
+  *val = n;
+}
+
+// Parses a register name at the beginning of p. Returns the number
+// of characters consumed, or 0 if p doesn't start with a register.
+static int parse_reg(char *p, int *reg, int *width) {
+  int len;
+
+  if (!strncmp(p, "sp", 2)) {
+    *reg = REG_SP;
+    *width = 3;
+    len = 2;
+  } else if (*p == 'f') {
+    *reg = REG_F;
+    *width = 1;
+    len = 1;
+  } else if (strchr("lwp", *p) && *p && '0' <= p[1] && p[1] <= '6') {
+    *reg = p[1] - '0';
+    *width = (*p == 'l') ? 1 : (*p == 'w') ? 2 : 3;
+    len = 2;
+  } else {
+    return 0;
+  }
+
+  if (is_symchar(p[len]))
+    return 0;
+  return len;
+}
+
+static Operand parse_operand(char *s) {
+  Operand op = {};
+  int reg, width;
+
+  if (*s != '@') {
+    int len = parse_reg(s, &reg, &width);
+    if (len && s[len] == '\0') {
+      op.kind = OP_REG;
+      op.reg = reg;
+      op.width = width;
+      return op;
+    }
+    op.kind = OP_IMM;
+    parse_expr(s, &op.sym, &op.val);
+    return op;
+  }
+
+  op.kind = OP_MEM;
+  s++;
+
+  if (*s == '-') {
+    if (!parse_reg(s + 1, &reg, &width) || width != 3)
+      asm_error("bad pre-decrement operand: @%s", s);
+    op.reg = reg;
+    op.mode = MEM_PREDEC;
+    return op;
+  }
+
+  int len = parse_reg(s, &reg, &width);
+  if (len) {
+    if (width != 3)
+      asm_error("bad address register: @%s", s);
+    op.reg = reg;
+    if (s[len] == '\0') {
+      op.mode = MEM_PLAIN;
+    } else if (!strcmp(s + len, "+")) {
+      op.mode = MEM_POSTINC;
+    } else {
+      int64_t n;
+      char *p = s + len;
+      if (*p == '+')
+        p++;
+      if (!parse_num(p, &n))
+        asm_error("bad displacement: @%s", s);
+      op.mode = MEM_DISP;
+      op.val = n;
+    }
+    return op;
+  }
+
+  op.reg = -1;
+  op.mode = MEM_DISP;
+  parse_expr(s, &op.sym, &op.val);
+  return op;
+}
+
+static int operand_size(Operand *op, int sz) {
+  switch (op->kind) {
+  case OP_IMM:
+    return sz;
+  case OP_MEM:
+    if (op->reg < 0)
+      return 3;
+    if (op->mode == MEM_DISP)
+      return (-128 <= op->val && op->val < 128) ? 1 : 3;
+    return 0;
+  default:
+    return 0;
+  }
+}
+
+// Estimate the encoded size of an instruction: an opcode word and
+// its immediates, displacements and absolute addresses.
+static int insn_size(Insn *insn) {
+  switch (insn->op) {
+  case I_LDQ:
+  case I_ADQ:
+  case I_SBQ:
+  case I_REPI:
+    return 2;
+  case I_JR:
+    if (!strcmp(insn->name, "jr.s"))
+      return 2;
+    if (!strcmp(insn->name, "jr.l"))
+      return 4;
+    return 3;
+  case I_DJNZ:
+    return 3;
+  default:
+    return 2 + operand_size(&insn->a, insn->sz) + operand_size(&insn->b, insn->sz);
+  }
+}
+
+static int insn_cycles(Insn *insn) {
+  int cycles = get_timing(insn->name);
+  if (cycles < 0)
+    cycles = get_timing(opcode_names[insn->op]);
+  if (cycles < 0)
+    asm_error("no timing for %s", insn->name);
+  return cycles;
+}
+
+static void add_insn(Insn *insn) {
+  static int capacity;
+  if (insns_len == capacity) {
+    capacity = capacity ? capacity * 2 : 1024;
+    insns = realloc(insns, sizeof(Insn *) * capacity);
+  }
+  insns[insns_len++] = insn;
+}
+
+static void add_func(char *name, uint32_t addr) {
+  static int capacity;
+  if (funcs_len == capacity) {
+    capacity = capacity ? capacity * 2 : 64;
+    funcs = realloc(funcs, sizeof(Func) * capacity);
+  }
+  funcs[funcs_len++] = (Func){name, addr};
+}
+
+static void add_object(char *name, bool in_rom) {
+  static int capacity;
+  if (objs_len == capacity) {
+    capacity = capacity ? capacity * 2 : 64;
+    objs = realloc(objs, sizeof(Object) * capacity);
+  }
+  objs[objs_len++] = (Object){name, in_rom};
+  in_obj = true;
+}
+
+// Counts the bytes of a data directive towards the current object.
+static void add_data(char *label, bool in_rom, int size) {
+  if (label)
+    add_object(label, in_rom);
+  if (in_obj)
+    objs[objs_len - 1].size += size;
+}
+
+static void parse_insn(char *line, bool in_rom) {
+  if (!in_rom)
+    asm_error("instruction in bss bank");
+
+  Insn *insn = calloc(1, sizeof(Insn));
+  insn->file = cur_file;
+  insn->line_no = cur_line;
+
+  char *p = line;
+  while (*p && !isspace(*p))
+    p++;
+  insn->name = strndup(line, p - line);
+
+  char *dot = strchr(insn->name, '.');
+  char *base = dot ? strndup(insn->name, dot - insn->name) : insn->name;
+
+  int i = 0;
+  while (i < sizeof(opcode_names) / sizeof(*opcode_names) && strcmp(opcode_names[i], base))
+    i++;
+  if (i == sizeof(opcode_names) / sizeof(*opcode_names))
+    asm_error("unknown instruction: %s", insn->name);
+  insn->op = i;
+
+  insn->sz = 3;
+  if (dot && insn->op != I_JR) {
+    if (!strcmp(dot, ".b"))
+      insn->sz = 1;
+    else if (!strcmp(dot, ".w"))
+      insn->sz = 2;
+    else if (strcmp(dot, ".p"))
+      asm_error("unknown size suffix: %s", insn->name);
+  }
+
+  // Split operands
+  char *ops[3];
+  int nops = 0;
+  p = skip_space(p);
+  while (*p) {
+    if (nops == 3)
+      asm_error("too many operands");
+    char *q = strchr(p, ',');
+    char *s = q ? strndup(p, q - p) : strdup(p);
+    trim(s);
+    ops[nops++] = s;
+    p = q ? skip_space(q + 1) : p + strlen(p);
+  }
+
+  // The first operand of a conditional jump is a condition code.
+  if (insn->op == I_JR && nops == 2) {
+    int j = 0;
+    while (j < sizeof(cond_names) / sizeof(*cond_names) && strcmp(cond_names[j].name, ops[0]))
+      j++;
+    if (j == sizeof(cond_names) / sizeof(*cond_names))
+      asm_error("unknown condition: %s", ops[0]);
+    insn->cc = cond_names[j].cc;
+    ops[0] = ops[1];
+    nops = 1;
+  }
+
+  if (nops > 2)
+    asm_error("too many operands");
+  insn->nops = nops;
+  if (nops > 0)
+    insn->a = parse_operand(ops[0]);
+  if (nops > 1)
+    insn->b = parse_operand(ops[1]);
+
+  int expected = 2;
+  switch (insn->op) {
+  case I_NEG: case I_NGX: case I_CPL: case I_SLA: case I_SRA:
+  case I_SRL: case I_RL: case I_RR: case I_JR: case I_JP:
+  case I_CALL: case I_REPI:
+    expected = 1;
+    break;
+  default:
+    break;
+  }
+  if (nops != expected)
+    asm_error("%s takes %d operand(s)", insn->name, expected);
+
+  if (pending_fn) {
+    add_func(pending_fn, rom_end);
+    pending_fn = NULL;
+  }
+  pending_obj = NULL;
+  in_obj = false;
+
+  insn->addr = rom_end;
+  insn->size = insn_size(insn);
+  insn->cycles = insn_cycles(insn);
+  insn->fn = funcs_len - 1;
+  rom_end += insn->size;
+  add_insn(insn);
+}
+
+static void define_symbol(char *name, uint32_t addr) {
+  if (hashmap_get(&symbols, name))
+    asm_error("duplicate symbol: %s", name);
+  Symbol *sym = calloc(1, sizeof(Symbol));
+  sym->name = name;
+  sym->addr = addr;
+  hashmap_put(&symbols, name, sym);
+}
+
+static void write_mem(uint32_t addr, uint32_t val, int sz);
+
+static void parse_directive(char *line, bool *in_rom) {
+  char name[16];
+  int n;
+  if (sscanf(line, "#%15s%n", name, &n) != 1)
+    asm_error("bad directive");
+  char *arg = skip_space(line + n);
+  char *label = pending_obj;
+  pending_fn = pending_obj = NULL;
+  uint32_t *pc = *in_rom ? &rom_end : &bss_end;
+
+  if (!strcmp(name, "bank")) {
+    in_obj = false;
+    if (!strcmp(arg, "rom"))
+      *in_rom = true;
+    else if (!strcmp(arg, "bss"))
+      *in_rom = false;
+    else
+      asm_error("unknown bank: %s", arg);
+    return;
+  }
+
+  int64_t val;
+  if (!strcmp(name, "align")) {
+    if (!parse_num(arg, &val) || val <= 0 || val % 8)
+      asm_error("bad alignment: %s", arg);
+    int align = val / 8;
+    *pc = (*pc + align - 1) / align * align;
+    return;
+  }
+
+  if (!strcmp(name, "res")) {
+    if (!parse_num(arg, &val) || val < 0)
+      asm_error("bad size: %s", arg);
+    add_data(label, *in_rom, val);
+    *pc += val;
+    return;
+  }
+
+  int sz;
+  if (!strcmp(name, "d8"))
+    sz = 1;
+  else if (!strcmp(name, "d16"))
+    sz = 2;
+  else if (!strcmp(name, "d24"))
+    sz = 3;
+  else if (!strcmp(name, "d32"))
+    sz = 4;
+  else
+    asm_error("unknown directive: #%s", name);
+
+  if (!*in_rom)
+    asm_error("initialized data in bss bank");
+
+  char *sym;
+  int32_t addend;
+  parse_expr(arg, &sym, &addend);
+
+  if (sym) {
+    Fixup *fix = calloc(1, sizeof(Fixup));
+    *fix = (Fixup){fixups, *pc, sz, sym, addend, cur_file, cur_line};
+    fixups = fix;
+  } else {
+    write_mem(*pc, addend, sz);
+  }
+  add_data(label, *in_rom, sz);
+  *pc += sz;
+}
+
+static void load_file(char *path) {
+  bool in_rom = true;
+  char *buf = read_file(path);
+  cur_file = path;
+  cur_line = 0;
+  file_no++;
+
+  for (char *line = buf; line;) {
+    char *next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
+    cur_line++;
+
+    char *semi = strchr(line, ';');
+    if (semi)
+      *semi = '\0';
+    trim(line);
+    line = skip_space(line);
+
+    if (*line == '#') {
+      parse_directive(line, &in_rom);
+    } else if (*line && line[strlen(line) - 1] == ':') {
+      char *name = local_name(strndup(line, strlen(line) - 1));
+      uint32_t addr = in_rom ? rom_end : bss_end;
+      define_symbol(name, addr);
+
+      // Every code label that is not generated by the compiler
+      // starts a new function for profiling.
+      if (in_rom && strncmp(name, "__L_", 4))
+        pending_fn = name;
+      pending_obj = name;
+      in_obj = false;
+    } else if (*line) {
+      parse_insn(line, in_rom);
+    }
+
+    line = next;
+  }
+
+  if (rom_end >= BSS_BASE)
+    error("%s: rom bank overflows into bss", path);
+  if (bss_end >= PREG_BASE)
+    error("%s: bss bank too large", path);
+}
+
+// The code generator uses a few well-known memory locations as extra
+// registers, e.g. __long_10 and __long_11 are the low and high words
+// of the second long register. If the program doesn't define them,
+// we allocate them in a dedicated area.
+static bool pseudo_register(char *name, uint32_t *addr) {
+  static struct { char *prefix; int offset; int stride; } pregs[] = {
+    {"__long_", 0x000, 4}, {"__float_", 0x040, 4},
+    {"__double_", 0x080, 8}, {"__softfp_tmp", 0x100, 8},
+  };
+
+  for (int i = 0; i < sizeof(pregs) / sizeof(*pregs); i++) {
+    int len = strlen(pregs[i].prefix);
+    char *p = name + len;
+    if (strncmp(name, pregs[i].prefix, len) || !isdigit(p[0]) ||
+        !isdigit(p[1]) || p[2])
+      continue;
+    *addr = PREG_BASE + pregs[i].offset + (p[0] - '0') * pregs[i].stride +
+            (p[1] - '0') * 2;
+    return true;
+  }
+  return false;
+}
+
+static uint32_t resolve(char *name, char *file, int line_no) {
+  Symbol *sym = hashmap_get(&symbols, name);
+  if (sym)
+    return sym->addr;
+
+  uint32_t addr;
+  if (pseudo_register(name, &addr))
+    return addr;
+
+  cur_file = file;
+  cur_line = line_no;
+  char *at = strchr(name, '@');
+  asm_error("undefined symbol: %.*s", at ? (int)(at - name) : (int)strlen(name), name);
+}
+
+static void resolve_operand(Insn *insn, Operand *op) {
+  if (op->sym) {
+    op->val += resolve(op->sym, insn->file, insn->line_no);
+    op->sym = NULL;
+  }
+}
+
+static void set_func_sizes(void) {
+  for (int i = 0; i < funcs_len; i++) {
+    uint32_t end = (i + 1 < funcs_len) ? funcs[i + 1].addr : rom_end;
+    funcs[i].size = end - funcs[i].addr;
+  }
+}
+
+static void link_program(void) {
+  for (Fixup *fix = fixups; fix; fix = fix->next)
+    write_mem(fix->addr, resolve(fix->sym, fix->file, fix->line_no) + fix->addend, fix->sz);
+
+  code_index = calloc(rom_end + 1, sizeof(int));
+  for (int i = 0; i < insns_len; i++) {
+    Insn *insn = insns[i];
+    resolve_operand(insn, &insn->a);
+    resolve_operand(insn, &insn->b);
+    code_index[insn->addr] = i + 1;
+  }
+
+  set_func_sizes();
+}
+
+//
+// Execution
+//
+
+static uint32_t mask(int sz) {
+  return sz == 4 ? 0xffffffff : (1u << (sz * 8)) - 1;
+}
+
+static int32_t sign_extend(uint32_t val, int sz) {
+  int shift = 32 - sz * 8;
+  return (int32_t)(val << shift) >> shift;
+}
+
+static void write_mem(uint32_t addr, uint32_t val, int sz) {
+  for (int i = 0; i < sz; i++) {
+    uint32_t a = (addr + i) & ADDR_MASK;
+    uint8_t b = val >> (i * 8);
+
+    if (a == IO_PUTCHAR) {
+      putchar(b);
+      continue;
+    }
+    if (a == IO_EXIT) {
+      halted = true;
+      exit_status = b;
+      continue;
+    }
+    mem[a] = b;
+  }
+}
+
+static uint8_t read_byte(uint32_t addr) {
+  if (IO_TIMER <= addr && addr < IO_TIMER + 4)
+    return cycle_count >> ((addr - IO_TIMER) * 8);
+  return mem[addr];
+}
+
+static uint32_t read_mem(uint32_t addr, int sz) {
+  uint32_t val = 0;
+  for (int i = 0; i < sz; i++)
+    val |= (uint32_t)read_byte((addr + i) & ADDR_MASK) << (i * 8);
+  return val;
+}
+
+static uint8_t get_flags(void) {
+  return flag_c | flag_z << 1 | flag_s << 2 | flag_v << 3;
+}
+
+static void set_flags(uint8_t val) {
+  flag_c = val & 1;
+  flag_z = val & 2;
+  flag_s = val & 4;
+  flag_v = val & 8;
+}
+
+static uint32_t read_reg(int reg, int width) {
+  if (reg == REG_F)
+    return get_flags();
+  return regs[reg] & mask(width);
+}
+
+static void write_reg(int reg, int width, uint32_t val) {
+  if (reg == REG_F) {
+    set_flags(val);
+    return;
+  }
+  uint32_t m = mask(width);
+  regs[reg] = (regs[reg] & ~m & ADDR_MASK) | (val & m);
+}
+
+// Pointers occupy a 4-byte slot on the stack.
+static int step(int reg, int sz) {
+  return (reg == REG_SP && sz == 3) ? 4 : sz;
+}
+
+// Computes the address of a memory operand, applying its
+// post-increment or pre-decrement side effect.
+static uint32_t effective_addr(Operand *op, int sz) {
+  switch (op->mode) {
+  case MEM_PLAIN:
+    return regs[op->reg];
+  case MEM_POSTINC: {
+    uint32_t addr = regs[op->reg];
+    regs[op->reg] = (addr + step(op->reg, sz)) & ADDR_MASK;
+    return addr;
+  }
+  case MEM_PREDEC:
+    regs[op->reg] = (regs[op->reg] - step(op->reg, sz)) & ADDR_MASK;
+    if (op->reg == REG_SP && regs[REG_SP] < bss_end)
+      error("pilot24-sim: stack overflow");
+    return regs[op->reg];
+  case MEM_DISP:
+    if (op->reg < 0)
+      return op->val & ADDR_MASK;
+    return (regs[op->reg] + op->val) & ADDR_MASK;
+  }
+  unreachable();
+}
+
+typedef struct {
+  Operand *op;
+  uint32_t addr;
+} Loc;
+
+static Loc locate(Operand *op, int sz) {
+  Loc loc = {op};
+  if (op->kind == OP_MEM) {
+    loc.addr = effective_addr(op, sz);
+    cycle_count += get_timing("mem");
+  }
+  return loc;
+}
+
+static uint32_t load(Loc *loc, int sz) {
+  switch (loc->op->kind) {
+  case OP_REG:
+    return read_reg(loc->op->reg, sz);
+  case OP_IMM:
+    return loc->op->val & mask(sz);
+  case OP_MEM:
+    return read_mem(loc->addr, sz);
+  default:
+    unreachable();
+  }
+}
+
+static void store(Loc *loc, int sz, uint32_t val) {
+  switch (loc->op->kind) {
+  case OP_REG:
+    write_reg(loc->op->reg, loc->op->reg == REG_F ? 1 : sz, val);
+    return;
+  case OP_MEM:
+    write_mem(loc->addr, val & mask(sz), sz);
+    return;
+  default:
+    error("cannot write to an immediate operand");
+  }
+}
+
+static void set_zs(uint32_t res, int sz) {
+  flag_z = (res & mask(sz)) == 0;
+  flag_s = (res >> (sz * 8 - 1)) & 1;
+}
+
+static uint32_t do_add(uint32_t a, uint32_t b, int carry, int sz) {
+  uint64_t res = (uint64_t)a + b + carry;
+  uint32_t top = 1u << (sz * 8 - 1);
+  flag_c = (res >> (sz * 8)) & 1;
+  flag_v = ((a ^ res) & (b ^ res) & top) != 0;
+  set_zs(res, sz);
+  return res & mask(sz);
+}
+
+static uint32_t do_sub(uint32_t a, uint32_t b, int borrow, int sz) {
+  uint32_t res = (a - b - borrow) & mask(sz);
+  uint32_t top = 1u << (sz * 8 - 1);
+  flag_c = (uint64_t)b + borrow > a;
+  flag_v = ((a ^ b) & (a ^ res) & top) != 0;
+  set_zs(res, sz);
+  return res;
+}
+
+static uint32_t do_logic(uint32_t res, int sz) {
+  flag_c = flag_v = false;
+  set_zs(res, sz);
+  return res & mask(sz);
+}
+
+static bool check_cond(CondCode cc) {
+  switch (cc) {
+  case CC_ALWAYS: return true;
+  case CC_Z: return flag_z;
+  case CC_NZ: return !flag_z;
+  case CC_C: return flag_c;
+  case CC_NC: return !flag_c;
+  case CC_UGT: return !flag_c && !flag_z;
+  case CC_ULE: return flag_c || flag_z;
+  case CC_LT: return flag_s != flag_v;
+  case CC_GE: return flag_s == flag_v;
+  case CC_GT: return !flag_z && flag_s == flag_v;
+  case CC_LE: return flag_z || flag_s != flag_v;
+  case CC_P: return !flag_s;
+  case CC_M: return flag_s;
+  case CC_V: return flag_v;
+  case CC_NV: return !flag_v;
+  }
+  unreachable();
+}
+
+static void push_addr(uint32_t val) {
+  Operand op = {OP_MEM, REG_SP, 3, MEM_PREDEC};
+  write_mem(effective_addr(&op, 3), val, 3);
+}
+
+static noreturn void runtime_error(Insn *insn, char *msg) {
+  error("%s:%d: %s: %s (pc=%06x)", insn->file, insn->line_no, insn->name,
+        msg, insn->addr);
+}
+
+// Executes a single instruction and returns the address of
+// the next instruction.
+static uint32_t exec(Insn *insn) {
+  uint32_t next = insn->addr + insn->size;
+  int sz = insn->sz;
+
+  cycle_count += insn->cycles;
+  insn_count++;
+  if (insn->fn >= 0) {
+    funcs[insn->fn].insns++;
+    funcs[insn->fn].cycles += insn->cycles;
+  }
+
+  switch (insn->op) {
+  case I_LD: {
+    Loc dst = locate(&insn->a, sz);
+    Loc src = locate(&insn->b, sz);
+    store(&dst, sz, load(&src, sz));
+    return next;
+  }
+  case I_LDQ: {
+    Loc dst = locate(&insn->a, 3);
+    store(&dst, 3, sign_extend(insn->b.val & 0xff, 1));
+    return next;
+  }
+  case I_LDSX:
+  case I_LDZX: {
+    Loc dst = locate(&insn->a, 3);
+    Loc src = locate(&insn->b, sz);
+    uint32_t val = load(&src, sz);
+    if (insn->op == I_LDSX)
+      val = sign_extend(val, sz);
+    store(&dst, 3, val);
+    return next;
+  }
+  case I_LEA: {
+    if (insn->b.kind != OP_MEM)
+      runtime_error(insn, "operand is not a memory reference");
+    Loc dst = locate(&insn->a, 3);
+    store(&dst, 3, effective_addr(&insn->b, 3));
+    return next;
+  }
+  case I_ADD:
+  case I_ADQ:
+  case I_ADX:
+  case I_SUB:
+  case I_SBQ:
+  case I_SBX:
+  case I_CP:
+  case I_AND:
+  case I_OR:
+  case I_XOR: {
+    Loc dst = locate(&insn->a, sz);
+    Loc src = locate(&insn->b, sz);
+    uint32_t a = load(&dst, sz);
+    uint32_t b = load(&src, sz);
+    uint32_t res;
+
+    switch (insn->op) {
+    case I_ADD: case I_ADQ: res = do_add(a, b, 0, sz); break;
+    case I_ADX: res = do_add(a, b, flag_c, sz); break;
+    case I_SUB: case I_SBQ: case I_CP: res = do_sub(a, b, 0, sz); break;
+    case I_SBX: res = do_sub(a, b, flag_c, sz); break;
+    case I_AND: res = a & b; break;
+    case I_OR: res = a | b; break;
+    default: res = a ^ b; break;
+    }
+
+    // Logical operations on the flag register don't set flags.
+    bool to_flags = insn->a.kind == OP_REG && insn->a.reg == REG_F;
+    if ((insn->op == I_AND || insn->op == I_OR || insn->op == I_XOR) && !to_flags)
+      res = do_logic(res, sz);
+    if (insn->op != I_CP)
+      store(&dst, sz, res);
+    return next;
+  }
+  case I_NEG:
+  case I_NGX:
+  case I_CPL:
+  case I_SLA:
+  case I_SRA:
+  case I_SRL:
+  case I_RL:
+  case I_RR: {
+    Loc dst = locate(&insn->a, sz);
+    uint32_t a = load(&dst, sz);
+    uint32_t top = 1u << (sz * 8 - 1);
+    uint32_t res;
+
+    switch (insn->op) {
+    case I_NEG: res = do_sub(0, a, 0, sz); break;
+    case I_NGX: res = do_sub(0, a, flag_c, sz); break;
+    case I_CPL: res = do_logic(~a, sz); break;
+    case I_SLA:
+      res = do_logic(a << 1, sz);
+      flag_c = (a & top) != 0;
+      break;
+    case I_SRA:
+      res = do_logic((a >> 1) | (a & top), sz);
+      flag_c = a & 1;
+      break;
+    case I_SRL:
+      res = do_logic(a >> 1, sz);
+      flag_c = a & 1;
+      break;
+    case I_RL:
+      res = do_logic(a << 1 | flag_c, sz);
+      flag_c = (a & top) != 0;
+      break;
+    default:
+      res = do_logic(a >> 1 | (flag_c ? top : 0), sz);
+      flag_c = a & 1;
+      break;
+    }
+    store(&dst, sz, res);
+    return next;
+  }
+  case I_MULU:
+  case I_MULS:
+  case I_DIVU:
+  case I_DIVS: {
+    // The result goes to the first operand. The upper half of the
+    // product, or the remainder, goes to register 0 of the same width.
+    Loc dst = locate(&insn->a, sz);
+    Loc src = locate(&insn->b, sz);
+    uint32_t a = load(&dst, sz);
+    uint32_t b = load(&src, sz);
+    bool is_signed = (insn->op == I_MULS || insn->op == I_DIVS);
+    int64_t x = is_signed ? sign_extend(a, sz) : a;
+    int64_t y = is_signed ? sign_extend(b, sz) : b;
+    uint64_t lo, hi;
+
+    if (insn->op == I_MULU || insn->op == I_MULS) {
+      uint64_t prod = x * y;
+      lo = prod & mask(sz);
+      hi = (prod >> (sz * 8)) & mask(sz);
+      flag_c = flag_v = hi != 0;
+      flag_z = lo == 0 && hi == 0;
+    } else {
+      if (y == 0)
+        runtime_error(insn, "division by zero");
+      lo = (x / y) & mask(sz);
+      hi = (x % y) & mask(sz);
+      flag_c = flag_v = false;
+      flag_z = lo == 0;
+    }
+    flag_s = (lo >> (sz * 8 - 1)) & 1;
+
+    store(&dst, sz, lo);
+    if (!(insn->a.kind == OP_REG && insn->a.reg == 0))
+      write_reg(0, sz, hi);
+    return next;
+  }
+  case I_JR:
+    if (!check_cond(insn->cc))
+      return next;
+    cycle_count += get_timing("taken");
+    return insn->a.val & ADDR_MASK;
+  case I_JP: {
+    Loc src = locate(&insn->a, 3);
+    return load(&src, 3);
+  }
+  case I_CALL: {
+    Loc src = locate(&insn->a, 3);
+    uint32_t target = load(&src, 3);
+    push_addr(next);
+    return target;
+  }
+  case I_DJNZ: {
+    if (insn->a.kind != OP_REG)
+      runtime_error(insn, "operand is not a register");
+    int reg = insn->a.reg;
+    regs[reg] = (regs[reg] - 1) & ADDR_MASK;
+    if (regs[reg] == 0)
+      return next;
+    cycle_count += get_timing("taken");
+    return insn->b.val & ADDR_MASK;
+  }
+  case I_REPI:
+    unreachable();
+  }
+  unreachable();
+}
+
+static Insn *fetch(uint32_t pc) {
+  if (pc >= rom_end || !code_index[pc])
+    error("pilot24-sim: jump to non-code address %06x", pc);
+  return insns[code_index[pc] - 1];
+}
+
+static void run(char *entry) {
+  Symbol *sym = hashmap_get(&symbols, entry);
+  if (!sym)
+    error("pilot24-sim: entry point %s is not defined", entry);
+
+  regs[REG_SP] = STACK_TOP;
+  push_addr(HALT_ADDR);
+  uint32_t pc = sym->addr;
+
+  while (!halted) {
+    if (pc == HALT_ADDR) {
+      exit_status = regs[0] & 0xff;
+      break;
+    }
+
+    Insn *insn = fetch(pc);
+
+    // repi N executes the following instruction N times.
+    if (insn->op == I_REPI) {
+      cycle_count += insn->cycles;
+      insn_count++;
+      Insn *next = fetch(insn->addr + insn->size);
+      for (int i = 0; i < insn->a.val && !halted; i++)
+        pc = exec(next);
+      if (insn->a.val <= 0)
+        pc = next->addr + next->size;
+    } else {
+      pc = exec(insn);
+    }
+
+    if (max_cycles && cycle_count > max_cycles)
+      error("pilot24-sim: cycle limit exceeded (pc=%06x)", pc);
+  }
+}
+
+static int compare_symbols(const void *x, const void *y) {
+  Symbol *a = *(Symbol **)x;
+  Symbol *b = *(Symbol **)y;
+  return (a->addr > b->addr) - (a->addr < b->addr);
+}
+
+// Writes the value of each 32-bit profile counter emitted by
+// chibicc -pg, one "<name> <value>" pair per line.
+static void dump_counters(char *path) {
+  Symbol **syms = calloc(symbols.used, sizeof(Symbol *));
+  int len = 0;
+
+  for (int i = 0; i < symbols.capacity; i++) {
+    Symbol *sym = symbols.buckets[i].val;
+    if (sym && !strncmp(sym->name, "__prof_", 7))
+      syms[len++] = sym;
+  }
+  qsort(syms, len, sizeof(Symbol *), compare_symbols);
+
+  FILE *out = fopen(path, "w");
+  if (!out)
+    error("cannot open %s: %s", path, strerror(errno));
+  for (int i = 0; i < len; i++)
+    fprintf(out, "%s %u\n", syms[i]->name, read_mem(syms[i]->addr, 4));
+  fclose(out);
+}
+
+static void print_stats(bool profile) {
+  fprintf(stderr, "instructions %llu\n", (unsigned long long)insn_count);
+  fprintf(stderr, "cycles %llu\n", (unsigned long long)cycle_count);
+  fprintf(stderr, "rom %u\n", rom_end - ROM_BASE);
+  fprintf(stderr, "bss %u\n", bss_end - BSS_BASE);
+
+  if (!profile)
+    return;
+
+  for (int i = 0; i < funcs_len; i++) {
+    Func *fn = &funcs[i];
+    fprintf(stderr, "function %s %d %llu %llu\n", fn->name, fn->size,
+            (unsigned long long)fn->insns, (unsigned long long)fn->cycles);
+  }
+}
+
+// Prints the size of each function and data object and the cost of
+// executing each instruction once, without running the program.
+// Taken-branch penalties are not included because they depend on
+// the path taken at runtime.
+static void print_analysis(void) {
+  uint64_t total = 0;
+  for (int i = 0; i < insns_len; i++) {
+    Insn *insn = insns[i];
+    uint64_t cycles = insn->cycles;
+    if (insn->a.kind == OP_MEM)
+      cycles += get_timing("mem");
+    if (insn->b.kind == OP_MEM)
+      cycles += get_timing("mem");
+    if (insn->fn >= 0) {
+      funcs[insn->fn].insns++;
+      funcs[insn->fn].cycles += cycles;
+    }
+    total += cycles;
+  }
+  set_func_sizes();
+
+  printf("instructions %d\n", insns_len);
+  printf("cycles %llu\n", (unsigned long long)total);
+  printf("rom %u\n", rom_end - ROM_BASE);
+  printf("bss %u\n", bss_end - BSS_BASE);
+
+  for (int i = 0; i < funcs_len; i++) {
+    Func *fn = &funcs[i];
+    printf("function %s %d %llu %llu\n", fn->name, fn->size,
+           (unsigned long long)fn->insns, (unsigned long long)fn->cycles);
+  }
+
+  // Compiler-generated labels are printed without their file suffix.
+  for (int i = 0; i < objs_len; i++) {
+    Object *obj = &objs[i];
+    printf("object %.*s %s %d\n", (int)strcspn(obj->name, "@"), obj->name,
+           obj->in_rom ? "rom" : "bss", obj->size);
+  }
+}
+
+int main(int argc, char **argv) {
+  StringArray inputs = {};
+  char *entry = "main";
+  char *timing_file = NULL;
+  char *counter_file = NULL;
+  bool opt_s = false;
+  bool opt_p = false;
+  bool opt_a = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--help"))
+      usage(0);
+
+    if (!strcmp(argv[i], "-s")) {
+      opt_s = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-a")) {
+      opt_a = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-p")) {
+      opt_s = opt_p = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "-c") ||
+        !strcmp(argv[i], "-e") || !strcmp(argv[i], "-g")) {
+      if (!argv[i + 1])
+        usage(1);
+      if (argv[i][1] == 't')
+        timing_file = argv[++i];
+      else if (argv[i][1] == 'c')
+        max_cycles = strtoull(argv[++i], NULL, 10);
+      else if (argv[i][1] == 'g')
+        counter_file = argv[++i];
+      else
+        entry = argv[++i];
+      continue;
+    }
+
+    if (argv[i][0] == '-' && argv[i][1] != '\0')
+      error("unknown argument: %s", argv[i]);
+
+    strarray_push(&inputs, argv[i]);
+  }
+
+  if (inputs.len == 0)
+    usage(1);
+
+  init_timing();
+  if (timing_file)
+    read_timing_file(timing_file);
+
+  mem = calloc(1, MEM_SIZE);
+  for (int i = 0; i < inputs.len; i++)
+    load_file(inputs.data[i]);
+
+  if (opt_a) {
+    print_analysis();
+    return 0;
+  }
+
+  link_program();
+
+  run(entry);
+  fflush(stdout);
+
+  if (counter_file)
+    dump_counters(counter_file);
+  if (opt_s)
+    print_stats(opt_p);
+  return exit_status;
+}
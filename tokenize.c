@@ -1,10 +1,21 @@
 #include "chibicc.h"
 
+// Under AddressSanitizer, the vector loads below would be reported
+// because they may read past the end of a buffer within a page.
+#if defined(__GNUC__) && defined(__SSE2__) && !defined(__SANITIZE_ADDRESS__)
+# define USE_SSE2
+# include <emmintrin.h>
+#endif
+
 // Input file
 static File *current_file;
 
-// A list of all input files.
+// A list of all input files of the current translation unit.
 static File **input_files;
+static int num_input_files;
+
+// Incremented for each translation unit.
+static int generation;
 
 // True if the current position is at the beginning of a line
 static bool at_bol;
@@ -12,10 +23,36 @@ static bool at_bol;
 // True if the current position follows a space character
 static bool has_space;
 
+// Character classes of ASCII bytes. Bytes >= 0x80 are parts of
+// UTF-8 sequences and are classified by unicode.c.
+#define CC_SPACE  1  // Whitespace
+#define CC_DIGIT  2  // Decimal digit
+#define CC_IDENT1 4  // Can start an identifier
+#define CC_IDENT2 8  // Can continue an identifier
+#define CC_PUNCT  16 // Single-character punctuator
+
+static unsigned char char_class[256];
+
+_Thread_local ErrorTrap *error_trap;
+
+static noreturn void trap_error(Token *tok, char *fmt, va_list ap) {
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+  vfprintf(out, fmt, ap);
+  fclose(out);
+
+  error_trap->tok = tok;
+  error_trap->msg = buf;
+  longjmp(error_trap->env, 1);
+}
+
 // Reports an error and exit.
 void error(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
+  if (error_trap)
+    trap_error(NULL, fmt, ap);
   vfprintf(stderr, fmt, ap);
   fprintf(stderr, "\n");
   exit(1);
@@ -50,34 +87,104 @@ static void verror_at(char *filename, char *input, int line_no,
 }
 
 void error_at(char *loc, char *fmt, ...) {
-  int line_no = 1;
-  for (char *p = current_file->contents; p < loc; p++)
-    if (*p == '\n')
-      line_no++;
-
   va_list ap;
   va_start(ap, fmt);
-  verror_at(current_file->name, current_file->contents, line_no, loc, fmt, ap);
+  verror_at(current_file->name, current_file->contents,
+            get_line_no(current_file, loc), loc, fmt, ap);
   exit(1);
 }
 
 void error_tok(Token *tok, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  verror_at(tok->file->name, tok->file->contents, tok->line_no, tok->loc, fmt, ap);
+  if (error_trap)
+    trap_error(tok, fmt, ap);
+  verror_at(tok->file->name, tok->file->contents, tok_line_no(tok), tok->loc, fmt, ap);
   exit(1);
 }
 
 void warn_tok(Token *tok, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  verror_at(tok->file->name, tok->file->contents, tok->line_no, tok->loc, fmt, ap);
+  verror_at(tok->file->name, tok->file->contents, tok_line_no(tok), tok->loc, fmt, ap);
   va_end(ap);
 }
 
-// Consumes the current token if it matches `op`.
+// Returns the physical line number of `loc` in `file`.
+//
+// Tokens don't carry line numbers because most of them are never
+// asked for one. Instead, the first call for a file records where
+// each of its lines begins, and later calls binary-search that.
+int get_line_no(File *file, char *loc) {
+  if (!file->line_starts) {
+    int cap = 64;
+    file->line_starts = calloc(cap, sizeof(int));
+    file->line_starts[file->num_lines++] = 0;
+
+    for (char *p = strchr(file->contents, '\n'); p; p = strchr(p + 1, '\n')) {
+      if (file->num_lines == cap) {
+        cap *= 2;
+        file->line_starts = realloc(file->line_starts, cap * sizeof(int));
+      }
+      file->line_starts[file->num_lines++] = p + 1 - file->contents;
+    }
+  }
+
+  int off = loc - file->contents;
+  int lo = 0;
+  int hi = file->num_lines - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (file->line_starts[mid] <= off)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo + 1;
+}
+
+// Returns the line number of a token, adjusted by #line.
+int tok_line_no(Token *tok) {
+  return get_line_no(tok->file, tok->loc) + tok->line_delta;
+}
+
+// Identifiers, keywords and punctuators are interned, so that each
+// distinct spelling is represented by a single string. Interned
+// strings can be compared by address and used as hashmap keys that
+// match by address. The byte before each of them holds IDENT_* flags,
+// which answer questions like "can this be a macro?" without a
+// hashmap lookup.
+char *intern(char *s, int len) {
+  static HashMap map;
+
+  char *str = hashmap_get2(&map, s, len);
+  if (str)
+    return str;
+  str = calloc(1, len + 2) + 1;
+  memcpy(str, s, len);
+  hashmap_put2(&map, str, len, str);
+  return str;
+}
+
+// Returns the interned form of `op`. The strings passed to equal()
+// are string literals, so their interned forms are cached by address.
+static char *intern_op(char *op) {
+  static struct { char *op; char *str; } cache[1024];
+
+  uint64_t h = (uintptr_t)op * 0x9e3779b97f4a7c15ULL;
+  int i = h >> 54;
+  if (cache[i].op != op) {
+    cache[i].op = op;
+    cache[i].str = intern(op, strlen(op));
+  }
+  return cache[i].str;
+}
+
+// Returns true if the current token matches `op`, which must be a
+// string literal. Only identifiers, keywords and punctuators can
+// match, and their spellings are interned.
 bool equal(Token *tok, char *op) {
-  return memcmp(tok->loc, op, tok->len) == 0 && op[tok->len] == '\0';
+  return tok->ident && tok->ident == intern_op(op);
 }
 
 // Ensure that the current token is `op`.
@@ -96,9 +203,22 @@ bool consume(Token **rest, Token *tok, char *str) {
   return false;
 }
 
+// Most tokens are single-character punctuators, so we cache them
+// to avoid a hashmap lookup for each.
+static char *intern_punct(char *p, int len) {
+  static char *cache[256];
+
+  if (len > 1)
+    return intern(p, len);
+  unsigned char c = *p;
+  if (!cache[c])
+    cache[c] = intern(p, 1);
+  return cache[c];
+}
+
 // Create a new token.
 static Token *new_token(TokenKind kind, char *start, char *end) {
-  Token *tok = calloc(1, sizeof(Token));
+  Token *tok = arena_alloc(&token_arena, sizeof(Token));
   tok->kind = kind;
   tok->loc = start;
   tok->len = end - start;
@@ -106,27 +226,153 @@ static Token *new_token(TokenKind kind, char *start, char *end) {
   tok->filename = current_file->display_name;
   tok->at_bol = at_bol;
   tok->has_space = has_space;
+  if (kind == TK_IDENT)
+    tok->ident = intern(start, end - start);
+  else if (kind == TK_PUNCT)
+    tok->ident = intern_punct(start, end - start);
 
   at_bol = has_space = false;
   return tok;
 }
 
 static bool startswith(char *p, char *q) {
-  return strncmp(p, q, strlen(q)) == 0;
+  for (; *q; p++, q++)
+    if (*p != *q)
+      return false;
+  return true;
+}
+
+static void init_char_class(void) {
+  for (int c = 0; c < 128; c++) {
+    if (isspace(c))
+      char_class[c] |= CC_SPACE;
+    if (isdigit(c))
+      char_class[c] |= CC_DIGIT | CC_IDENT2;
+    if (isalpha(c) || c == '_' || c == '$')
+      char_class[c] |= CC_IDENT1 | CC_IDENT2;
+    else if (ispunct(c))
+      char_class[c] |= CC_PUNCT;
+  }
+}
+
+static bool is_class(char c, int cls) {
+  return char_class[(unsigned char)c] & cls;
+}
+
+// The following functions skip over runs of bytes that the tokenizer
+// would otherwise consume one at a time. With SSE2, they examine 16
+// bytes at a time. Loads are 16-byte aligned so that they never cross
+// a page boundary, and bits for bytes before `p` are masked off. Every
+// scan stops at the terminating '\0', so we never read past the
+// 16-byte block containing it.
+//
+// `char` is signed on x86-64, so bytes >= 0x80 are negative and never
+// in an ASCII range.
+#ifdef USE_SSE2
+typedef char Vec __attribute__((vector_size(16)));
+
+static char *first_set(char *q, unsigned mask, Vec m) {
+  return q + __builtin_ctz(_mm_movemask_epi8((__m128i)m) & mask);
+}
+#endif
+
+// Skips spaces and tabs.
+static char *skip_blanks(char *p) {
+#ifdef USE_SSE2
+  char *q = (char *)((uintptr_t)p & ~15);
+  unsigned mask = 0xffff << (p - q);
+
+  for (;; q += 16, mask = 0xffff) {
+    Vec v = *(Vec *)q;
+    Vec m = (v != ' ') & (v != '\t');
+    if (_mm_movemask_epi8((__m128i)m) & mask)
+      return first_set(q, mask, m);
+  }
+#else
+  while (*p == ' ' || *p == '\t')
+    p++;
+  return p;
+#endif
+}
+
+// Skips ASCII characters that can continue an identifier.
+static char *skip_ident_chars(char *p) {
+#ifdef USE_SSE2
+  char *q = (char *)((uintptr_t)p & ~15);
+  unsigned mask = 0xffff << (p - q);
+
+  for (;; q += 16, mask = 0xffff) {
+    Vec v = *(Vec *)q;
+    Vec lower = v | 0x20;
+    Vec m = ((lower < 'a') | (lower > 'z')) & ((v < '0') | (v > '9')) &
+            (v != '_') & (v != '$');
+    if (_mm_movemask_epi8((__m128i)m) & mask)
+      return first_set(q, mask, m);
+  }
+#else
+  while (is_class(*p, CC_IDENT2))
+    p++;
+  return p;
+#endif
+}
+
+// Finds the first '"', '\\', '\n' or '\0'.
+static char *find_string_special(char *p) {
+#ifdef USE_SSE2
+  char *q = (char *)((uintptr_t)p & ~15);
+  unsigned mask = 0xffff << (p - q);
+
+  for (;; q += 16, mask = 0xffff) {
+    Vec v = *(Vec *)q;
+    Vec m = (v == '"') | (v == '\\') | (v == '\n') | (v == '\0');
+    if (_mm_movemask_epi8((__m128i)m) & mask)
+      return first_set(q, mask, m);
+  }
+#else
+  while (*p != '"' && *p != '\\' && *p != '\n' && *p != '\0')
+    p++;
+  return p;
+#endif
+}
+
+// Finds the first '\r', '\\' or '\0'.
+static char *find_cr_or_backslash(char *p) {
+#ifdef USE_SSE2
+  char *q = (char *)((uintptr_t)p & ~15);
+  unsigned mask = 0xffff << (p - q);
+
+  for (;; q += 16, mask = 0xffff) {
+    Vec v = *(Vec *)q;
+    Vec m = (v == '\r') | (v == '\\') | (v == '\0');
+    if (_mm_movemask_epi8((__m128i)m) & mask)
+      return first_set(q, mask, m);
+  }
+#else
+  while (*p != '\r' && *p != '\\' && *p != '\0')
+    p++;
+  return p;
+#endif
 }
 
 // Read an identifier and returns the length of it.
 // If p does not point to a valid identifier, 0 is returned.
+//
+// ASCII characters are classified by a table lookup. Only non-ASCII
+// characters are decoded and checked against the Unicode ranges.
 static int read_ident(char *start) {
   char *p = start;
-  uint32_t c = decode_utf8(&p, p);
-  if (!is_ident1(c))
-    return 0;
 
   for (;;) {
+    if ((unsigned char)*p < 128) {
+      if (!is_class(*p, p == start ? CC_IDENT1 : CC_IDENT2))
+        return p - start;
+      p = skip_ident_chars(p + 1);
+      continue;
+    }
+
     char *q;
-    c = decode_utf8(&q, p);
-    if (!is_ident2(c))
+    uint32_t c = decode_utf8(&q, p);
+    if (!(p == start ? is_ident1(c) : is_ident2(c)))
       return p - start;
     p = q;
   }
@@ -141,24 +387,44 @@ static int from_hex(char c) {
 }
 
 // Read a punctuator token from p and returns its length.
+// The longest punctuator that matches wins.
 static int read_punct(char *p) {
-  static char *kw[] = {
-    "<<=", ">>=", "...", "==", "!=", "<=", ">=", "->", "+=",
-    "-=", "*=", "/=", "++", "--", "%=", "&=", "|=", "^=", "&&",
-    "||", "<<", ">>", "##",
-  };
-
-  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-    if (startswith(p, kw[i]))
-      return strlen(kw[i]);
+  switch (*p) {
+  case '<':
+  case '>':
+    // << <<= <= >> >>= >=
+    if (p[1] == p[0])
+      return (p[2] == '=') ? 3 : 2;
+    return (p[1] == '=') ? 2 : 1;
+  case '+':
+  case '-':
+  case '&':
+  case '|':
+    // ++ += -- -= -> && &= || |=
+    if (p[1] == p[0] || p[1] == '=' || (p[0] == '-' && p[1] == '>'))
+      return 2;
+    return 1;
+  case '=':
+  case '!':
+  case '*':
+  case '/':
+  case '%':
+  case '^':
+    // == != *= /= %= ^=
+    return (p[1] == '=') ? 2 : 1;
+  case '.':
+    return (p[1] == '.' && p[2] == '.') ? 3 : 1;
+  case '#':
+    return (p[1] == '#') ? 2 : 1;
+  }
 
-  return ispunct(*p) ? 1 : 0;
+  return is_class(*p, CC_PUNCT) ? 1 : 0;
 }
 
 static bool is_keyword(Token *tok) {
-  static HashMap map;
+  static bool init;
 
-  if (map.capacity == 0) {
+  if (!init) {
     static char *kw[] = {
       "return", "if", "else", "for", "while", "int", "sizeof", "char",
       "struct", "union", "short", "long", "void", "typedef", "_Bool",
@@ -171,10 +437,11 @@ static bool is_keyword(Token *tok) {
     };
 
     for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-      hashmap_put(&map, kw[i], (void *)1);
+      intern(kw[i], strlen(kw[i]))[-1] |= IDENT_KEYWORD;
+    init = true;
   }
 
-  return hashmap_get2(&map, tok->loc, tok->len);
+  return tok->kind == TK_IDENT && (tok->ident[-1] & IDENT_KEYWORD);
 }
 
 static int read_escaped_char(char **new_pos, char *p) {
@@ -233,13 +500,14 @@ static int read_escaped_char(char **new_pos, char *p) {
 // Find a closing double-quote.
 static char *string_literal_end(char *p) {
   char *start = p;
-  for (; *p != '"'; p++) {
+  for (;;) {
+    p = find_string_special(p);
+    if (*p == '"')
+      return p;
     if (*p == '\n' || *p == '\0')
       error_at(start, "unclosed string literal");
-    if (*p == '\\')
-      p++;
+    p += 2;
   }
-  return p;
 }
 
 static Token *read_string_literal(char *start, char *quote) {
@@ -440,8 +708,12 @@ static void convert_pp_number(Token *tok) {
   tok->ty = ty;
 }
 
+// Turns preprocessed tokens into the ones the parser reads. Hidesets
+// live only as long as the preprocessor's arena, so they are cleared
+// here, and no token left over from preprocessing refers to one.
 void convert_pp_tokens(Token *tok) {
   for (Token *t = tok; t->kind != TK_EOF; t = t->next) {
+    t->hideset = NULL;
     if (is_keyword(t))
       t->kind = TK_KEYWORD;
     else if (t->kind == TK_PP_NUM)
@@ -449,21 +721,6 @@ void convert_pp_tokens(Token *tok) {
   }
 }
 
-// Initialize line info for all tokens.
-static void add_line_numbers(Token *tok) {
-  char *p = current_file->contents;
-  int n = 1;
-
-  do {
-    if (p == tok->loc) {
-      tok->line_no = n;
-      tok = tok->next;
-    }
-    if (*p == '\n')
-      n++;
-  } while (*p++);
-}
-
 Token *tokenize_string_literal(Token *tok, Type *basety) {
   Token *t;
   if (basety->size == 2)
@@ -485,12 +742,18 @@ Token *tokenize(File *file) {
   at_bol = true;
   has_space = false;
 
+  static bool init;
+  if (!init) {
+    init_char_class();
+    init = true;
+  }
+
   while (*p) {
     // Skip line comments.
     if (startswith(p, "//")) {
-      p += 2;
-      while (*p != '\n')
-        p++;
+      // strchr() is vectorized in libc.
+      char *q = strchr(p + 2, '\n');
+      p = q ? q : p + strlen(p);
       has_space = true;
       continue;
     }
@@ -514,17 +777,18 @@ Token *tokenize(File *file) {
     }
 
     // Skip whitespace characters.
-    if (isspace(*p)) {
-      p++;
+    if (is_class(*p, CC_SPACE)) {
+      p = skip_blanks(p + 1);
       has_space = true;
       continue;
     }
 
     // Numeric literal
-    if (isdigit(*p) || (*p == '.' && isdigit(p[1]))) {
+    if (is_class(*p, CC_DIGIT) || (*p == '.' && is_class(p[1], CC_DIGIT))) {
       char *q = p++;
       for (;;) {
-        if (p[0] && p[1] && strchr("eEpP", p[0]) && strchr("+-", p[1]))
+        if ((p[0] == 'e' || p[0] == 'E' || p[0] == 'p' || p[0] == 'P') &&
+            (p[1] == '+' || p[1] == '-'))
           p += 2;
         else if (isalnum(*p) || *p == '.')
           p++;
@@ -620,18 +884,58 @@ Token *tokenize(File *file) {
   }
 
   cur = cur->next = new_token(TK_EOF, p, p);
-  add_line_numbers(head.next);
   return head.next;
 }
 
-// Returns the contents of a given file.
-static char *read_file(char *path) {
+// Maps a file into memory without copying it. That works only if
+// the file ends with a newline and its size is not a multiple of the
+// page size, because then the zero-filled rest of the last page
+// terminates the contents. Otherwise, NULL is returned.
+static char *map_file(char *path, size_t *len) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  char *p = NULL;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      st.st_size % sysconf(_SC_PAGESIZE) != 0) {
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      p = NULL;
+    } else if (p[st.st_size - 1] != '\n') {
+      munmap(p, st.st_size);
+      p = NULL;
+    } else {
+      *len = st.st_size;
+    }
+  }
+
+  close(fd);
+  return p;
+}
+
+// Returns the contents of a given file. If `mapped` is not NULL, it
+// is set to the length of the mapping, or 0 if the contents were
+// read into a buffer (see free_contents()).
+static char *read_file(char *path, size_t *mapped) {
   FILE *fp;
+  size_t len = 0;
+
+  if (mapped)
+    *mapped = 0;
 
   if (strcmp(path, "-") == 0) {
     // By convention, read from stdin if a given filename is "-".
     fp = stdin;
   } else {
+    char *p = map_file(path, &len);
+    if (p) {
+      if (mapped)
+        *mapped = len;
+      return p;
+    }
+
     fp = fopen(path, "r");
     if (!fp)
       return NULL;
@@ -662,10 +966,31 @@ static char *read_file(char *path) {
   return buf;
 }
 
+static void free_contents(char *p, size_t mapped) {
+  if (mapped)
+    munmap(p, mapped);
+  else
+    free(p);
+}
+
 File **get_input_files(void) {
   return input_files;
 }
 
+void add_input_file(File *file) {
+  input_files = realloc(input_files, sizeof(File *) * (num_input_files + 2));
+  input_files[num_input_files++] = file;
+  input_files[num_input_files] = NULL;
+}
+
+// Called at the start of each translation unit but the first one.
+void reset_input_files(void) {
+  generation++;
+  num_input_files = 0;
+  if (input_files)
+    input_files[0] = NULL;
+}
+
 File *new_file(char *name, int file_no, char *contents) {
   File *file = calloc(1, sizeof(File));
   file->name = name;
@@ -675,52 +1000,6 @@ File *new_file(char *name, int file_no, char *contents) {
   return file;
 }
 
-// Replaces \r or \r\n with \n.
-static void canonicalize_newline(char *p) {
-  int i = 0, j = 0;
-
-  while (p[i]) {
-    if (p[i] == '\r' && p[i + 1] == '\n') {
-      i += 2;
-      p[j++] = '\n';
-    } else if (p[i] == '\r') {
-      i++;
-      p[j++] = '\n';
-    } else {
-      p[j++] = p[i++];
-    }
-  }
-
-  p[j] = '\0';
-}
-
-// Removes backslashes followed by a newline.
-static void remove_backslash_newline(char *p) {
-  int i = 0, j = 0;
-
-  // We want to keep the number of newline characters so that
-  // the logical line number matches the physical one.
-  // This counter maintain the number of newlines we have removed.
-  int n = 0;
-
-  while (p[i]) {
-    if (p[i] == '\\' && p[i + 1] == '\n') {
-      i += 2;
-      n++;
-    } else if (p[i] == '\n') {
-      p[j++] = p[i++];
-      for (; n > 0; n--)
-        p[j++] = '\n';
-    } else {
-      p[j++] = p[i++];
-    }
-  }
-
-  for (; n > 0; n--)
-    p[j++] = '\n';
-  p[j] = '\0';
-}
-
 static uint32_t read_universal_char(char *p, int len) {
   uint32_t c = 0;
   for (int i = 0; i < len; i++) {
@@ -731,11 +1010,14 @@ static uint32_t read_universal_char(char *p, int len) {
   return c;
 }
 
-// Replace \u or \U escape sequences with corresponding UTF-8 bytes.
-static void convert_universal_chars(char *p) {
-  char *q = p;
+// Replace \u or \U escape sequences in [*rest, end) with
+// corresponding UTF-8 bytes, writing them to *out. A sequence may
+// extend past `end`.
+static void convert_universal_chars(char **rest, char **out, char *end) {
+  char *p = *rest;
+  char *q = *out;
 
-  while (*p) {
+  while (p < end) {
     if (startswith(p, "\\u")) {
       uint32_t c = read_universal_char(p + 2, 4);
       if (c) {
@@ -760,14 +1042,74 @@ static void convert_universal_chars(char *p) {
     }
   }
 
-  *q = '\0';
+  *rest = p;
+  *out = q;
 }
 
-Token *tokenize_file(char *path) {
-  char *p = read_file(path);
-  if (!p)
-    return NULL;
+// Returns true if the source contains \r, a backslash-newline or
+// something that looks like a \u or \U escape sequence.
+static bool needs_fixup(char *p) {
+  for (;;) {
+    p = find_cr_or_backslash(p);
+    if (*p == '\0')
+      return false;
+    if (*p == '\r' || p[1] == '\n' || p[1] == 'u' || p[1] == 'U')
+      return true;
+    p++;
+  }
+}
+
+// Copies the source to a new buffer, replacing \r or \r\n with \n,
+// removing backslash-newlines and converting \u and \U escape
+// sequences, in this order.
+//
+// This is done in a single pass. The first two are applied to each
+// input character. The last one needs to look ahead up to 10
+// characters of their output, so it trails behind them in the same
+// buffer.
+static char *fixup_source(char *src) {
+  char *buf = calloc(1, strlen(src) + 1);
+  char *p = src;
+  char *w = buf; // End of the output of the first two
+  char *r = buf; // Start of the input of the last one
+  char *q = buf; // End of the output of the last one
+
+  // We want to keep the number of newline characters so that
+  // the logical line number matches the physical one.
+  // This counter maintain the number of newlines we have removed.
+  int n = 0;
+
+  while (*p) {
+    char c = *p++;
+    if (c == '\r') {
+      if (*p == '\n')
+        p++;
+      c = '\n';
+    }
+
+    if (c == '\\' && (*p == '\n' || *p == '\r')) {
+      p += (p[0] == '\r' && p[1] == '\n') ? 2 : 1;
+      n++;
+    } else if (c == '\n') {
+      *w++ = '\n';
+      for (; n > 0; n--)
+        *w++ = '\n';
+    } else {
+      *w++ = c;
+    }
+
+    if (w - r > 10)
+      convert_universal_chars(&r, &q, w - 10);
+  }
+
+  for (; n > 0; n--)
+    *w++ = '\n';
+  convert_universal_chars(&r, &q, w);
+  *q = '\0';
+  return buf;
+}
 
+static Token *tokenize_contents(char *path, char *p) {
   // UTF-8 texts may start with a 3-byte "BOM" marker sequence.
   // If exists, just skip them because they are useless bytes.
   // (It is actually not recommended to add BOM markers to UTF-8
@@ -775,19 +1117,238 @@ Token *tokenize_file(char *path) {
   if (!memcmp(p, "\xef\xbb\xbf", 3))
     p += 3;
 
-  canonicalize_newline(p);
-  remove_backslash_newline(p);
-  convert_universal_chars(p);
+  if (needs_fixup(p))
+    p = fixup_source(p);
 
   // Save the filename for assembler .file directive.
-  static int file_no;
-  File *file = new_file(path, file_no + 1, p);
+  File *file = new_file(path, num_input_files + 1, p);
+  add_input_file(file);
+  return tokenize(file);
+}
 
-  // Save the filename for assembler .file directive.
-  input_files = realloc(input_files, sizeof(char *) * (file_no + 2));
-  input_files[file_no] = file;
-  input_files[file_no + 1] = NULL;
-  file_no++;
+Token *tokenize_file(char *path) {
+  char *p = read_file(path, NULL);
+  if (!p)
+    return NULL;
+  return tokenize_contents(path, p);
+}
 
-  return tokenize(file);
+// Headers are often included more than once, and with
+// -fintegrated-cc1 or --server by many translation units in the same
+// process, so their tokens are cached and each file is read only
+// once. That is safe because the preprocessor copies the tokens of an
+// included file before it changes them.
+//
+// A cached file is checked for changes once per translation unit.
+// If its size or modification time has changed, the server also
+// compares a hash of its contents before it reads the file again.
+typedef struct {
+  Token *tok;
+  char *contents;
+  size_t mapped;
+  struct timespec mtime;
+  off_t size;
+  uint64_t hash;
+  int checked;
+} CachedFile;
+
+static HashMap header_cache;
+
+// Incremented when the cache gets a new entry.
+int cache_updates;
+
+// The tokens, and the types of string literals among them, outlive
+// the translation unit, so they are allocated from separate arenas.
+static Arena header_token_arena;
+static Arena header_type_arena;
+
+static uint64_t hash_contents(char *p) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (; *p; p++) {
+    hash ^= (unsigned char)*p;
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+// The server compiles files for clients in different directories.
+static char *cache_key(char *path) {
+  static char *cwd;
+  static int cwd_generation = -1;
+
+  if (!opt_server || path[0] == '/')
+    return path;
+
+  if (cwd_generation != generation) {
+    char buf[PATH_MAX];
+    cwd = getcwd(buf, sizeof(buf)) ? strdup(buf) : "";
+    cwd_generation = generation;
+  }
+  return format("%s/%s", cwd, path);
+}
+
+static bool is_same_file(CachedFile *cf, char *path) {
+  struct stat st;
+  if (stat(path, &st))
+    return false;
+
+  if (st.st_size != cf->size || st.st_mtim.tv_sec != cf->mtime.tv_sec ||
+      st.st_mtim.tv_nsec != cf->mtime.tv_nsec) {
+    if (!opt_server)
+      return false;
+    size_t mapped;
+    char *p = read_file(path, &mapped);
+    if (!p)
+      return false;
+    uint64_t hash = hash_contents(p);
+    free_contents(p, mapped);
+    if (hash != cf->hash)
+      return false;
+  }
+
+  cf->mtime = st.st_mtim;
+  cf->size = st.st_size;
+  return true;
+}
+
+// Returns the cached tokens of a header if the file hasn't changed
+// since it was read.
+Token *find_header(char *path) {
+  char *key = cache_key(path);
+  CachedFile *cf = hashmap_get(&header_cache, key);
+  if (!cf)
+    return NULL;
+
+  if (cf->checked != generation) {
+    if (!is_same_file(cf, path)) {
+      // Nothing refers to the old tokens once the entry is gone:
+      // each translation unit looks its headers up again.
+      hashmap_delete(&header_cache, key);
+      free_contents(cf->contents, cf->mapped);
+      free(cf);
+      return NULL;
+    }
+    cf->checked = generation;
+  }
+  return cf->tok;
+}
+
+Token *tokenize_header(char *path) {
+  Token *tok = find_header(path);
+  if (tok) {
+    // Undo #line directives of the last translation unit.
+    tok->file->line_delta = 0;
+    tok->file->display_name = tok->file->name;
+    add_input_file(tok->file);
+    return tok;
+  }
+
+  struct stat st;
+  if (stat(path, &st))
+    return NULL;
+
+  size_t mapped;
+  char *p = read_file(path, &mapped);
+  if (!p)
+    return NULL;
+
+  CachedFile *cf = calloc(1, sizeof(CachedFile));
+  cf->contents = p;
+  cf->mapped = mapped;
+  cf->mtime = st.st_mtim;
+  cf->size = st.st_size;
+  cf->checked = generation;
+  if (opt_server)
+    cf->hash = hash_contents(p);
+
+  swap_arenas(&token_arena, &header_token_arena);
+  swap_arenas(&type_arena, &header_type_arena);
+  cf->tok = tokenize_contents(path, p);
+  for (Token *t = cf->tok; t; t = t->next)
+    t->is_shared = true;
+  swap_arenas(&token_arena, &header_token_arena);
+  swap_arenas(&type_arena, &header_type_arena);
+
+  hashmap_put(&header_cache, cache_key(path), cf);
+  cache_updates++;
+  return cf->tok;
+}
+
+// Include paths are searched for every #include, and most lookups
+// fail, so instead of calling stat() for each of them, we read the
+// names in a directory once and look them up in memory. Like cached
+// headers, a directory is checked for changes by its modification
+// time once per translation unit.
+typedef struct {
+  HashMap names;
+  struct timespec mtime;
+  int checked;
+  bool is_listed;
+} CachedDir;
+
+static HashMap dir_cache;
+
+static CachedDir *read_dir(char *path) {
+  CachedDir *cd = calloc(1, sizeof(CachedDir));
+  cd->checked = generation;
+
+  struct stat st;
+  if (stat(path, &st))
+    return cd;
+  cd->mtime = st.st_mtim;
+
+  // If a directory can't be read but its files can be opened, we
+  // fall back to file_exists().
+  DIR *dir = opendir(path);
+  if (!dir)
+    return cd;
+
+  for (struct dirent *ent; (ent = readdir(dir));)
+    hashmap_put(&cd->names, strdup(ent->d_name), (void *)1);
+  closedir(dir);
+  cd->is_listed = true;
+  return cd;
+}
+
+static CachedDir *find_dir(char *path) {
+  char *key = cache_key(path);
+  CachedDir *cd = hashmap_get(&dir_cache, key);
+
+  if (cd && cd->checked != generation) {
+    struct stat st;
+    if (stat(path, &st) || st.st_mtim.tv_sec != cd->mtime.tv_sec ||
+        st.st_mtim.tv_nsec != cd->mtime.tv_nsec)
+      cd = NULL;
+    else
+      cd->checked = generation;
+  }
+
+  if (!cd) {
+    cd = read_dir(path);
+    hashmap_put(&dir_cache, key, cd);
+  }
+  return cd;
+}
+
+// Returns true if `name`, which may contain slashes, exists in `dir`.
+bool file_exists_in(char *dir, char *name) {
+  for (;;) {
+    while (*name == '/')
+      name++;
+
+    CachedDir *cd = find_dir(dir);
+    if (!cd->is_listed)
+      return file_exists(format("%s/%s", dir, name));
+
+    char *end = strchr(name, '/');
+    if (!end)
+      end = name + strlen(name);
+    if (!hashmap_get2(&cd->names, name, end - name))
+      return false;
+    if (!*end)
+      return true;
+
+    dir = format("%s/%.*s", dir, (int)(end - name), name);
+    name = end;
+  }
 }
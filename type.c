@@ -17,7 +17,7 @@ Type *ty_float = &(Type){TY_FLOAT, 4, 4};
 Type *ty_double = &(Type){TY_DOUBLE, 8, 8};
 
 static Type *new_type(TypeKind kind, int size, int align) {
-  Type *ty = calloc(1, sizeof(Type));
+  Type *ty = arena_alloc(&type_arena, sizeof(Type));
   ty->kind = kind;
   ty->size = size;
   ty->align = align;
@@ -86,7 +86,7 @@ bool is_compatible(Type *t1, Type *t2) {
 }
 
 Type *copy_type(Type *ty) {
-  Type *ret = calloc(1, sizeof(Type));
+  Type *ret = arena_alloc(&type_arena, sizeof(Type));
   *ret = *ty;
   ret->origin = ty;
   return ret;
@@ -175,16 +175,31 @@ void add_type(Node *node) {
 
   add_type(node->lhs);
   add_type(node->rhs);
-  add_type(node->cond);
-  add_type(node->then);
-  add_type(node->els);
-  add_type(node->init);
-  add_type(node->inc);
-
-  for (Node *n = node->body; n; n = n->next)
-    add_type(n);
-  for (Node *n = node->args; n; n = n->next)
-    add_type(n);
+
+  switch (node->kind) {
+  case ND_IF:
+  case ND_COND:
+  case ND_FOR:
+  case ND_DO:
+  case ND_SWITCH:
+    add_type(node->cond);
+    add_type(node->then);
+    add_type(node->els);
+    add_type(node->init);
+    add_type(node->inc);
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next)
+      add_type(n);
+    break;
+  case ND_FUNCALL:
+    for (Node *n = node->args; n; n = n->next)
+      add_type(n);
+    break;
+  default:
+    break;
+  }
 
   switch (node->kind) {
     case ND_NUM: